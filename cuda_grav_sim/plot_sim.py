@@ -1,8 +1,13 @@
 import matplotlib.pyplot as plt
 import matplotlib.animation as animation
 import numpy as np
+import mmap
+import os
+import struct
 import sys
 
+TRAJECTORY_MAGIC = b'GRAVTRJ1'
+
 def read_simulation_data(filename):
     """
     Reads the simulation data from the given filename.
@@ -33,6 +38,45 @@ def read_simulation_data(filename):
                 positions[name]['y'].append(y)
     return positions
 
+def read_trajectory(filename):
+    """
+    Maps a binary trajectory (solargraph.bin, see TrajectoryWriter in solar-sys.cu).
+    Returns (names, steps, dt, xyz): xyz has shape (frames, 3, bodies) and, for float32
+    frames, is a view of the mapped file, so nothing is read until it is used.
+    """
+    with open(filename, 'rb') as file:
+        data = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+    magic, num_bodies, stride, quantized, names_bytes, dt = struct.unpack_from('<8s4Id', data, 0)
+    if magic != TRAJECTORY_MAGIC:
+        raise ValueError(f"{filename} is not a GravSim trajectory")
+    header_bytes = struct.calcsize('<8s4Id')
+    names = [name.decode() for name in data[header_bytes:header_bytes + names_bytes].split(b'\0')[:num_bodies]]
+
+    value = np.dtype('<u2') if quantized else np.dtype('<f4')
+    values_bytes = 3 * num_bodies * value.itemsize
+    frame = np.dtype([('step', '<u8'), ('origin', '<f4', 3), ('scale', '<f4', 3),
+                      ('xyz', value, (3, num_bodies)), ('pad', 'V', (values_bytes + 7) // 8 * 8 - values_bytes)])
+    offset = header_bytes + names_bytes
+    count = (len(data) - offset) // frame.itemsize  # a frame still being written is left out
+    frames = np.frombuffer(data, dtype=frame, count=count, offset=offset)
+    if quantized:
+        xyz = frames['origin'][:, :, None] + frames['scale'][:, :, None] * frames['xyz'].astype(np.float32)
+    else:
+        xyz = frames['xyz']
+    return names, frames['step'], dt, xyz
+
+def read_positions(filename):
+    """
+    Positions from a binary trajectory or a text solargraph.dat, in the same dictionary
+    read_simulation_data returns.
+    """
+    with open(filename, 'rb') as file:
+        binary = file.read(len(TRAJECTORY_MAGIC)) == TRAJECTORY_MAGIC
+    if not binary:
+        return read_simulation_data(filename)
+    names, _, _, xyz = read_trajectory(filename)
+    return {name: {'x': xyz[:, 0, i], 'y': xyz[:, 1, i]} for i, name in enumerate(names)}
+
 def plot_trajectories(positions, selected_bodies=None, save=False, filename='trajectories.png'):
     """
     Plots the trajectories of celestial bodies.
@@ -137,9 +181,11 @@ def main():
     """
     import argparse
 
-    parser = argparse.ArgumentParser(description='Plot simulation data from solargraph.dat')
-    parser.add_argument('--file', type=str, default='solargraph.dat',
-                        help='Path to the simulation data file (default: solargraph.dat)')
+    parser = argparse.ArgumentParser(description='Plot simulation data from solargraph.bin or solargraph.dat')
+    parser.add_argument('--file', type=str,
+                        default='solargraph.bin' if os.path.exists('solargraph.bin') else 'solargraph.dat',
+                        help='Path to the simulation data file, binary or text '
+                             '(default: solargraph.bin if there is one, else solargraph.dat)')
     parser.add_argument('--plot', type=str, choices=['trajectories', 'animation'], default='trajectories',
                         help='Type of plot to generate (default: trajectories)')
     parser.add_argument('--save', action='store_true',
@@ -155,7 +201,7 @@ def main():
 
     # Read data
     print(f"Reading simulation data from {args.file}...")
-    positions = read_simulation_data(args.file)
+    positions = read_positions(args.file)
     if not positions:
         print("No data found. Exiting.")
         sys.exit(1)
@@ -1,5 +1,14 @@
+// Builds two ways (see the Makefile): nvcc gives both the CUDA and the CPU backend and
+// picks one at run time (--backend=cuda|cpu, CUDA when there is a GPU), g++ -x c++ on a
+// machine without CUDA gives the OpenMP CPU backend alone.
+#ifdef __CUDACC__
 #include <cuda.h>
 #include <cuda_runtime.h>
+#endif
+#include <omp.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <unordered_map>
@@ -9,6 +18,9 @@
 #include <sstream>
 #include <random>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <unistd.h>
 
 // There is no c++20 compatibility for the nvcc on amarel
@@ -24,9 +36,10 @@ const float G = 6.67e-11f;
 random_device rd;
 mt19937 gen(0); // Seeded for reproducibility
 uniform_real_distribution<> dis(0, 1);
+// Softening factor added to every r^2, --softening=L sets it to L^2. The default keeps
+// point masses; an L near the bodies' size keeps close encounters finite.
+float softening2 = 1e-10f;
 
-const int print_every = 100;
-const int graph_every = 1000;
 
 struct body {
     uint32_t id;
@@ -45,9 +58,26 @@ struct Bodies {
     float *old_ax, *old_ay, *old_az;
 };
 
+enum class backend {CPU, CUDA};
+enum class solver {DIRECT, BARNES_HUT}; // all pairs, or the Barnes-Hut octree (CPU)
+enum class integrator {SYMPLECTIC_EULER, BLOCK_LEAPFROG};
+
+// Block timesteps: body i steps dt / 2^level[i], level[i] between 0 and levels, chosen by
+// the step criterion with accuracy parameter eta (see GravSim::block_level)
+struct block_options {
+    int levels = 8;
+    float eta = 0.02f;
+};
+
+// Both backends compute the inverse cube of the distance as (1/r)^3: r2 * r2 * r2 overflows
+// float once bodies are more than ~2600 km apart, and rsqrtf(inf) is 0, so no force at all.
+// Both also keep the previous step's acceleration in old_a* themselves, so the host never
+// copies it.
+
+#ifdef __CUDACC__
 // CUDA Kernels
 
-__global__ void compute_acceleration_kernel(int n, Bodies bodies) {
+__global__ void compute_acceleration_kernel(int n, Bodies bodies, float eps2) {
     int i = blockIdx.x * blockDim.x + threadIdx.x;
     if (i >= n) return;
 
@@ -66,14 +96,18 @@ __global__ void compute_acceleration_kernel(int n, Bodies bodies) {
         float dy = bodies.y[j] - y1;
         float dz = bodies.z[j] - z1;
 
-        float r2 = dx * dx + dy * dy + dz * dz + 1e-10f; // Softening factor
-        float inv_r3 = rsqrtf(r2 * r2 * r2); // Inverse of r^3
+        float r2 = dx * dx + dy * dy + dz * dz + eps2; // Softening factor
+        float inv_r = rsqrtf(r2);
+        float inv_r3 = inv_r * inv_r * inv_r; // Inverse of r^3
 
         ax += bodies.Gm[j] * dx * inv_r3;
         ay += bodies.Gm[j] * dy * inv_r3;
         az += bodies.Gm[j] * dz * inv_r3;
     }
 
+    bodies.old_ax[i] = bodies.ax[i];
+    bodies.old_ay[i] = bodies.ay[i];
+    bodies.old_az[i] = bodies.az[i];
     bodies.ax[i] = ax;
     bodies.ay[i] = ay;
     bodies.az[i] = az;
@@ -93,37 +127,735 @@ __global__ void step_forward_kernel(int n, Bodies bodies, float dt) {
     bodies.y[i] += bodies.vy[i] * dt;
     bodies.z[i] += bodies.vz[i] * dt;
 }
+#endif
+
+// CPU backend
+
+// Accelerations of bodies [begin, end) from all n, begin/end other than 0/n only for
+// benchmarking; with active, of bodies active[begin..end) instead, the ones the block
+// timestep integrator moves at a substep. Threads take blocks of CPU_I_BLOCK bodies; a
+// block walks the others in tiles of CPU_J_TILE, whose x, y, z and Gm (16 KB) stay in L1
+// while every body of the block is summed against them in an omp simd j-loop. There is
+// no i == j test: r2 = 0 only for the body itself (or one at the same spot, with no
+// softening), and a select makes its inv_r 0 so the loop stays branch-free.
+const int CPU_I_BLOCK = 64;
+const int CPU_J_TILE = 1024;
+
+void compute_acceleration_cpu(int n, Bodies bodies, int begin, int end, const int *active = nullptr) {
+    const float eps2 = softening2;
+    #pragma omp parallel for schedule(dynamic)
+    for (int ib = begin; ib < end; ib += CPU_I_BLOCK) {
+        int ie = min(ib + CPU_I_BLOCK, end);
+        float ax[CPU_I_BLOCK] = {}, ay[CPU_I_BLOCK] = {}, az[CPU_I_BLOCK] = {};
+        for (int jb = 0; jb < n; jb += CPU_J_TILE) {
+            int je = min(jb + CPU_J_TILE, n);
+            for (int r = ib; r < ie; r++) {
+                int i = active ? active[r] : r;
+                float x1 = bodies.x[i];
+                float y1 = bodies.y[i];
+                float z1 = bodies.z[i];
+                float sx = 0.0f, sy = 0.0f, sz = 0.0f;
+                #pragma omp simd reduction(+:sx, sy, sz)
+                for (int j = jb; j < je; j++) {
+                    float dx = bodies.x[j] - x1;
+                    float dy = bodies.y[j] - y1;
+                    float dz = bodies.z[j] - z1;
+                    float r2 = dx * dx + dy * dy + dz * dz + eps2; // Softening factor
+                    float inv_r = r2 > 0.0f ? 1.0f / sqrtf(r2) : 0.0f; // 0 for itself
+                    float s = bodies.Gm[j] * inv_r * inv_r * inv_r;
+                    sx += s * dx;
+                    sy += s * dy;
+                    sz += s * dz;
+                }
+                ax[r - ib] += sx;
+                ay[r - ib] += sy;
+                az[r - ib] += sz;
+            }
+        }
+        for (int r = ib; r < ie; r++) {
+            int i = active ? active[r] : r;
+            bodies.old_ax[i] = bodies.ax[i];
+            bodies.old_ay[i] = bodies.ay[i];
+            bodies.old_az[i] = bodies.az[i];
+            bodies.ax[i] = ax[r - ib];
+            bodies.ay[i] = ay[r - ib];
+            bodies.az[i] = az[r - ib];
+        }
+    }
+}
+
+void step_forward_cpu(int n, Bodies bodies, float dt) {
+    #pragma omp parallel for simd schedule(static)
+    for (int i = 0; i < n; i++) {
+        // Update velocities
+        bodies.vx[i] += bodies.ax[i] * dt;
+        bodies.vy[i] += bodies.ay[i] * dt;
+        bodies.vz[i] += bodies.az[i] * dt;
+
+        // Update positions
+        bodies.x[i] += bodies.vx[i] * dt;
+        bodies.y[i] += bodies.vy[i] * dt;
+        bodies.z[i] += bodies.vz[i] * dt;
+    }
+}
+
+// Barnes-Hut
+
+// O(n log n) alternative to the all-pairs sum for large n. Bodies are grouped in an octree,
+// and a cell whose side is small next to its distance (side / distance < theta) pulls like
+// one body at its centre of mass, so a body opens only the few cells near it; theta = 0
+// opens everything and gives the all-pairs sum back. The tree is rebuilt from scratch
+// every step, all of it in parallel:
+//   - bodies are sorted by the 63-bit Morton code of their position (parallel LSD radix
+//     sort), which makes every octree cell one contiguous range of the sorted order and
+//     puts bodies that are close in space next to each other in memory
+//   - the cells at depth BH_TASK_DEPTH are built as independent subtrees by different
+//     threads and spliced together under the few cells above them
+//   - nodes are stored depth first, each with the index of the node after its subtree, so
+//     a walk is one forward pass over the array that jumps over the subtrees it accepts
+// Bodies are walked in sorted order, so neighbouring walks touch the same nodes.
+struct bh_node {
+    float cx, cy, cz;  // centre of mass
+    float Gm;          // total of the cell
+    float size2;       // side of the cell, squared
+    int next;          // index of the node after this subtree
+    int first, count;  // a leaf's bodies in sorted order, count == 0 for inner nodes
+};
+
+const int BH_LEAF_SIZE = 16;
+const int BH_MAX_DEPTH = 21;   // 21 bits per axis in a 63-bit Morton code
+const int BH_TASK_DEPTH = 3;   // up to 512 subtrees built in parallel
+
+class BarnesHut {
+public:
+    float theta;
+    double build_seconds = 0, walk_seconds = 0; // of the last compute()
+
+    explicit BarnesHut(float theta_param = 0.5f) : theta(theta_param) {}
+    // accelerations of all n bodies, or of the count in active, the previous ones saved to
+    // old_a* like the all-pairs backends do
+    void compute(int n, Bodies bodies, const int *active = nullptr, int count = 0);
+    size_t num_nodes() const { return nodes.size(); }
+private:
+    struct subtree {
+        int b, e, d;             // cell [b, e) of the sorted bodies at depth d
+        vector<bh_node> nodes;   // next relative to the subtree
+        int offset;              // of its root in nodes
+    };
+    vector<uint64_t> keys, keys_tmp;
+    vector<int> order, order_tmp;     // body at each sorted position
+    vector<int> rank;                 // sorted position of each body, to walk active ones
+    vector<float> sx, sy, sz, sGm;    // bodies in sorted order
+    vector<bh_node> nodes;
+    vector<subtree> subtrees;
+    float root_side = 0;
+
+    void build(int n, Bodies bodies);
+    void sort_by_key(int n);
+    bool is_leaf(int b, int e, int d) const { return e - b <= BH_LEAF_SIZE || d == BH_MAX_DEPTH; }
+    int child_end(int b, int e, int d, int c) const;
+    bh_node leaf(int b, int e, int d) const;
+    bh_node inner(const vector<bh_node> &out, int k, int d) const;
+    void build_subtree(vector<bh_node> &out, int b, int e, int d) const;
+    void collect_subtrees(int b, int e, int d);
+    void place(int b, int e, int d, int &next_subtree);
+};
+
+// the low 21 bits of v moved to every third bit
+static uint64_t spread_bits(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+// LSD radix sort of (keys, order), a byte per pass. Each thread counts and scatters its
+// own slice of the input, slices land in thread order so every pass is stable.
+void BarnesHut::sort_by_key(int n) {
+    keys_tmp.resize(n);
+    order_tmp.resize(n);
+    vector<int> counts(omp_get_max_threads() * 256);
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num(), threads = omp_get_num_threads();
+        int lo = int(int64_t(n) * t / threads), hi = int(int64_t(n) * (t + 1) / threads);
+        int *mine = &counts[t * 256];
+        for (int shift = 0; shift < 64; shift += 8) {
+            fill(mine, mine + 256, 0);
+            for (int i = lo; i < hi; i++) mine[(keys[i] >> shift) & 255]++;
+            #pragma omp barrier
+            #pragma omp single
+            {
+                int sum = 0;
+                for (int bucket = 0; bucket < 256; bucket++) {
+                    for (int u = 0; u < threads; u++) {
+                        int c = counts[u * 256 + bucket];
+                        counts[u * 256 + bucket] = sum;
+                        sum += c;
+                    }
+                }
+            }
+            for (int i = lo; i < hi; i++) {
+                int pos = mine[(keys[i] >> shift) & 255]++;
+                keys_tmp[pos] = keys[i];
+                order_tmp[pos] = order[i];
+            }
+            #pragma omp barrier
+            #pragma omp single
+            {
+                keys.swap(keys_tmp);
+                order.swap(order_tmp);
+            }
+        }
+    }
+}
+
+// end of child c of cell [b, e) at depth d: keys in a cell share everything above digit
+// d, so its children are consecutive runs of that digit
+int BarnesHut::child_end(int b, int e, int d, int c) const {
+    int shift = 3 * (BH_MAX_DEPTH - 1 - d);
+    return int(partition_point(keys.begin() + b, keys.begin() + e,
+                               [&](uint64_t key) { return int(key >> shift & 7) <= c; }) - keys.begin());
+}
+
+bh_node BarnesHut::leaf(int b, int e, int d) const {
+    float side = ldexpf(root_side, -d);
+    double m = 0, mx = 0, my = 0, mz = 0;
+    for (int j = b; j < e; j++) {
+        m += sGm[j];
+        mx += double(sGm[j]) * sx[j];
+        my += double(sGm[j]) * sy[j];
+        mz += double(sGm[j]) * sz[j];
+    }
+    if (m <= 0) return {sx[b], sy[b], sz[b], 0.0f, side * side, 1, b, e - b};
+    return {float(mx / m), float(my / m), float(mz / m), float(m), side * side, 1, b, e - b};
+}
+
+// inner node k of out from its children, which follow it up to out.size()
+bh_node BarnesHut::inner(const vector<bh_node> &out, int k, int d) const {
+    float side = ldexpf(root_side, -d);
+    double m = 0, mx = 0, my = 0, mz = 0;
+    for (int c = k + 1; c < int(out.size()); c = out[c].next) {
+        m += out[c].Gm;
+        mx += double(out[c].Gm) * out[c].cx;
+        my += double(out[c].Gm) * out[c].cy;
+        mz += double(out[c].Gm) * out[c].cz;
+    }
+    int next = int(out.size());
+    if (m <= 0) return {out[k + 1].cx, out[k + 1].cy, out[k + 1].cz, 0.0f, side * side, next, 0, 0};
+    return {float(mx / m), float(my / m), float(mz / m), float(m), side * side, next, 0, 0};
+}
+
+// appends the subtree of cell [b, e) at depth d to out, next counted from out[0]
+void BarnesHut::build_subtree(vector<bh_node> &out, int b, int e, int d) const {
+    int k = int(out.size());
+    if (is_leaf(b, e, d)) {
+        out.push_back(leaf(b, e, d));
+        out[k].next = k + 1;
+        return;
+    }
+    out.push_back({});
+    for (int c = 0, cb = b; cb < e; c++) {
+        int ce = child_end(cb, e, d, c);
+        if (ce > cb) build_subtree(out, cb, ce, d + 1);
+        cb = ce;
+    }
+    out[k] = inner(out, k, d);
+}
+
+// the cells built as separate subtrees, depth first
+void BarnesHut::collect_subtrees(int b, int e, int d) {
+    if (d == BH_TASK_DEPTH || is_leaf(b, e, d)) {
+        subtrees.push_back({b, e, d, {}, 0});
+        return;
+    }
+    for (int c = 0, cb = b; cb < e; c++) {
+        int ce = child_end(cb, e, d, c);
+        if (ce > cb) collect_subtrees(cb, ce, d + 1);
+        cb = ce;
+    }
+}
+
+// The cells above the subtrees, laid out in nodes in the same order as collect_subtrees.
+// Each subtree gets its offset and room in nodes; only its root is filled in here, for
+// the centre of mass of the cells above it.
+void BarnesHut::place(int b, int e, int d, int &next_subtree) {
+    int k = int(nodes.size());
+    if (d == BH_TASK_DEPTH || is_leaf(b, e, d)) {
+        subtree &t = subtrees[next_subtree++];
+        t.offset = k;
+        nodes.resize(k + t.nodes.size());
+        nodes[k] = t.nodes[0];
+        nodes[k].next = int(nodes.size());
+        return;
+    }
+    nodes.push_back({});
+    for (int c = 0, cb = b; cb < e; c++) {
+        int ce = child_end(cb, e, d, c);
+        if (ce > cb) place(cb, ce, d + 1, next_subtree);
+        cb = ce;
+    }
+    nodes[k] = inner(nodes, k, d);
+}
+
+void BarnesHut::build(int n, Bodies bodies) {
+    // Bounding cube, a bit larger than the bodies so none sits on its far faces
+    float min_x = INFINITY, min_y = INFINITY, min_z = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY, max_z = -INFINITY;
+    #pragma omp parallel for reduction(min:min_x, min_y, min_z) reduction(max:max_x, max_y, max_z)
+    for (int i = 0; i < n; i++) {
+        min_x = min(min_x, bodies.x[i]); max_x = max(max_x, bodies.x[i]);
+        min_y = min(min_y, bodies.y[i]); max_y = max(max_y, bodies.y[i]);
+        min_z = min(min_z, bodies.z[i]); max_z = max(max_z, bodies.z[i]);
+    }
+    root_side = max({max_x - min_x, max_y - min_y, max_z - min_z, 1.0f}) * 1.0001f;
+    float scale = float(1 << BH_MAX_DEPTH) / root_side;
+
+    keys.resize(n);
+    order.resize(n);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        const uint64_t top = (1 << BH_MAX_DEPTH) - 1;
+        uint64_t ix = min(top, uint64_t((bodies.x[i] - min_x) * scale));
+        uint64_t iy = min(top, uint64_t((bodies.y[i] - min_y) * scale));
+        uint64_t iz = min(top, uint64_t((bodies.z[i] - min_z) * scale));
+        keys[i] = spread_bits(ix) << 2 | spread_bits(iy) << 1 | spread_bits(iz);
+        order[i] = i;
+    }
+    sort_by_key(n);
+
+    sx.resize(n); sy.resize(n); sz.resize(n); sGm.resize(n);
+    #pragma omp parallel for schedule(static)
+    for (int s = 0; s < n; s++) {
+        int i = order[s];
+        sx[s] = bodies.x[i];
+        sy[s] = bodies.y[i];
+        sz[s] = bodies.z[i];
+        sGm[s] = bodies.Gm[i];
+    }
+
+    subtrees.clear();
+    collect_subtrees(0, n, 0);
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < int(subtrees.size()); t++) {
+        build_subtree(subtrees[t].nodes, subtrees[t].b, subtrees[t].e, subtrees[t].d);
+    }
+    nodes.clear();
+    int next_subtree = 0;
+    place(0, n, 0, next_subtree);
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < int(subtrees.size()); t++) {
+        const subtree &sub = subtrees[t];
+        for (size_t k = 1; k < sub.nodes.size(); k++) {
+            nodes[sub.offset + k] = sub.nodes[k];
+            nodes[sub.offset + k].next += sub.offset;
+        }
+    }
+}
+
+void BarnesHut::compute(int n, Bodies bodies, const int *active, int count) {
+    if (n == 0) return;
+    double start = omp_get_wtime();
+    build(n, bodies);
+    if (active) {
+        rank.resize(n);
+        #pragma omp parallel for schedule(static)
+        for (int s = 0; s < n; s++) rank[order[s]] = s;
+    }
+    double built = omp_get_wtime();
+
+    float theta2 = theta * theta;
+    const float eps2 = softening2;
+    int num = int(nodes.size());
+    int walks = active ? count : n;
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int w = 0; w < walks; w++) {
+        int s = active ? rank[active[w]] : w;
+        float x1 = sx[s], y1 = sy[s], z1 = sz[s];
+        float ax = 0.0f, ay = 0.0f, az = 0.0f;
+        for (int k = 0; k < num; ) {
+            const bh_node &node = nodes[k];
+            float dx = node.cx - x1;
+            float dy = node.cy - y1;
+            float dz = node.cz - z1;
+            float d2 = dx * dx + dy * dy + dz * dz;
+            if (node.size2 < theta2 * d2) { // far enough, the whole cell at once
+                float r2 = d2 + eps2; // Softening factor
+                float inv_r = 1.0f / sqrtf(r2);
+                float f = node.Gm * inv_r * inv_r * inv_r;
+                ax += f * dx;
+                ay += f * dy;
+                az += f * dz;
+                k = node.next;
+            } else if (node.count > 0) { // a leaf too close, its bodies one by one
+                float lx = 0.0f, ly = 0.0f, lz = 0.0f;
+                int je = node.first + node.count;
+                #pragma omp simd reduction(+:lx, ly, lz)
+                for (int j = node.first; j < je; j++) {
+                    float ex = sx[j] - x1;
+                    float ey = sy[j] - y1;
+                    float ez = sz[j] - z1;
+                    float r2 = ex * ex + ey * ey + ez * ez + eps2;
+                    float inv_r = r2 > 0.0f ? 1.0f / sqrtf(r2) : 0.0f;
+                    float f = sGm[j] * inv_r * inv_r * inv_r;
+                    lx += f * ex;
+                    ly += f * ey;
+                    lz += f * ez;
+                }
+                ax += lx;
+                ay += ly;
+                az += lz;
+                k = node.next;
+            } else { // open the cell
+                k++;
+            }
+        }
+        int i = order[s];
+        bodies.old_ax[i] = bodies.ax[i];
+        bodies.old_ay[i] = bodies.ay[i];
+        bodies.old_az[i] = bodies.az[i];
+        bodies.ax[i] = ax;
+        bodies.ay[i] = ay;
+        bodies.az[i] = az;
+    }
+    build_seconds = built - start;
+    walk_seconds = omp_get_wtime() - built;
+}
+
+// Body arrays
+
+// n floats for the backend: Unified Memory for CUDA https://www.olcf.ornl.gov/wp-content/uploads/2019/06/06_Managed_Memory.pdf
+// so the host can print them, 64-byte aligned host memory for the CPU
+float* alloc_array(int n, backend where, const char what[]) {
+    float *p = nullptr;
+    (void)where;
+#ifdef __CUDACC__
+    if (where == backend::CUDA) {
+        cudaError_t err = cudaMallocManaged(&p, n * sizeof(float));
+        if (err != cudaSuccess) { cerr << "CUDA malloc error (" << what << "): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
+        return p;
+    }
+#endif
+    p = static_cast<float*>(aligned_alloc(64, (n * sizeof(float) + 63) / 64 * 64));
+    if (p == nullptr) { cerr << "malloc error (" << what << ")" << endl; exit(EXIT_FAILURE); }
+    return p;
+}
+
+void free_array(float *p, backend where) {
+    (void)where;
+#ifdef __CUDACC__
+    if (where == backend::CUDA) {
+        cudaFree(p);
+        return;
+    }
+#endif
+    free(p);
+}
+
+Bodies alloc_bodies(int n, backend where) {
+    Bodies b;
+    b.Gm = alloc_array(n, where, "Gm");
+    b.x = alloc_array(n, where, "x");
+    b.y = alloc_array(n, where, "y");
+    b.z = alloc_array(n, where, "z");
+    b.vx = alloc_array(n, where, "vx");
+    b.vy = alloc_array(n, where, "vy");
+    b.vz = alloc_array(n, where, "vz");
+    b.ax = alloc_array(n, where, "ax");
+    b.ay = alloc_array(n, where, "ay");
+    b.az = alloc_array(n, where, "az");
+    b.old_ax = alloc_array(n, where, "old_ax");
+    b.old_ay = alloc_array(n, where, "old_ay");
+    b.old_az = alloc_array(n, where, "old_az");
+    return b;
+}
+
+void free_bodies(Bodies &b, backend where) {
+    for (float *p : {b.Gm, b.x, b.y, b.z, b.vx, b.vy, b.vz, b.ax, b.ay, b.az, b.old_ax, b.old_ay, b.old_az}) {
+        free_array(p, where);
+    }
+}
+
+// CUDA when built with nvcc and a GPU is present, otherwise the CPU
+backend default_backend() {
+#ifdef __CUDACC__
+    int devices = 0;
+    if (cudaGetDeviceCount(&devices) == cudaSuccess && devices > 0) return backend::CUDA;
+#endif
+    return backend::CPU;
+}
+
+// Trajectory output
+
+// Snapshots for solargraph.* and the periodic printout are written by a background thread:
+// the simulation only copies the positions (and velocities, to print) into one of two
+// snapshot buffers and goes on, while the other buffer is formatted and written. It waits
+// only when the writer is still busy with the snapshot before last.
+//
+// Binary trajectories (solargraph.bin) are a header, the body names, then frames of a fixed
+// size, so a reader can map the file and index frames directly (plot_sim.py does):
+//   trajectory_header
+//   names: num_bodies NUL-terminated names, names_bytes in all, padded to 8 bytes
+//   frames: trajectory_frame_header, then x[num_bodies], y[..], z[..] as float32, or as
+//           uint16 with x = origin[0] + scale[0] * q when quantized; padded to 8 bytes
+// Frames hold every stride-th body. Text trajectories (solargraph.dat) are the old format,
+// a line per frame of "name x y z" for each body.
+struct trajectory_options {
+    bool binary = true;     // solargraph.bin, or text in solargraph.dat
+    int stride = 1;         // every stride-th body in the binary frames
+    bool quantize = false;  // 16-bit positions relative to the frame's bounding box
+};
+
+struct trajectory_header {
+    char magic[8];          // "GRAVTRJ1"
+    uint32_t num_bodies;    // in every frame
+    uint32_t stride;        // of the simulation's bodies
+    uint32_t quantized;     // 0: float32 positions, 1: uint16
+    uint32_t names_bytes;
+    double dt;              // seconds per simulation step
+};
+
+struct trajectory_frame_header {
+    uint64_t step;
+    float origin[3];        // 0 and
+    float scale[3];         // 1 for float32 positions
+};
+
+class TrajectoryWriter {
+public:
+    TrajectoryWriter() = default;
+    ~TrajectoryWriter() { close(); }
+    TrajectoryWriter(const TrajectoryWriter &orig) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter &rhs) = delete;
+
+    void open(const vector<string> &body_names, float dt, trajectory_options options_param);
+    // Copies the state of the n bodies at step for the writer thread: a trajectory frame
+    // when graph, the printout when print.
+    void submit(uint64_t step, int n, Bodies bodies, bool graph, bool print);
+    // waits until everything submitted is written
+    void flush();
+    void close();
+private:
+    struct snapshot {
+        uint64_t step;
+        bool graph, print;
+        vector<float> x, y, z, vx, vy, vz;
+    };
+    trajectory_options options;
+    vector<string> names;
+    ofstream file;
+    vector<char> frame;        // one encoded binary frame
+    snapshot buffers[2];
+    int filling = 0;           // buffer the simulation copies into next
+    int pending = -1;          // buffer waiting for the writer thread
+    int writing = -1;          // buffer the writer thread is on
+    bool done = false;
+    mutex lock;
+    condition_variable changed;
+    thread writer;
+
+    void run();
+    void write_frame(const snapshot &s);
+    void print_snapshot(const snapshot &s);
+};
+
+void TrajectoryWriter::open(const vector<string> &body_names, float dt, trajectory_options options_param) {
+    options = options_param;
+    options.stride = max(options.stride, 1);
+    names = body_names;
+    file.open(options.binary ? "solargraph.bin" : "solargraph.dat", options.binary ? ios::binary : ios::out);
+    if (!file.is_open()) {
+        cerr << "Failed to open trajectory file" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (options.binary) {
+        string name_block;
+        uint32_t m = 0;
+        for (size_t i = 0; i < names.size(); i += options.stride, m++) {
+            name_block += names[i];
+            name_block += '\0';
+        }
+        name_block.resize((name_block.size() + 7) / 8 * 8, '\0');
+        trajectory_header header = {{'G', 'R', 'A', 'V', 'T', 'R', 'J', '1'}, m, uint32_t(options.stride),
+                                    options.quantize ? 1u : 0u, uint32_t(name_block.size()), dt};
+        file.write(reinterpret_cast<const char*>(&header), sizeof header);
+        file.write(name_block.data(), name_block.size());
+    }
+    done = false;
+    writer = thread(&TrajectoryWriter::run, this);
+}
+
+void TrajectoryWriter::submit(uint64_t step, int n, Bodies bodies, bool graph, bool print) {
+    snapshot &s = buffers[filling];
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&] { return writing != filling && pending != filling; });
+    }
+    s.step = step;
+    s.graph = graph;
+    s.print = print;
+    s.x.assign(bodies.x, bodies.x + n);
+    s.y.assign(bodies.y, bodies.y + n);
+    s.z.assign(bodies.z, bodies.z + n);
+    if (print) {
+        s.vx.assign(bodies.vx, bodies.vx + n);
+        s.vy.assign(bodies.vy, bodies.vy + n);
+        s.vz.assign(bodies.vz, bodies.vz + n);
+    }
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&] { return pending == -1; });
+        pending = filling;
+    }
+    changed.notify_all();
+    filling ^= 1;
+}
+
+void TrajectoryWriter::flush() {
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [&] { return pending == -1 && writing == -1; });
+    file.flush();
+    cout.flush();
+}
+
+void TrajectoryWriter::close() {
+    if (!writer.joinable()) return;
+    {
+        lock_guard<mutex> guard(lock);
+        done = true;
+    }
+    changed.notify_all();
+    writer.join();
+    file.close();
+}
+
+void TrajectoryWriter::run() {
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        changed.wait(guard, [&] { return pending != -1 || done; });
+        if (pending == -1) return;
+        writing = pending;
+        pending = -1;
+        guard.unlock();
+        changed.notify_all();
+        const snapshot &s = buffers[writing];
+        if (s.graph) write_frame(s);
+        if (s.print) print_snapshot(s);
+        guard.lock();
+        writing = -1;
+        changed.notify_all();
+    }
+}
+
+void TrajectoryWriter::write_frame(const snapshot &s) {
+    int n = int(s.x.size());
+    if (!options.binary) {
+        for (int i = 0; i < n; i++) {
+            file << names[i] << ' ' << s.x[i] << ' ' << s.y[i] << ' ' << s.z[i] << ' ';
+        }
+        file << '\n';
+        return;
+    }
+    int m = (n + options.stride - 1) / options.stride;
+    size_t value_bytes = options.quantize ? sizeof(uint16_t) : sizeof(float);
+    frame.assign(sizeof(trajectory_frame_header) + (3 * m * value_bytes + 7) / 8 * 8, '\0');
+    trajectory_frame_header header = {s.step, {0, 0, 0}, {1, 1, 1}};
+    const vector<float> *axes[3] = {&s.x, &s.y, &s.z};
+    char *values = frame.data() + sizeof header;
+    for (int a = 0; a < 3; a++) {
+        const vector<float> &v = *axes[a];
+        if (!options.quantize) {
+            float *out = reinterpret_cast<float*>(values) + size_t(a) * m;
+            for (int k = 0; k < m; k++) out[k] = v[size_t(k) * options.stride];
+            continue;
+        }
+        float lo = INFINITY, hi = -INFINITY;
+        for (int k = 0; k < m; k++) {
+            lo = min(lo, v[size_t(k) * options.stride]);
+            hi = max(hi, v[size_t(k) * options.stride]);
+        }
+        float scale = hi > lo ? (hi - lo) / 65535.0f : 1.0f;
+        header.origin[a] = lo;
+        header.scale[a] = scale;
+        uint16_t *out = reinterpret_cast<uint16_t*>(values) + size_t(a) * m;
+        for (int k = 0; k < m; k++) {
+            float q = (v[size_t(k) * options.stride] - lo) / scale;
+            out[k] = uint16_t(min(65535.0f, max(0.0f, roundf(q))));
+        }
+    }
+    memcpy(frame.data(), &header, sizeof header);
+    file.write(frame.data(), frame.size());
+}
+
+void TrajectoryWriter::print_snapshot(const snapshot &s) {
+    for (size_t i = 0; i < s.x.size(); i++) {
+        cout << names[i] << " "
+             << s.x[i] << ","
+             << s.y[i] << ","
+             << s.z[i] << "   "
+             << s.vx[i] << ","
+             << s.vy[i] << ","
+             << s.vz[i] << '\n';
+    }
+}
 
 class GravSim {
 public:
     bool verbose;
     enum class configuration {CIRCULAR, ELLIPTICAL_2D, CIRCULAR_RANDOM, ELLIPTICAL_3D};
 private:
-    ofstream graphfile;
+    TrajectoryWriter trajectory;
     vector<string> names;
     unordered_map<string, uint32_t> orbit_map;
     vector<struct body> bodies;
 
     Bodies device_bodies;
+    backend where;
+    solver method;
+    BarnesHut tree;
+    integrator scheme;
+    block_options blocks;
+    vector<int> level;       // block timestep level of each body
+    vector<int> active;      // bodies whose block step ends at the current substep
     int n; // # of bodies
     float dt;
     uint64_t num_steps;
     uint64_t timestep;
+    uint32_t print_every, graph_every;
+    uint64_t force_evaluations = 0; // accelerations computed, one per body
+    double elapsed_seconds = 0;
+    bool track_energy;              // O(n^2) energy before and after, --energy
+    double relative_energy_error = 0;
 
     void read_line(ifstream &infile, configuration config);
     void add_body(const string& name, uint32_t orbiting_body, float m, float x, float y, float z, float vx, float vy, float vz);
     void add_body_circular(const string& name, uint32_t orbiting_body, float m, float a, float e, float orbPeriod);
     void add_body_circular_random(const string& name, uint32_t orbiting_body, float m, float a, float e, float orbPeriod);
     void add_body_elliptical(const string& name, uint32_t orbiting_body, float m, float a, float e, float orbPeriod);
+    int block_level(int i, float h, int substep) const;
+    void start_block();
+    void step_block();
+    double energy() const;
 public:
-    GravSim(const char filename[], float timestep_dt, float duration, bool verbose_flag, uint32_t print_every, uint32_t graph_every, configuration config);
+    GravSim(const char filename[], float timestep_dt, float duration, bool verbose_flag, uint32_t print_every, uint32_t graph_every, configuration config, backend where_param = default_backend(), solver method_param = solver::DIRECT, float theta = 0.5f, trajectory_options output = {}, integrator scheme_param = integrator::SYMPLECTIC_EULER, block_options blocks_param = {}, bool track_energy_param = false);
     ~GravSim();
     GravSim(const GravSim &orig) = delete;
     GravSim& operator=(const GravSim &rhs) = delete;
+    // of all bodies, or only of the count in active
+    void compute_acceleration(const int *active = nullptr, int count = 0);
+    void step_forward(float dt);
+#ifdef __CUDACC__
     void compute_acceleration_cuda(int threads_per_block = 256);
     void step_forward_cuda(float dt, int threads_per_block = 256);
-    void print_system() const;
+#endif
+    void print_system();
     void graph_system();
+    uint64_t force_evaluation_count() const { return force_evaluations; }
+    double seconds() const { return elapsed_seconds; }
+    double energy_error() const { return relative_energy_error; }
 };
 
 // GravSim Methods
@@ -188,8 +920,9 @@ void GravSim::read_line(ifstream &infile, configuration config) {
     }
 }
 
-GravSim::GravSim(const char filename[], float timestep_dt, float duration, bool verbose_flag, uint32_t print_every_param, uint32_t graph_every_param, configuration config) 
-    : verbose(verbose_flag), graphfile("solargraph.dat"), dt(timestep_dt), num_steps(duration / timestep_dt), timestep(0) {
+GravSim::GravSim(const char filename[], float timestep_dt, float duration, bool verbose_flag, uint32_t print_every_param, uint32_t graph_every_param, configuration config, backend where_param, solver method_param, float theta, trajectory_options output, integrator scheme_param, block_options blocks_param, bool track_energy_param) 
+    : verbose(verbose_flag), where(where_param), method(method_param), tree(theta), scheme(scheme_param), blocks(blocks_param), dt(timestep_dt), num_steps(duration / timestep_dt), timestep(0),
+      print_every(max(print_every_param, 1u)), graph_every(max(graph_every_param, 1u)), track_energy(track_energy_param) {
 
     ifstream infile(filename);
     if (!infile.is_open()) {
@@ -203,34 +936,7 @@ GravSim::GravSim(const char filename[], float timestep_dt, float duration, bool
 
     n = bodies.size();
 
-    // Allocate Unified Memory https://www.olcf.ornl.gov/wp-content/uploads/2019/06/06_Managed_Memory.pdf
-    cudaError_t err;
-    err = cudaMallocManaged(&device_bodies.Gm, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (Gm): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.x, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (x): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.y, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (y): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.z, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (z): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.vx, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (vx): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.vy, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (vy): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.vz, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (vz): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.ax, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (ax): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.ay, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (ay): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.az, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (az): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.old_ax, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (old_ax): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.old_ay, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (old_ay): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
-    err = cudaMallocManaged(&device_bodies.old_az, n * sizeof(float));
-    if (err != cudaSuccess) { cerr << "CUDA malloc error (old_az): " << cudaGetErrorString(err) << endl; exit(EXIT_FAILURE); }
+    device_bodies = alloc_bodies(n, where);
 
     for (int i = 0; i < n; i++) {
         device_bodies.Gm[i] = bodies[i].Gm;
@@ -247,20 +953,25 @@ GravSim::GravSim(const char filename[], float timestep_dt, float duration, bool
         device_bodies.old_ay[i] = bodies[i].old_ay;
         device_bodies.old_az[i] = bodies[i].old_az;
     }
+    trajectory.open(names, dt, output);
 
     // Main simulation loop
-    cout << "Starting simulation with " << n << " bodies, num_steps=" << num_steps << endl;
+    cout << "Starting simulation with " << n << " bodies, num_steps=" << num_steps
+         << ", backend=" << (where == backend::CUDA ? "cuda" : "cpu");
+    if (method == solver::BARNES_HUT) cout << ", solver=barnes-hut, theta=" << tree.theta;
+    if (scheme == integrator::BLOCK_LEAPFROG) cout << ", block timesteps dt/2^0..dt/2^" << blocks.levels << ", eta=" << blocks.eta;
+    cout << endl;
+    double start_energy = track_energy ? energy() : 0;
+    auto start = chrono::high_resolution_clock::now();
+    if (scheme == integrator::BLOCK_LEAPFROG) start_block();
     for (int i = 0; i < num_steps; i++) {
-        // Old accelerations
-        for (int j = 0; j < n; j++) {
-            device_bodies.old_ax[j] = device_bodies.ax[j];
-            device_bodies.old_ay[j] = device_bodies.ay[j];
-            device_bodies.old_az[j] = device_bodies.az[j];
-        }
+        if (scheme == integrator::BLOCK_LEAPFROG) {
+            step_block();
+        } else {
+            compute_acceleration(); // also keeps the old accelerations
 
-        compute_acceleration_cuda();
-
-        step_forward_cuda(dt);
+            step_forward(dt);
+        }
 
         if (verbose) {
             timestep = i;
@@ -273,29 +984,165 @@ GravSim::GravSim(const char filename[], float timestep_dt, float duration, bool
         }
     }
 
-    cudaDeviceSynchronize();
+#ifdef __CUDACC__
+    if (where == backend::CUDA) cudaDeviceSynchronize();
+#endif
+    trajectory.flush();
+    chrono::duration<double> elapsed = chrono::high_resolution_clock::now() - start;
+    elapsed_seconds = elapsed.count();
+    if (track_energy && start_energy != 0) relative_energy_error = fabs((energy() - start_energy) / start_energy);
+    cout << "Simulated " << num_steps << " steps in " << elapsed.count() << " seconds, "
+         << double(n) * force_evaluations / elapsed.count() << " interactions/s"
+         << (method == solver::BARNES_HUT ? " (all-pairs equivalent)" : "") << ", " << force_evaluations
+         << " force evaluations";
+    if (scheme == integrator::BLOCK_LEAPFROG && n > 0) {
+        double finest = double(n) * (num_steps * (uint64_t(1) << blocks.levels) + 1);
+        cout << " (" << 100.0 * (1.0 - force_evaluations / finest) << "% fewer than every body at dt/2^" << blocks.levels << ")";
+    }
+    if (track_energy) cout << ", relative energy error " << relative_energy_error;
+    cout << endl;
 }
 
 GravSim::~GravSim() {
-    // Free Unified Memory
-    cudaFree(device_bodies.Gm);
-    cudaFree(device_bodies.x);
-    cudaFree(device_bodies.y);
-    cudaFree(device_bodies.z);
-    cudaFree(device_bodies.vx);
-    cudaFree(device_bodies.vy);
-    cudaFree(device_bodies.vz);
-    cudaFree(device_bodies.ax);
-    cudaFree(device_bodies.ay);
-    cudaFree(device_bodies.az);
-    cudaFree(device_bodies.old_ax);
-    cudaFree(device_bodies.old_ay);
-    cudaFree(device_bodies.old_az);
+    free_bodies(device_bodies, where);
+}
+
+void GravSim::compute_acceleration(const int *active, int count) {
+    force_evaluations += active ? count : n;
+    if (method == solver::BARNES_HUT) {
+        // built and walked on the CPU for either backend, CUDA's bodies are Unified Memory
+        tree.compute(n, device_bodies, active, count);
+        return;
+    }
+#ifdef __CUDACC__
+    if (where == backend::CUDA && !active) {
+        compute_acceleration_cuda();
+        return;
+    }
+#endif
+    // the active bodies of a block substep are few, those go to the CPU for either backend
+    if (active) {
+        compute_acceleration_cpu(n, device_bodies, 0, count, active);
+    } else {
+        compute_acceleration_cpu(n, device_bodies, 0, n);
+    }
+}
+
+// Block timesteps
+
+// Level of body i after a step of h that ends at substep (of 2^levels per dt): its step is
+// eta times the shorter of |v| / |a|, how long it takes to change velocity by its own,
+// and |a| / |da/dt|, how long until its acceleration changes by itself; da/dt is from the
+// new acceleration and the one at the start of the step, which compute_acceleration left
+// in old_a*. The second is what shortens the steps of close encounters. A body can always
+// move to a finer level, to a coarser one only at a boundary of that level's steps.
+int GravSim::block_level(int i, float h, int substep) const {
+    const Bodies &b = device_bodies;
+    float v2 = b.vx[i] * b.vx[i] + b.vy[i] * b.vy[i] + b.vz[i] * b.vz[i];
+    float a2 = b.ax[i] * b.ax[i] + b.ay[i] * b.ay[i] + b.az[i] * b.az[i];
+    float step = a2 > 0 ? blocks.eta * sqrtf(v2 / a2) : dt;
+    if (h > 0) {
+        float jx = b.ax[i] - b.old_ax[i], jy = b.ay[i] - b.old_ay[i], jz = b.az[i] - b.old_az[i];
+        float j2 = jx * jx + jy * jy + jz * jz;
+        if (j2 > 0) step = min(step, blocks.eta * h * sqrtf(a2 / j2));
+    }
+    int l = 0;
+    while (l < blocks.levels && ldexpf(dt, -l) > step) l++;
+    if (h > 0) {
+        int current = level[i];
+        while (l < current && substep % (1 << (blocks.levels - l)) != 0) l++;
+    }
+    return l;
+}
+
+// accelerations and levels at the start
+void GravSim::start_block() {
+    if (n == 0) return;
+    compute_acceleration();
+    level.assign(n, 0);
+    for (int i = 0; i < n; i++) level[i] = block_level(i, 0, 0);
+}
+
+// One dt by kick-drift-kick leapfrog with block timesteps. Every body drifts at every
+// substep, but only those whose step starts get their opening half kick, and only those
+// whose step ends get new accelerations and their closing half kick; substeps no body
+// ends on are skipped, so a dt takes as many substeps as its finest occupied level needs.
+void GravSim::step_block() {
+    if (n == 0) return;
+    Bodies b = device_bodies;
+    int substeps = 1 << blocks.levels;
+    float h_min = dt / substeps;
+    for (int s = 0; s < substeps; ) {
+        int finest = *max_element(level.begin(), level.end());
+        int span = 1 << (blocks.levels - finest);
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            int span_i = 1 << (blocks.levels - level[i]);
+            if (s % span_i == 0) {
+                float half = 0.5f * h_min * span_i;
+                b.vx[i] += b.ax[i] * half;
+                b.vy[i] += b.ay[i] * half;
+                b.vz[i] += b.az[i] * half;
+            }
+        }
+        float h = h_min * span;
+        #pragma omp parallel for simd schedule(static)
+        for (int i = 0; i < n; i++) {
+            b.x[i] += b.vx[i] * h;
+            b.y[i] += b.vy[i] * h;
+            b.z[i] += b.vz[i] * h;
+        }
+        s += span;
+
+        active.clear();
+        for (int i = 0; i < n; i++) {
+            if (s % (1 << (blocks.levels - level[i])) == 0) active.push_back(i);
+        }
+        compute_acceleration(active.data(), int(active.size()));
+        #pragma omp parallel for schedule(static)
+        for (int k = 0; k < int(active.size()); k++) {
+            int i = active[k];
+            float h_i = h_min * (1 << (blocks.levels - level[i]));
+            b.vx[i] += b.ax[i] * 0.5f * h_i;
+            b.vy[i] += b.ay[i] * 0.5f * h_i;
+            b.vz[i] += b.az[i] * 0.5f * h_i;
+            level[i] = block_level(i, h_i, s);
+        }
+    }
 }
 
+// Kinetic plus potential energy times G (masses are kept as Gm), softened like the
+// forces; only its relative change is reported
+double GravSim::energy() const {
+    const Bodies &b = device_bodies;
+    double kinetic = 0, potential = 0;
+    double eps2 = softening2;
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:kinetic, potential)
+    for (int i = 0; i < n; i++) {
+        kinetic += 0.5 * b.Gm[i] * (double(b.vx[i]) * b.vx[i] + double(b.vy[i]) * b.vy[i] + double(b.vz[i]) * b.vz[i]);
+        for (int j = i + 1; j < n; j++) {
+            double dx = double(b.x[j]) - b.x[i], dy = double(b.y[j]) - b.y[i], dz = double(b.z[j]) - b.z[i];
+            potential -= double(b.Gm[i]) * b.Gm[j] / sqrt(dx * dx + dy * dy + dz * dz + eps2);
+        }
+    }
+    return kinetic + potential;
+}
+
+void GravSim::step_forward(float dt) {
+#ifdef __CUDACC__
+    if (where == backend::CUDA) {
+        step_forward_cuda(dt);
+        return;
+    }
+#endif
+    step_forward_cpu(n, device_bodies, dt);
+}
+
+#ifdef __CUDACC__
 void GravSim::compute_acceleration_cuda(int threads_per_block) {
     int blocks = (n + threads_per_block - 1) / threads_per_block;
-    compute_acceleration_kernel<<<blocks, threads_per_block>>>(n, device_bodies);
+    compute_acceleration_kernel<<<blocks, threads_per_block>>>(n, device_bodies, softening2);
     cudaError_t err = cudaGetLastError();
     if (err != cudaSuccess) {
         cerr << "Failed to launch compute_acceleration_kernel: " << cudaGetErrorString(err) << endl;
@@ -314,40 +1161,277 @@ void GravSim::step_forward_cuda(float dt, int threads_per_block) {
     }
     cudaDeviceSynchronize();
 }
+#endif
 
-void GravSim::print_system() const {
-    for (int i = 0; i < n; i++) {
-        cout << names[i] << " " 
-             << device_bodies.x[i] << "," 
-             << device_bodies.y[i] << "," 
-             << device_bodies.z[i] << "   " 
-             << device_bodies.vx[i] << "," 
-             << device_bodies.vy[i] << "," 
-             << device_bodies.vz[i] << endl;
-    }
+void GravSim::print_system() {
+    trajectory.submit(timestep, n, device_bodies, false, true);
 }
 
 void GravSim::graph_system() {
+    trajectory.submit(timestep, n, device_bodies, true, false);
+}
+
+// Benchmark
+
+// n bodies at rest in a disc 2e12 m across, masses from asteroids to a few Suns
+void random_bodies(int n, Bodies b) {
     for (int i = 0; i < n; i++) {
-        graphfile << names[i] << ' ' 
-                  << device_bodies.x[i] << ' ' 
-                  << device_bodies.y[i] << ' ' 
-                  << device_bodies.z[i] << ' ';
+        b.Gm[i] = G * float(1e20 + dis(gen) * 1e28);
+        b.x[i] = float((dis(gen) * 2 - 1) * 1e12);
+        b.y[i] = float((dis(gen) * 2 - 1) * 1e12);
+        b.z[i] = float((dis(gen) * 2 - 1) * 1e11);
+        b.vx[i] = b.vy[i] = b.vz[i] = 0;
+        b.ax[i] = b.ay[i] = b.az[i] = 0;
+        b.old_ax[i] = b.old_ay[i] = b.old_az[i] = 0;
+    }
+}
+
+// bodies of a timed all-pairs pass on the CPU, ~1e8 interactions per thread
+int benchmark_rows(int n) {
+    int threads = omp_get_max_threads();
+    long long budget = 100000000LL * threads;
+    return int(min<long long>(n, max<long long>(budget / n, (long long)CPU_I_BLOCK * threads)));
+}
+
+// seconds per call of pass, repeated for at least half a second after a warm up
+template <typename Pass>
+double seconds_per_pass(Pass pass) {
+    pass();
+    long long passes = 0;
+    auto start = chrono::high_resolution_clock::now();
+    chrono::duration<double> elapsed{};
+    do {
+        pass();
+        passes++;
+        elapsed = chrono::high_resolution_clock::now() - start;
+    } while (elapsed.count() < 0.5);
+    return elapsed.count() / passes;
+}
+
+// Interactions per second of the acceleration computation for random bodies, from the
+// ~1000 of solarsys.dat up to max_n by factors of 4. Passes repeat for at least half a
+// second. On the CPU a pass covers only as many bodies (against all n) as fit ~1e8
+// interactions per thread, every body costs the same so the rate is that of a full step
+// without a million-body step taking minutes.
+void benchmark_acceleration(backend where, int max_n) {
+    for (long long size = 1024; size <= max_n; size *= 4) {
+        int n = int(size);
+        Bodies b = alloc_bodies(n, where);
+        random_bodies(n, b);
+        int threads = omp_get_max_threads();
+        int rows = where == backend::CPU ? benchmark_rows(n) : n;
+        auto pass = [&] {
+#ifdef __CUDACC__
+            if (where == backend::CUDA) {
+                compute_acceleration_kernel<<<(n + 255) / 256, 256>>>(n, b, softening2);
+                cudaDeviceSynchronize();
+                return;
+            }
+#endif
+            compute_acceleration_cpu(n, b, 0, rows);
+        };
+        pass(); // warm up
+        long long passes = 0;
+        auto start = chrono::high_resolution_clock::now();
+        chrono::duration<double> elapsed{};
+        do {
+            pass();
+            passes++;
+            elapsed = chrono::high_resolution_clock::now() - start;
+        } while (elapsed.count() < 0.5);
+        double interactions = double(rows) * n * passes;
+        cout << n << " bodies, " << (where == backend::CUDA ? "cuda" : "cpu, " + to_string(threads) + (threads == 1 ? " thread" : " threads"))
+             << ": " << interactions / elapsed.count() << " interactions/s (" << passes << " passes of " << rows
+             << " x " << n << " in " << elapsed.count() << " seconds)" << endl;
+        free_bodies(b, where);
+    }
+}
+
+// Barnes-Hut against all pairs on the CPU for random bodies, from 1024 up to max_n by
+// factors of 4: seconds per step of each, and the error of the Barnes-Hut accelerations
+// relative to the all-pairs ones (|a_bh - a| / |a|). Past ~1e8 interactions per thread
+// the all-pairs time is estimated from the first benchmark_rows(n) bodies, which are
+// also the ones the error is measured on; the bodies are random, so that is a fair sample.
+void benchmark_barnes_hut(float theta, int max_n) {
+    BarnesHut tree(theta);
+    cout << "Barnes-Hut, theta=" << theta << ", " << omp_get_max_threads() << " thread(s)" << endl;
+    for (long long size = 1024; size <= max_n; size *= 4) {
+        int n = int(size);
+        Bodies b = alloc_bodies(n, backend::CPU);
+        random_bodies(n, b);
+        double tree_seconds = seconds_per_pass([&] { tree.compute(n, b); });
+        vector<float> bh_ax(b.ax, b.ax + n), bh_ay(b.ay, b.ay + n), bh_az(b.az, b.az + n);
+
+        int rows = benchmark_rows(n);
+        double direct_seconds = seconds_per_pass([&] { compute_acceleration_cpu(n, b, 0, rows); }) * n / rows;
+        double sum2 = 0, max_err = 0;
+        for (int i = 0; i < rows; i++) {
+            double ex = bh_ax[i] - b.ax[i], ey = bh_ay[i] - b.ay[i], ez = bh_az[i] - b.az[i];
+            double a2 = double(b.ax[i]) * b.ax[i] + double(b.ay[i]) * b.ay[i] + double(b.az[i]) * b.az[i];
+            double err = sqrt((ex * ex + ey * ey + ez * ez) / a2);
+            sum2 += err * err;
+            max_err = max(max_err, err);
+        }
+        cout << n << " bodies: all-pairs " << direct_seconds << " s/step" << (rows < n ? " (est.)" : "")
+             << ", barnes-hut " << tree_seconds << " s/step (build " << tree.build_seconds << ", walk "
+             << tree.walk_seconds << ", " << tree.num_nodes() << " nodes), " << direct_seconds / tree_seconds
+             << "x; relative error rms " << sqrt(sum2 / rows) << ", max " << max_err << endl;
+        free_bodies(b, backend::CPU);
+    }
+}
+
+// Block timesteps against one global step for the bodies in filename, over duration:
+// force evaluations, seconds and relative energy error of kick-drift-kick leapfrog with
+// every body at 4000 s down to 250 s, and with block steps of 64000 s / 2^levels for a
+// range of eta. Then, for each global step, the cheapest block run with no larger energy
+// error. Point masses (the default softening) make close encounters, and so the energy
+// error, unbounded whatever the step; set --softening to about the bodies' size.
+void benchmark_block(const char filename[], float duration, int levels) {
+    struct run {
+        float dt;
+        block_options blocks;
+        uint64_t evaluations;
+        double seconds, error;
+    };
+    vector<run> global, block;
+    auto simulate = [&](float dt, block_options blocks) {
+        gen.seed(0); // the same starting phases for every run
+        GravSim sim(filename, dt, duration, false, UINT32_MAX, UINT32_MAX, GravSim::configuration::CIRCULAR_RANDOM,
+                    backend::CPU, solver::DIRECT, 0.5f, trajectory_options{}, integrator::BLOCK_LEAPFROG, blocks, true);
+        return run{dt, blocks, sim.force_evaluation_count(), sim.seconds(), sim.energy_error()};
+    };
+    for (float dt : {4000.0f, 2000.0f, 1000.0f, 500.0f, 250.0f}) {
+        global.push_back(simulate(dt, block_options{0, 0.0f}));
+    }
+    for (float eta : {0.04f, 0.02f, 0.01f, 0.005f, 0.0025f}) {
+        block.push_back(simulate(64000.0f, block_options{levels, eta}));
+    }
+    cout << "softening " << sqrt(softening2) << " m" << endl;
+    for (const run &r : global) {
+        cout << "global dt=" << r.dt << " s: " << r.evaluations << " force evaluations, " << r.seconds
+             << " seconds, relative energy error " << r.error << endl;
+    }
+    for (const run &r : block) {
+        cout << "block dt=64000/2^0.." << r.blocks.levels << " s, eta=" << r.blocks.eta << ": " << r.evaluations
+             << " force evaluations, " << r.seconds << " seconds, relative energy error " << r.error << endl;
+    }
+    for (const run &g : global) {
+        const run *best = nullptr;
+        for (const run &b : block) {
+            if (b.error <= g.error && (!best || b.seconds < best->seconds)) best = &b;
+        }
+        if (!best) {
+            cout << "global dt=" << g.dt << " s: no block run as accurate" << endl;
+            continue;
+        }
+        cout << "global dt=" << g.dt << " s vs block eta=" << best->blocks.eta << ": "
+             << 100.0 * (1.0 - double(best->evaluations) / g.evaluations) << "% fewer force evaluations, "
+             << g.seconds / best->seconds << "x faster" << endl;
     }
-    graphfile << '\n';
 }
 
 // Main 
 
+// Usage: sim [file] [--backend=cpu|cuda] [--solver=direct|barnes-hut] [--theta=T]
+//            [--trajectory=binary|text] [--trajectory-stride=K] [--quantize]
+//            [--years=Y] [--dt=S] [--integrator=euler|block] [--levels=L] [--eta=E]
+//            [--softening=M] [--energy] [--bench] [--bench-bh] [--bench-block] [--bench-max=N]
+// --solver=barnes-hut simulates with the octree, opening angle T (0.5).
+// Trajectories go to solargraph.bin, every K-th body (1), positions 16-bit with --quantize;
+// --trajectory=text writes the text solargraph.dat instead.
+// Simulates Y years (1) in steps of S seconds (1000) of symplectic Euler, or with
+// --integrator=block of kick-drift-kick leapfrog where each body steps S / 2^l, l up to
+// L (8) by the step criterion with accuracy E (0.02). Forces are softened by M metres
+// (1e-5). --energy reports the relative change in total energy, an O(n^2) sum before and
+// after the run.
+// --bench times the acceleration computation from 1024 up to N (1048576) random bodies
+// instead of simulating file, --bench-bh compares Barnes-Hut to all pairs the same way,
+// --bench-block block timesteps to a global one on file for Y years.
 int main(int argc, char **argv) {
-    const char *filename = (argc > 1) ? argv[1] : "solarsys.dat";
+    const char *filename = "solarsys.dat";
+    backend where = default_backend();
+    solver method = solver::DIRECT;
+    float theta = 0.5f;
+    trajectory_options output;
+    integrator scheme = integrator::SYMPLECTIC_EULER;
+    block_options blocks;
     float dt = 1000.0f; // Timestep in seconds
     float duration = year; // One year
+    bool track_energy = false;
+    bool bench = false, bench_bh = false, bench_block = false;
+    int bench_max = 1 << 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--backend=cpu") == 0) {
+            where = backend::CPU;
+        } else if (strcmp(argv[i], "--backend=cuda") == 0) {
+#ifdef __CUDACC__
+            where = backend::CUDA;
+#else
+            cerr << "This build has no CUDA backend, build it with nvcc (make sim)" << endl;
+            return EXIT_FAILURE;
+#endif
+        } else if (strcmp(argv[i], "--solver=direct") == 0) {
+            method = solver::DIRECT;
+        } else if (strcmp(argv[i], "--solver=barnes-hut") == 0) {
+            method = solver::BARNES_HUT;
+        } else if (strncmp(argv[i], "--theta=", 8) == 0) {
+            theta = float(atof(argv[i] + 8));
+        } else if (strcmp(argv[i], "--trajectory=binary") == 0) {
+            output.binary = true;
+        } else if (strcmp(argv[i], "--trajectory=text") == 0) {
+            output.binary = false;
+        } else if (strncmp(argv[i], "--trajectory-stride=", 20) == 0) {
+            output.stride = atoi(argv[i] + 20);
+        } else if (strcmp(argv[i], "--quantize") == 0) {
+            output.quantize = true;
+        } else if (strncmp(argv[i], "--years=", 8) == 0) {
+            duration = float(atof(argv[i] + 8) * year);
+        } else if (strncmp(argv[i], "--dt=", 5) == 0) {
+            dt = float(atof(argv[i] + 5));
+        } else if (strcmp(argv[i], "--integrator=euler") == 0) {
+            scheme = integrator::SYMPLECTIC_EULER;
+        } else if (strcmp(argv[i], "--integrator=block") == 0) {
+            scheme = integrator::BLOCK_LEAPFROG;
+        } else if (strncmp(argv[i], "--levels=", 9) == 0) {
+            blocks.levels = min(max(atoi(argv[i] + 9), 0), 20);
+        } else if (strncmp(argv[i], "--eta=", 6) == 0) {
+            blocks.eta = float(atof(argv[i] + 6));
+        } else if (strncmp(argv[i], "--softening=", 12) == 0) {
+            softening2 = float(atof(argv[i] + 12) * atof(argv[i] + 12));
+        } else if (strcmp(argv[i], "--energy") == 0) {
+            track_energy = true;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--bench-bh") == 0) {
+            bench_bh = true;
+        } else if (strcmp(argv[i], "--bench-block") == 0) {
+            bench_block = true;
+        } else if (strncmp(argv[i], "--bench-max=", 12) == 0) {
+            bench_max = atoi(argv[i] + 12);
+        } else if (argv[i][0] == '-') {
+            cerr << "Unknown option " << argv[i] << endl;
+            return EXIT_FAILURE;
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (bench) {
+        benchmark_acceleration(where, bench_max);
+        return 0;
+    }
+    if (bench_bh) {
+        benchmark_barnes_hut(theta, bench_max);
+        return 0;
+    }
+    if (bench_block) {
+        benchmark_block(filename, duration, blocks.levels);
+        return 0;
+    }
     bool verbose = true;
     uint32_t print_every = static_cast<uint32_t>(31536000 / dt); // Print once per year
     uint32_t graph_every = static_cast<uint32_t>(86400 / dt); // Graph once per day
 
-    GravSim sim(filename, dt, duration, verbose, print_every, graph_every, GravSim::configuration::CIRCULAR_RANDOM);
+    GravSim sim(filename, dt, duration, verbose, print_every, graph_every, GravSim::configuration::CIRCULAR_RANDOM, where, method, theta, output, scheme, blocks, track_energy);
     sim.print_system();
     sim.graph_system();
 
@@ -1,10 +1,21 @@
+#include <algorithm>
 #include <chrono>
-//#include <immintrin.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace std::chrono;
 
+// The kernels are in memory_timing_x86_64.s or memory_timingarm64.s, the Makefile picks
+// the one for the machine it builds on.
 extern "C" {
     void read_one(uint64_t *data, int n);
     void read_memory_scalar(uint64_t *data, int n);
@@ -18,49 +29,284 @@ extern "C" {
     void write_one(uint64_t *data, int n);
     void write_one_avx(uint64_t *data, int n);
     void write_memory_scalar(uint64_t *data, int n);
-    void write_memory_sse(uint64_t *data, int n);    
+    void write_memory_sse(uint64_t *data, int n);
     void write_memory_avx(uint64_t *data, int n);
+    void write_memory_sse_nt(uint64_t *data, int n);
+    void write_memory_avx_nt(uint64_t *data, int n);
 };
 
 // for information on how C++ passes parameters to functions, see:
 //https://en.wikipedia.org/wiki/X86_calling_conventions (search for linux)
 
+// --csv prints every result as one line of mode,name,threads,bytes,seconds,value,unit
+bool csv = false;
+
+void report(const char mode[], const string& name, int threads, uint64_t bytes, double seconds, double value,
+            const char unit[]) {
+    if (csv) {
+        cout << mode << ',' << name << ',' << threads << ',' << bytes << ',' << seconds << ',' << value << ','
+             << unit << endl;
+    } else {
+        cout << name << (threads > 1 ? ", " + to_string(threads) + " threads" : string()) << ": " << value << ' '
+             << unit << " (" << seconds << " seconds)" << endl;
+    }
+}
+
+// the x86 AVX kernels use 256-bit integer instructions, AVX2
+bool has_avx() {
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("avx2");
+#else
+    return true;
+#endif
+}
+
 template<typename Func, typename... Args>
 void benchmark(const char name[], Func read_memory, uint64_t* p, int n, Args... args) {
     auto start = std::chrono::high_resolution_clock::now();
     read_memory(p, n, args...);
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end - start;
+    if (csv) {
+        report("kernels", name, 1, uint64_t(n) * sizeof(uint64_t), elapsed.count(), elapsed.count() / n * 1e9,
+               "ns per element");
+        return;
+    }
     std::cout << name << " took " << elapsed.count() << " seconds " << elapsed.count()/n*1e9 << " ns per element" << std::endl;
 }
 
-int main() {
-  constexpr uint64_t n = 1024*1024*512; // 4GB, 512 million 64-bit words
-  uint64_t* p = (uint64_t*)aligned_alloc(32, n*sizeof(uint64_t)); // allocate
-
-  benchmark("warmup (disregard)", read_memory_scalar, p, n);
-  benchmark("read_one", read_one, p, n);
-  benchmark("write_one", write_one, p, n);
-  benchmark("read_memory_scalar", read_memory_sse_unaligned, p, n);
-  benchmark("read_memory_sse", read_memory_sse, p, n);
-  benchmark("read_memory_avx", read_memory_avx, p, n);
-  benchmark("read_memory_sse_unaligned", read_memory_sse_unaligned, p, n);
-  benchmark("read_memory_avx_unaligned", read_memory_avx_unaligned, p, n);
-  benchmark("read_memory_every 2", read_memory_every2, p, n);
-  benchmark("read_memory_everyk 4", read_memory_everyk, p, n, 4);
-  benchmark("read_memory_everyk 8", read_memory_everyk, p, n, 8);
-  benchmark("read_memory_everyk 16", read_memory_everyk, p, n, 16);
-  benchmark("read_memory_everyk 32", read_memory_everyk, p, n, 32);
-  benchmark("read_memory_everyk 64", read_memory_everyk, p, n, 64);
-  benchmark("read_memory_everyk 128", read_memory_everyk, p, n, 128);
-  benchmark("read_memory_everyk 256", read_memory_everyk, p, n, 256);
-  benchmark("read_memory_everyk 512", read_memory_everyk, p, n, 512);
-  benchmark("read_memory_everyk 1024", read_memory_everyk, p, n, 1024);
-  benchmark("read_memory_everyk 1M", read_memory_everyk, p, n, 1024*1024);
-  benchmark("read_one_avx", read_one_avx, p, n);
-  benchmark("write_one_avx", write_one_avx, p, n);
-  benchmark("write_memory_scalar", write_memory_scalar, p, n);
-  benchmark("write_memory_avx", write_memory_avx, p, n);
-  free(p);
-  return 0;
+// every kernel once over n words
+void run_kernels(uint64_t n) {
+    uint64_t* p = (uint64_t*)aligned_alloc(32, n*sizeof(uint64_t)); // allocate
+    bool avx = has_avx();
+    // start 8 bytes in so every 16 / 32 byte load straddles an alignment boundary
+    uint64_t* unaligned = p + 1;
+    int un = int(n - 4);
+
+    benchmark("warmup (disregard)", read_memory_scalar, p, n);
+    benchmark("read_one", read_one, p, n);
+    benchmark("write_one", write_one, p, n);
+    benchmark("read_memory_scalar", read_memory_scalar, p, n);
+    benchmark("read_memory_sse", read_memory_sse, p, n);
+    if (avx) benchmark("read_memory_avx", read_memory_avx, p, n);
+    benchmark("read_memory_sse_unaligned", read_memory_sse_unaligned, unaligned, un);
+    if (avx) benchmark("read_memory_avx_unaligned", read_memory_avx_unaligned, unaligned, un);
+    benchmark("read_memory_every 2", read_memory_every2, p, n);
+    benchmark("read_memory_everyk 4", read_memory_everyk, p, n, 4);
+    benchmark("read_memory_everyk 8", read_memory_everyk, p, n, 8);
+    benchmark("read_memory_everyk 16", read_memory_everyk, p, n, 16);
+    benchmark("read_memory_everyk 32", read_memory_everyk, p, n, 32);
+    benchmark("read_memory_everyk 64", read_memory_everyk, p, n, 64);
+    benchmark("read_memory_everyk 128", read_memory_everyk, p, n, 128);
+    benchmark("read_memory_everyk 256", read_memory_everyk, p, n, 256);
+    benchmark("read_memory_everyk 512", read_memory_everyk, p, n, 512);
+    benchmark("read_memory_everyk 1024", read_memory_everyk, p, n, 1024);
+    if (n >= 1024*1024) benchmark("read_memory_everyk 1M", read_memory_everyk, p, n, 1024*1024); // k <= n, 8MB and up
+    if (avx) benchmark("read_one_avx", read_one_avx, p, n);
+    if (avx) benchmark("write_one_avx", write_one_avx, p, n);
+    benchmark("write_memory_scalar", write_memory_scalar, p, n);
+    benchmark("write_memory_sse", write_memory_sse, p, n);
+    if (avx) benchmark("write_memory_avx", write_memory_avx, p, n);
+    benchmark("write_memory_sse_nt", write_memory_sse_nt, p, n);
+    if (avx) benchmark("write_memory_avx_nt", write_memory_avx_nt, p, n);
+    free(p);
+}
+
+// where chase_latency's walk ended up
+void* volatile chase_end;
+
+// Average ns per load walking a random cycle through a working set of bytes, one pointer
+// per 64-byte cache line. Every load depends on the one before, so nothing overlaps and
+// the prefetchers can't guess the next line: this is the load-to-use latency of whatever
+// level the working set fits in (past the TLB's reach it includes page walks too).
+double chase_latency(size_t bytes, uint64_t loads) {
+    constexpr size_t line = 64;
+    size_t lines = max<size_t>(bytes / line, 2);
+    char* buffer = (char*)aligned_alloc(line, lines * line);
+    // Sattolo's shuffle gives a single cycle through every line
+    vector<size_t> next(lines);
+    iota(next.begin(), next.end(), 0);
+    mt19937_64 gen(lines);
+    for (size_t i = lines - 1; i > 0; i--) {
+        swap(next[i], next[uniform_int_distribution<size_t>(0, i - 1)(gen)]);
+    }
+    for (size_t i = 0; i < lines; i++) {
+        *(void**)(buffer + i * line) = buffer + next[i] * line;
+    }
+
+    void* p = buffer;
+    for (size_t i = 0; i < lines; i++) { // one lap to warm the caches and TLB
+        p = *(void**)p;
+    }
+    auto start = high_resolution_clock::now();
+    for (uint64_t i = 0; i < loads; i++) {
+        p = *(void**)p;
+    }
+    chase_end = p; // a volatile store, so the chain can't be dropped or moved past the clock
+    auto end = high_resolution_clock::now();
+    free(buffer);
+    return duration<double>(end - start).count() / loads * 1e9;
+}
+
+// working sets from 4 KB (L1) to max_bytes (DRAM), in steps of 1x and 1.5x powers of 2
+void run_latency(size_t max_bytes) {
+    constexpr uint64_t loads = 1 << 23;
+    for (size_t size = 4096; size <= max_bytes; size *= 2) {
+        for (size_t bytes : { size, size + size / 2 }) {
+            if (bytes > max_bytes) {
+                break;
+            }
+            auto start = high_resolution_clock::now();
+            double ns = chase_latency(bytes, loads);
+            double seconds = duration<double>(high_resolution_clock::now() - start).count();
+            report("latency", "chase " + to_string(bytes / 1024) + " KB", 1, bytes, seconds, ns, "ns per load");
+        }
+    }
+}
+
+// STREAM (McCalpin) style bandwidth: copy, scale, add and triad over three arrays of n
+// doubles, each thread owning one contiguous slice, plus the plain read / write / non-temporal
+// write kernels above per slice. Best of repeats, bytes counted the STREAM way (what the
+// loop reads plus writes, no write-allocate traffic).
+void run_stream(uint64_t n, int max_threads) {
+    double* a = (double*)aligned_alloc(64, n * sizeof(double));
+    double* b = (double*)aligned_alloc(64, n * sizeof(double));
+    double* c = (double*)aligned_alloc(64, n * sizeof(double));
+    const double scalar = 3.0;
+    const int repeats = 5;
+    bool avx = has_avx();
+
+    // runs kernel(lo, hi) over threads slices of [0, n) and returns the wall time
+    auto parallel = [&](int threads, auto kernel) {
+        vector<thread> team;
+        auto start = high_resolution_clock::now();
+        for (int t = 0; t < threads; t++) {
+            team.emplace_back([&, t] { kernel(n * t / threads, n * (t + 1) / threads); });
+        }
+        for (auto& member : team) {
+            member.join();
+        }
+        return duration<double>(high_resolution_clock::now() - start).count();
+    };
+    // first touch from max_threads slices, so pages land near the threads that use them
+    parallel(max_threads, [&](uint64_t lo, uint64_t hi) {
+        for (uint64_t i = lo; i < hi; i++) {
+            a[i] = 1.0;
+            b[i] = 2.0;
+            c[i] = 0.0;
+        }
+    });
+
+    void (*read_words)(uint64_t*, int) = avx ? read_memory_avx : read_memory_sse;
+    void (*write_words)(uint64_t*, int) = avx ? write_memory_avx : write_memory_sse;
+    void (*write_words_nt)(uint64_t*, int) = avx ? write_memory_avx_nt : write_memory_sse_nt;
+    // slices start at any element, the asm kernels get the 32-byte aligned part of theirs
+    auto words = [](double* base, uint64_t lo, uint64_t hi, void (*kernel)(uint64_t*, int)) {
+        uint64_t first = (lo + 3) / 4 * 4, last = hi / 4 * 4;
+        if (last > first) {
+            kernel((uint64_t*)(base + first), int(last - first));
+        }
+    };
+    struct Kernel {
+        const char* name;
+        uint64_t bytes_per_element;
+        function<void(uint64_t, uint64_t)> run;
+    };
+    const Kernel kernels[] = {
+        { "copy", 16, [&](uint64_t lo, uint64_t hi) {
+              for (uint64_t i = lo; i < hi; i++) c[i] = a[i];
+          } },
+        { "scale", 16, [&](uint64_t lo, uint64_t hi) {
+              for (uint64_t i = lo; i < hi; i++) b[i] = scalar * c[i];
+          } },
+        { "add", 24, [&](uint64_t lo, uint64_t hi) {
+              for (uint64_t i = lo; i < hi; i++) c[i] = a[i] + b[i];
+          } },
+        { "triad", 24, [&](uint64_t lo, uint64_t hi) {
+              for (uint64_t i = lo; i < hi; i++) a[i] = b[i] + scalar * c[i];
+          } },
+        { "read", 8, [&](uint64_t lo, uint64_t hi) { words(a, lo, hi, read_words); } },
+        { "write", 8, [&](uint64_t lo, uint64_t hi) { words(c, lo, hi, write_words); } },
+        { "write_nt", 8, [&](uint64_t lo, uint64_t hi) { words(c, lo, hi, write_words_nt); } },
+    };
+
+    vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+    for (int threads : thread_counts) {
+        for (const Kernel& kernel : kernels) {
+            double best = 1e30;
+            for (int r = 0; r < repeats; r++) {
+                best = min(best, parallel(threads, kernel.run));
+            }
+            uint64_t bytes = kernel.bytes_per_element * n;
+            report("stream", kernel.name, threads, bytes, best, bytes / best / 1e9, "GB/s");
+        }
+    }
+    free(a);
+    free(b);
+    free(c);
+}
+
+// value of --name=value in arg, or nullptr
+const char* option(const char* arg, const char* name) {
+    size_t length = strlen(name);
+    return strncmp(arg, name, length) == 0 && arg[length] == '=' ? arg + length + 1 : nullptr;
+}
+
+// Usage: benchmark_assembler_mem [--mode=kernels|latency|stream|all] [--size-mb=N]
+//        [--latency-max-mb=N] [--stream-mb=N] [--threads=N] [--csv]
+// kernels (the default) times every kernel over one --size-mb buffer (4096), latency
+// sweeps working sets up to --latency-max-mb (1024), stream runs --stream-mb per array
+// (256) from 1 thread doubling up to --threads (all hardware threads).
+int main(int argc, char* argv[]) {
+    string mode = "kernels";
+    uint64_t size_mb = 4096, latency_max_mb = 1024, stream_mb = 256;
+    int max_threads = max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        const char* value;
+        if ((value = option(argv[i], "--mode"))) {
+            mode = value;
+        } else if ((value = option(argv[i], "--size-mb"))) {
+            size_mb = strtoull(value, nullptr, 10);
+        } else if ((value = option(argv[i], "--latency-max-mb"))) {
+            latency_max_mb = strtoull(value, nullptr, 10);
+        } else if ((value = option(argv[i], "--stream-mb"))) {
+            stream_mb = strtoull(value, nullptr, 10);
+        } else if ((value = option(argv[i], "--threads"))) {
+            max_threads = atoi(value);
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else {
+            cerr << "unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    // words must fit the kernels' int n
+    if (size_mb == 0 || size_mb > 8191 || stream_mb == 0 || stream_mb > 8191 || latency_max_mb == 0
+        || max_threads < 1) {
+        cerr << "sizes must be 1..8191 MB and threads at least 1" << endl;
+        return 1;
+    }
+    bool all = mode == "all";
+    if (!all && mode != "kernels" && mode != "latency" && mode != "stream") {
+        cerr << "unknown mode " << mode << endl;
+        return 1;
+    }
+
+    if (csv) {
+        cout << "mode,name,threads,bytes,seconds,value,unit" << endl;
+    }
+    if (all || mode == "kernels") {
+        run_kernels(size_mb * 1024 * 1024 / sizeof(uint64_t)); // 4GB: 512 million 64-bit words
+    }
+    if (all || mode == "latency") {
+        run_latency(latency_max_mb * 1024 * 1024);
+    }
+    if (all || mode == "stream") {
+        run_stream(stream_mb * 1024 * 1024 / sizeof(double), max_threads);
+    }
+    return 0;
 }
@@ -0,0 +1,281 @@
+# x86-64 versions of the kernels in memory_timingarm64.s, same names and
+# arguments (System V: data in %rdi, n in %esi, k in %edx). n counts 64-bit
+# words. SSE kernels move 16 bytes, AVX kernels 32 (AVX2 machines), the
+# aligned ones need data 16 / 32 byte aligned. The _nt writes use
+# non-temporal stores, which go around the cache straight to memory, and end
+# with sfence so the timing includes draining them. n <= 0 does nothing, as
+# does read_memory_everyk when k > n.
+    .global read_one
+    .global read_memory_scalar
+    .global read_memory_sse
+    .global read_one_avx
+    .global read_memory_avx
+    .global read_memory_sse_unaligned
+    .global read_memory_avx_unaligned
+    .global read_memory_every2
+    .global read_memory_everyk
+    .global write_one
+    .global write_one_avx
+    .global write_memory_scalar
+    .global write_memory_sse
+    .global write_memory_avx
+    .global write_memory_sse_nt
+    .global write_memory_avx_nt
+
+    .text
+
+# Read one location repeatedly
+# void read_one(uint64_t *data, int n);
+read_one:
+    movslq %esi, %rsi           # n, sign extended
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    movq (%rdi), %rax           # load 64 bits from the same place
+    subq $1, %rsi               # n = n - 1
+    jg 1b                       # until all n reads are done
+9:
+    ret
+
+# Read 8 bytes (64 bits) at a time
+# void read_memory_scalar(uint64_t *data, int n);
+read_memory_scalar:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    movq (%rdi), %rax           # load 64 bits
+    addq $8, %rdi               # advance to the next word
+    subq $1, %rsi
+    jg 1b
+9:
+    ret
+
+# Read all even words, then odd
+# void read_memory_every2(uint64_t *data, int n);
+read_memory_every2:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+    movq %rdi, %r8              # keep the start for the odd pass
+    movq %rsi, %rcx
+1:
+    movq (%rdi), %rax           # even words
+    addq $16, %rdi
+    subq $2, %rcx
+    jg 1b
+    leaq 8(%r8), %rdi           # odd words start one word in
+2:
+    movq (%rdi), %rax
+    addq $16, %rdi
+    subq $2, %rsi
+    jg 2b
+9:
+    ret
+
+# Read words skipping k, then go back and fill in the missing ones
+# void read_memory_everyk(uint64_t *data, int n, int k);
+read_memory_everyk:
+    movslq %esi, %rax
+    movslq %edx, %rcx           # k = number of passes
+    testq %rcx, %rcx
+    jle 9f
+    cqto
+    idivq %rcx                  # rax = q = n / k
+    testq %rax, %rax
+    jle 9f                      # k > n: not even one read per pass
+    movq %rax, %r10
+    leaq (,%rcx,8), %r8         # k * 8 bytes between reads
+1:
+    movq %rdi, %r9              # start of this pass
+    movq %r10, %r11             # q reads per pass
+2:
+    movq (%r9), %rax
+    addq %r8, %r9               # advance by k words
+    subq $1, %r11
+    jg 2b
+    addq $8, %rdi               # next pass starts one word later
+    subq $1, %rcx
+    jg 1b
+9:
+    ret
+
+# Read 16 bytes (128 bits) at a time (aligned)
+# void read_memory_sse(uint64_t *data, int n);
+read_memory_sse:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    movdqa (%rdi), %xmm0
+    addq $16, %rdi
+    subq $2, %rsi               # n = n - 2
+    jg 1b
+9:
+    ret
+
+# Read one location repeatedly using AVX (256 bits)
+# void read_one_avx(uint64_t *data, int n);
+read_one_avx:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    vmovdqa (%rdi), %ymm0
+    subq $4, %rsi               # n = n - 4
+    jg 1b
+    vzeroupper                  # avoid the SSE/AVX transition penalty in the caller
+9:
+    ret
+
+# Read 32 bytes (256 bits) at a time (aligned)
+# void read_memory_avx(uint64_t *data, int n);
+read_memory_avx:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    vmovdqa (%rdi), %ymm0
+    addq $32, %rdi
+    subq $4, %rsi
+    jg 1b
+    vzeroupper
+9:
+    ret
+
+# Read 16 bytes (128 bits) at a time (unaligned)
+# void read_memory_sse_unaligned(uint64_t *data, int n);
+read_memory_sse_unaligned:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    movdqu (%rdi), %xmm0
+    addq $16, %rdi
+    subq $2, %rsi
+    jg 1b
+9:
+    ret
+
+# Read 32 bytes (256 bits) at a time (unaligned)
+# void read_memory_avx_unaligned(uint64_t *data, int n);
+read_memory_avx_unaligned:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    vmovdqu (%rdi), %ymm0
+    addq $32, %rdi
+    subq $4, %rsi
+    jg 1b
+    vzeroupper
+9:
+    ret
+
+# Write repeatedly to one 64-bit memory location
+# void write_one(uint64_t *data, int n);
+write_one:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    movq $1, (%rdi)
+    subq $1, %rsi
+    jg 1b
+9:
+    ret
+
+# Write repeatedly to one 256-bit memory location using AVX
+# void write_one_avx(uint64_t *data, int n);
+write_one_avx:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+    vpcmpeqq %ymm0, %ymm0, %ymm0  # all ones
+1:
+    vmovdqa %ymm0, (%rdi)
+    subq $4, %rsi
+    jg 1b
+    vzeroupper
+9:
+    ret
+
+# Write 8 bytes (64 bits) at a time
+# void write_memory_scalar(uint64_t *data, int n);
+write_memory_scalar:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+1:
+    movq $1, (%rdi)
+    addq $8, %rdi
+    subq $1, %rsi
+    jg 1b
+9:
+    ret
+
+# Write 16 bytes (128 bits) at a time
+# void write_memory_sse(uint64_t *data, int n);
+write_memory_sse:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+    pcmpeqd %xmm0, %xmm0
+1:
+    movdqa %xmm0, (%rdi)
+    addq $16, %rdi
+    subq $2, %rsi
+    jg 1b
+9:
+    ret
+
+# Write 32 bytes (256 bits) at a time
+# void write_memory_avx(uint64_t *data, int n);
+write_memory_avx:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+    vpcmpeqq %ymm0, %ymm0, %ymm0
+1:
+    vmovdqa %ymm0, (%rdi)
+    addq $32, %rdi
+    subq $4, %rsi
+    jg 1b
+    vzeroupper
+9:
+    ret
+
+# Write 16 bytes at a time with non-temporal stores, data 16 byte aligned
+# void write_memory_sse_nt(uint64_t *data, int n);
+write_memory_sse_nt:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+    pcmpeqd %xmm0, %xmm0
+1:
+    movntdq %xmm0, (%rdi)
+    addq $16, %rdi
+    subq $2, %rsi
+    jg 1b
+    sfence                      # wait for the write-combining buffers to drain
+9:
+    ret
+
+# Write 32 bytes at a time with non-temporal stores, data 32 byte aligned
+# void write_memory_avx_nt(uint64_t *data, int n);
+write_memory_avx_nt:
+    movslq %esi, %rsi
+    testq %rsi, %rsi
+    jle 9f                      # nothing to do for n <= 0
+    vpcmpeqq %ymm0, %ymm0, %ymm0
+1:
+    vmovntdq %ymm0, (%rdi)
+    addq $32, %rdi
+    subq $4, %rsi
+    jg 1b
+    sfence
+    vzeroupper
+9:
+    ret
+
+    .section .note.GNU-stack,"",@progbits
@@ -12,6 +12,8 @@
     .global write_memory_scalar
     .global write_memory_sse
     .global write_memory_avx
+    .global write_memory_sse_nt
+    .global write_memory_avx_nt
 
     .text
 
@@ -199,3 +201,33 @@ write_memory_avx:
     CMP x1, #0
     BGT 1b                     // Loop until all n locations have been written
     RET
+
+// Write 16 bytes at a time with non-temporal stores (STNP hints the data
+// won't be read again soon, so it can bypass the cache)
+// void write_memory_sse_nt(uint64_t *data, int n);
+write_memory_sse_nt:
+    MOV x2, #1
+    DUP v0.2D, x2             // Set v0 to [1, 1]
+1:
+    STNP d0, d0, [x0]          // Store two 64-bit halves (16 bytes)
+    ADD x0, x0, #16            // Advance pointer
+    SUB x1, x1, #2             // n = n - 2
+    CMP x1, #0
+    BGT 1b                     // Loop until all n locations have been written
+    DMB ST                     // Order the stores before returning
+    RET
+
+// Write 32 bytes at a time with non-temporal stores
+// void write_memory_avx_nt(uint64_t *data, int n);
+write_memory_avx_nt:
+    MOV x2, #1
+    DUP v0.2D, x2             // Set v0 to [1, 1]
+    DUP v1.2D, x2             // Set v1 to [1, 1]
+1:
+    STNP q0, q1, [x0]          // Store v0 and v1 together (32 bytes)
+    ADD x0, x0, #32            // Advance pointer
+    SUB x1, x1, #4             // n = n - 4
+    CMP x1, #0
+    BGT 1b                     // Loop until all n locations have been written
+    DMB ST                     // Order the stores before returning
+    RET
@@ -19,8 +19,13 @@
 //Diagonal matrices multiplymatrix3 with 4 threads: 0.962202 seconds
 //Diagonal matrices multiplymatrix3 with 8 threads: 0.492557 seconds
 #include <omp.h>
-#include <iostream>
+#include <immintrin.h>
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
 
 // Assuming a system with 4 physical cores.
 // The performance with 8 threads will indicate how well hyperthreading is utilized.
@@ -111,6 +116,207 @@ void multiplymatrix3(float a[], float b[], float c[], int n) {
     }
 }
 
+// Blocked GEMM, C = A * B for row-major A (m x k), B (k x n) and C (m x n), any sizes.
+// Same loop nest as BLIS/GotoBLAS: B is copied in kc x nc blocks (sized for L3) into
+// NR-wide column slivers, A in mc x kc blocks (sized for L2) into MR-tall row slivers,
+// and a micro-kernel keeps an MR x NR tile of C in registers while it walks kc, streaming
+// one sliver of each from L1. Packing makes every load in the kernel sequential, so the
+// stride-n walk down B in multiplymatrix3 and the extra transposed copy both go away.
+// Edge tiles are packed with zero padding and their results copied out partially.
+const int GEMM_MR = 6;     // rows of the register tile, 6 x 16 floats = 12 ymm accumulators
+const int GEMM_NR = 16;
+const int GEMM_KC = 256;   // MR x KC of A plus KC x NR of B = 22 KB, fits L1
+const int GEMM_MC = 96;    // MC x KC of A = 96 KB, fits L2
+const int GEMM_NC = 3072;  // KC x NC of B = 3 MB, shared by all threads in L3
+const int GEMM_NT = 256;   // columns of a macro-tile, the unit threads split NC into
+
+float* gemm_alloc(size_t floats) {
+    size_t bytes = (floats * sizeof(float) + 63) / 64 * 64;
+    return static_cast<float*>(std::aligned_alloc(64, bytes));
+}
+
+// B[pc .. pc+kc) x [jc .. jc+nc) into NR-wide slivers, kc rows of NR each
+void pack_b(const float* b, float* packed, int ldb, int kc, int nc) {
+    int slivers = (nc + GEMM_NR - 1) / GEMM_NR;
+    #pragma omp for schedule(static)
+    for (int s = 0; s < slivers; s++) {
+        int j0 = s * GEMM_NR;
+        int width = std::min(GEMM_NR, nc - j0);
+        float* out = packed + (size_t)s * kc * GEMM_NR;
+        for (int p = 0; p < kc; p++) {
+            const float* row = b + (size_t)p * ldb + j0;
+            for (int j = 0; j < width; j++) {
+                out[j] = row[j];
+            }
+            for (int j = width; j < GEMM_NR; j++) {
+                out[j] = 0.0f;
+            }
+            out += GEMM_NR;
+        }
+    }
+}
+
+// A[ic .. ic+mc) x [pc .. pc+kc) into MR-tall slivers, kc columns of MR each
+void pack_a(const float* a, float* packed, int lda, int mc, int kc) {
+    for (int i0 = 0; i0 < mc; i0 += GEMM_MR) {
+        int height = std::min(GEMM_MR, mc - i0);
+        for (int p = 0; p < kc; p++) {
+            for (int i = 0; i < height; i++) {
+                packed[i] = a[(size_t)(i0 + i) * lda + p];
+            }
+            for (int i = height; i < GEMM_MR; i++) {
+                packed[i] = 0.0f;
+            }
+            packed += GEMM_MR;
+        }
+    }
+}
+
+// C tile += packed A sliver * packed B sliver, the whole MR x NR tile
+__attribute__((target("avx2,fma")))
+void gemm_kernel_avx2(int kc, const float* a, const float* b, float* c, int ldc) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (int p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ai = _mm256_broadcast_ss(a);
+        c00 = _mm256_fmadd_ps(ai, b0, c00);
+        c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(ai, b0, c10);
+        c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(ai, b0, c20);
+        c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(ai, b0, c30);
+        c31 = _mm256_fmadd_ps(ai, b1, c31);
+        ai = _mm256_broadcast_ss(a + 4);
+        c40 = _mm256_fmadd_ps(ai, b0, c40);
+        c41 = _mm256_fmadd_ps(ai, b1, c41);
+        ai = _mm256_broadcast_ss(a + 5);
+        c50 = _mm256_fmadd_ps(ai, b0, c50);
+        c51 = _mm256_fmadd_ps(ai, b1, c51);
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    __m256 rows[GEMM_MR][2] = { { c00, c01 }, { c10, c11 }, { c20, c21 },
+                                { c30, c31 }, { c40, c41 }, { c50, c51 } };
+    for (int i = 0; i < GEMM_MR; i++) {
+        float* row = c + (size_t)i * ldc;
+        _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), rows[i][0]));
+        _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), rows[i][1]));
+    }
+}
+
+// the same tile in plain C++ for CPUs without AVX2/FMA
+void gemm_kernel_scalar(int kc, const float* a, const float* b, float* c, int ldc) {
+    float tile[GEMM_MR][GEMM_NR] = {};
+    for (int p = 0; p < kc; p++) {
+        for (int i = 0; i < GEMM_MR; i++) {
+            #pragma omp simd
+            for (int j = 0; j < GEMM_NR; j++) {
+                tile[i][j] += a[i] * b[j];
+            }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    for (int i = 0; i < GEMM_MR; i++) {
+        for (int j = 0; j < GEMM_NR; j++) {
+            c[(size_t)i * ldc + j] += tile[i][j];
+        }
+    }
+}
+
+void gemm(const float* a, const float* b, float* c, int m, int n, int k) {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    auto kernel = has_avx2 ? gemm_kernel_avx2 : gemm_kernel_scalar;
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < m; i++) {
+        std::fill(c + (size_t)i * n, c + (size_t)(i + 1) * n, 0.0f);
+    }
+    float* packed_b = gemm_alloc((size_t)GEMM_KC * ((std::min(n, GEMM_NC) + GEMM_NR - 1) / GEMM_NR * GEMM_NR));
+
+    #pragma omp parallel
+    {
+        float* packed_a = gemm_alloc((size_t)GEMM_MC * GEMM_KC);
+        float edge[GEMM_MR * GEMM_NR];
+        for (int jc = 0; jc < n; jc += GEMM_NC) {
+            int nc = std::min(GEMM_NC, n - jc);
+            for (int pc = 0; pc < k; pc += GEMM_KC) {
+                int kc = std::min(GEMM_KC, k - pc);
+                // every thread packs part of the shared B block, implicit barrier after
+                pack_b(b + (size_t)pc * n + jc, packed_b, n, kc, nc);
+
+                // macro-tiles of MC rows by NT columns, each thread packs the A block of its own
+                int row_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+                int col_blocks = (nc + GEMM_NT - 1) / GEMM_NT;
+                int packed_ic = -1;
+                #pragma omp for schedule(dynamic) collapse(2)
+                for (int rb = 0; rb < row_blocks; rb++) {
+                    for (int cb = 0; cb < col_blocks; cb++) {
+                        int ic = rb * GEMM_MC;
+                        int mc = std::min(GEMM_MC, m - ic);
+                        if (packed_ic != ic) {
+                            pack_a(a + (size_t)ic * k + pc, packed_a, k, mc, kc);
+                            packed_ic = ic;
+                        }
+                        int col_end = std::min(nc, (cb + 1) * GEMM_NT);
+                        for (int jr = cb * GEMM_NT; jr < col_end; jr += GEMM_NR) {
+                            const float* sliver_b = packed_b + (size_t)(jr / GEMM_NR) * kc * GEMM_NR;
+                            int width = std::min(GEMM_NR, nc - jr);
+                            for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                                const float* sliver_a = packed_a + (size_t)ir * kc;
+                                int height = std::min(GEMM_MR, mc - ir);
+                                float* tile = c + (size_t)(ic + ir) * n + jc + jr;
+                                if (height == GEMM_MR && width == GEMM_NR) {
+                                    kernel(kc, sliver_a, sliver_b, tile, n);
+                                    continue;
+                                }
+                                std::fill(edge, edge + GEMM_MR * GEMM_NR, 0.0f);
+                                kernel(kc, sliver_a, sliver_b, edge, GEMM_NR);
+                                for (int i = 0; i < height; i++) {
+                                    for (int j = 0; j < width; j++) {
+                                        tile[(size_t)i * n + j] += edge[i * GEMM_NR + j];
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+                // implicit barrier, packed_b is reused for the next block
+            }
+        }
+        std::free(packed_a);
+    }
+    std::free(packed_b);
+}
+
+// square n x n entry point with the same signature as the others
+void multiplymatrix_gemm(float a[], float b[], float c[], int n) {
+    gemm(a, b, c, n, n, n);
+}
+
+// runs multiply once and prints its time and GFLOP/s (2 n^3 flops)
+void time_multiply(const char* label, int num_threads, void (*multiply)(float[], float[], float[], int),
+                   float a[], float b[], float c[], int n) {
+    omp_set_num_threads(num_threads);
+    auto start = std::chrono::high_resolution_clock::now();
+    multiply(a, b, c, n);
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> duration = end - start;
+    double gflops = 2.0 * n * n * n / duration.count() / 1e9;
+    std::cout << label << " with " << num_threads << (num_threads == 1 ? " thread: " : " threads: ")
+              << duration.count() << " seconds, " << gflops << " GFLOP/s\n";
+}
+
 void benchmark_multiply(int n, int num_threads) {
     float* a = new float[n*n];
     float* b = new float[n*n];
@@ -125,31 +331,19 @@ void benchmark_multiply(int n, int num_threads) {
     }
 
     // Benchmark original multiplymatrix
-    omp_set_num_threads(1);
-    auto start = std::chrono::high_resolution_clock::now();
-    multiplymatrix(a, b, c, n);
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> duration = end - start;
-    std::cout << "Original multiplymatrix with 1 thread: " << duration.count() << " seconds\n";
+    time_multiply("Original multiplymatrix", 1, multiplymatrix, a, b, c, n);
 
     // Benchmark optimized multiplymatrix3
-    omp_set_num_threads(num_threads);
-    start = std::chrono::high_resolution_clock::now();
-    multiplymatrix3(a, b, c, n);
-    end = std::chrono::high_resolution_clock::now();
-    duration = end - start;
-    std::cout << "Optimized multiplymatrix3 with " << num_threads << " threads: " << duration.count() << " seconds\n";
+    time_multiply("Optimized multiplymatrix3", num_threads, multiplymatrix3, a, b, c, n);
 
     float* b_transposed = new float[n*n];
     transpose(b, b_transposed, n);
 
     // Benchmark transposed multiplymatrix
-    omp_set_num_threads(num_threads);
-    start = std::chrono::high_resolution_clock::now();
-    multiplymatrix_transposed(a, b_transposed, c, n);
-    end = std::chrono::high_resolution_clock::now();
-    duration = end - start;
-    std::cout << "Transposed multiplymatrix with " << num_threads << " threads: " << duration.count() << " seconds\n";
+    time_multiply("Transposed multiplymatrix", num_threads, multiplymatrix_transposed, a, b_transposed, c, n);
+
+    // Benchmark blocked gemm, no transposed copy needed
+    time_multiply("Blocked gemm", num_threads, multiplymatrix_gemm, a, b, c, n);
 
     delete[] a;
     delete[] b_transposed;
@@ -157,6 +351,43 @@ void benchmark_multiply(int n, int num_threads) {
     delete[] c;
 }
 
+// gemm on random m x k and k x n matrices against a double-precision reference,
+// sizes picked to leave partial MR / NR / KC / MC / NC blocks
+bool check_gemm(int m, int n, int k) {
+    std::mt19937 gen(m * 31 + n * 7 + k);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+    float* a = new float[(size_t)m * k];
+    float* b = new float[(size_t)k * n];
+    float* c = new float[(size_t)m * n];
+    for (size_t i = 0; i < (size_t)m * k; i++) a[i] = value(gen);
+    for (size_t i = 0; i < (size_t)k * n; i++) b[i] = value(gen);
+
+    gemm(a, b, c, m, n, k);
+    double worst = 0.0;
+    double* row = new double[n];
+    for (int i = 0; i < m; i++) {
+        std::fill(row, row + n, 0.0);
+        for (int p = 0; p < k; p++) {
+            double aip = a[(size_t)i * k + p];
+            for (int j = 0; j < n; j++) {
+                row[j] += aip * b[(size_t)p * n + j];
+            }
+        }
+        for (int j = 0; j < n; j++) {
+            worst = std::max(worst, std::fabs(row[j] - c[(size_t)i * n + j]));
+        }
+    }
+    // float sums of k terms of size <= 1 drift by about k * 2^-24 * sqrt(k)
+    bool ok = worst <= 1e-6 * k * std::sqrt((double)k) + 1e-5;
+    std::cout << "gemm " << m << " x " << k << " * " << k << " x " << n << ": max error " << worst
+              << (ok ? "\n" : " FAILED\n");
+    delete[] row;
+    delete[] a;
+    delete[] b;
+    delete[] c;
+    return ok;
+}
+
 void benchmark_diagonal_matrices(int n, int num_threads) {
     float* a = new float[n*n];
     float* b = new float[n*n];
@@ -186,6 +417,17 @@ void benchmark_diagonal_matrices(int n, int num_threads) {
 int main() {
     int n = 1024;
 
+    std::cout << "Checking gemm against a reference:\n";
+    bool ok = true;
+    int shapes[][3] = { { 1, 1, 1 }, { 7, 13, 5 }, { 97, 33, 300 }, { 255, 1000, 257 }, { 1023, 3100, 517 } };
+    for (auto& shape : shapes) {
+        ok &= check_gemm(shape[0], shape[1], shape[2]);
+    }
+    if (!ok) {
+        return 1;
+    }
+    std::cout << "\n";
+
     std::cout << "Benchmarking with identity matrices:\n";
     benchmark_multiply(n, 1);
     benchmark_multiply(n, 2);
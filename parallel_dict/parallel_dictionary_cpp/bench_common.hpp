@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+// deterministic vocabulary of random lowercase words, the same for every caller
+inline std::vector<std::string> generateVocabulary(size_t vocabularySize)
+{
+    std::mt19937 gen(0); // Seeded for reproducibility
+    std::uniform_int_distribution<int> wordLength(1, 12);
+    std::uniform_int_distribution<int> letter(0, 25);
+    std::vector<std::string> vocabulary(vocabularySize);
+    for (auto& word : vocabulary) {
+        int length = wordLength(gen);
+        for (int i = 0; i < length; ++i) {
+            word.push_back(static_cast<char>('a' + letter(gen)));
+        }
+    }
+    return vocabulary;
+}
+
+// count tokens drawn from vocabulary with a Zipfian (1/rank) distribution
+inline std::vector<std::string> generateTokens(const std::vector<std::string>& vocabulary, size_t count, unsigned seed)
+{
+    std::vector<double> weights(vocabulary.size());
+    for (size_t i = 0; i < vocabulary.size(); ++i) {
+        weights[i] = 1.0 / static_cast<double>(i + 1);
+    }
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    std::mt19937 gen(seed);
+    std::vector<std::string> tokens;
+    tokens.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        tokens.push_back(vocabulary[pick(gen)]);
+    }
+    return tokens;
+}
+
+// seconds taken by run()
+template <typename Func>
+double secondsFor(Func&& run)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    run();
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    return elapsed.count();
+}
@@ -0,0 +1,236 @@
+// Compressed books: tokenizing gzip (and, built with make ZSTD=1, zstd)
+// books while they are decompressed, against reading the same books already
+// decompressed. Books are generated into a temporary directory and written
+// plain, gzipped and as zstd of 1 MB frames; the zstd set is also written as
+// one file of all books, whose frame ranges are decoded in parallel. Timed
+// warm (files in the page cache) and cold (pages dropped first, best effort);
+// MB/s are of decompressed text.
+// Usage: bench_compressed [files] [bytes per file] [threads]
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bench_common.hpp"
+#include "compressed_book.hpp"
+#include "mapped_file.hpp"
+#include "scheduler.hpp"
+#include "sharded_dictionary.hpp"
+#include "tokenizer.hpp"
+
+std::string makeText(const std::vector<std::string>& vocabulary, size_t bytes, unsigned seed)
+{
+    std::string text;
+    for (const std::string& word : generateTokens(vocabulary, bytes / 7 + 1, seed)) {
+        text += word;
+        text += text.size() % 80 < 8 ? '\n' : ' ';
+        if (text.size() >= bytes) {
+            break;
+        }
+    }
+    return text;
+}
+
+std::string gzipText(const std::string& text)
+{
+    z_stream stream {};
+    deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY); // +16 writes a gzip header
+    std::string out(deflateBound(&stream, text.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+    stream.avail_in = static_cast<uInt>(text.size());
+    stream.next_out = reinterpret_cast<Bytef*>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+
+#ifdef PD_ZSTD
+// independent frames of frameBytes of text each
+std::string zstdText(const std::string& text, size_t frameBytes)
+{
+    std::string out;
+    for (size_t pos = 0; pos < text.size(); pos += frameBytes) {
+        size_t length = std::min(frameBytes, text.size() - pos);
+        std::string frame(ZSTD_compressBound(length), '\0');
+        frame.resize(ZSTD_compress(frame.data(), frame.size(), text.data() + pos, length, 3));
+        out += frame;
+    }
+    return out;
+}
+#endif
+
+BookFile writeBook(const std::filesystem::path& path, const std::string& contents)
+{
+    std::ofstream(path, std::ios::binary) << contents;
+    Compression compression = compressionFromName(path.string());
+    BookFile book { path.string(), contents.size(), compression, {} };
+    if (compression == Compression::Zstd) {
+        MappedFile file(book.path);
+        book.frames = zstdFrameOffsets(file.view());
+    }
+    return book;
+}
+
+// asks the kernel to drop the files' cached pages so the next read goes to disk
+void dropCaches(const std::vector<BookFile>& books)
+{
+    for (const BookFile& book : books) {
+        int fd = ::open(book.path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fdatasync(fd);
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+}
+
+// total occurrences plus distinct words, the same for every path
+uint64_t checksum(const SingleOwnerDictionary& dict)
+{
+    uint64_t sum = 0;
+    dict.forEach([&](std::string_view, const DictionaryEntry& entry) {
+        sum += static_cast<uint64_t>(entry.wordCount) + 1;
+    });
+    return sum;
+}
+
+// like the default ingest: threads drain scheduler tasks into their own
+// dictionaries, compressed tasks are decoded like processBookMapped does
+uint64_t runBooks(const std::vector<BookFile>& books, unsigned numThreads, size_t chunkBytes, uint64_t& textBytes)
+{
+    WorkStealingScheduler scheduler(books, numThreads, chunkBytes);
+    std::vector<std::unique_ptr<SingleOwnerDictionary>> threadDicts;
+    std::vector<uint64_t> decoded(numThreads, 0);
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threadDicts.emplace_back(std::make_unique<SingleOwnerDictionary>(16));
+    }
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t] {
+            WordTokenizer tokenizer;
+            BookTask task;
+            while (scheduler.next(t, task)) {
+                const BookFile& book = books[task.bookIndex];
+                auto insert = [&](std::string_view word) {
+                    threadDicts[t]->insert(word, static_cast<int>(task.bookIndex));
+                };
+                MappedFile file(book.path);
+                if (book.compression == Compression::None) {
+                    tokenizer.forEachWord(file.view(), insert);
+                    decoded[t] += file.view().size();
+                    continue;
+                }
+                RangeEdges edges;
+                forEachDecompressedText(file.view(), book.compression, task.begin, task.end, edges, decoded[t],
+                    [&](std::string_view text) { tokenizer.forEachWord(text, insert); });
+                if (task.numRanges > 1) {
+                    scheduler.seams().add(task.bookIndex, task.numRanges, task.begin, std::move(edges),
+                        [&](std::string_view letters) { tokenizer.forEachWord(letters, insert); });
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    textBytes = 0;
+    for (uint64_t bytes : decoded) {
+        textBytes += bytes;
+    }
+    SingleOwnerDictionary dict(16);
+    dict.mergeAll(threadDicts, numThreads, false);
+    return checksum(dict);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t numFiles = argc >= 2 ? std::stoul(argv[1]) : 200;
+    size_t bytesPerFile = argc >= 3 ? std::stoul(argv[2]) : 512 * 1024;
+    unsigned numThreads = argc >= 4 ? static_cast<unsigned>(std::stoul(argv[3]))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+    constexpr size_t kFrameBytes = 1024 * 1024;
+
+    std::filesystem::path dir
+        = std::filesystem::temp_directory_path() / ("bench_compressed." + std::to_string(::getpid()));
+    for (const char* sub : { "plain", "gzip", "zstd", "zstd_one" }) {
+        std::filesystem::create_directories(dir / sub);
+    }
+    std::vector<std::string> vocabulary = generateVocabulary(50000);
+    std::vector<BookFile> plain, gzip, zstd, zstdOne;
+    uint64_t plainBytes = 0, gzipBytes = 0, zstdBytes = 0;
+    std::string all;
+    for (size_t i = 0; i < numFiles; ++i) {
+        std::string text = makeText(vocabulary, bytesPerFile, static_cast<unsigned>(i + 1));
+        std::string name = "book" + std::to_string(i) + ".txt";
+        plain.push_back(writeBook(dir / "plain" / name, text));
+        gzip.push_back(writeBook(dir / "gzip" / (name + ".gz"), gzipText(text)));
+        plainBytes += plain.back().size;
+        gzipBytes += gzip.back().size;
+#ifdef PD_ZSTD
+        zstd.push_back(writeBook(dir / "zstd" / (name + ".zst"), zstdText(text, kFrameBytes)));
+        zstdBytes += zstd.back().size;
+        all += text;
+#endif
+    }
+#ifdef PD_ZSTD
+    zstdOne.push_back(writeBook(dir / "zstd_one" / "all.txt.zst", zstdText(all, kFrameBytes)));
+    all.clear();
+#endif
+    std::cout << numFiles << " files, " << plainBytes / numFiles << " bytes each, " << numThreads
+              << " threads; gzip " << static_cast<double>(plainBytes) / static_cast<double>(gzipBytes) << "x";
+    if (kZstdSupported) {
+        std::cout << ", zstd " << static_cast<double>(plainBytes) / static_cast<double>(zstdBytes) << "x";
+    } else {
+        std::cout << ", zstd not built in (make ZSTD=1)";
+    }
+    std::cout << std::endl;
+
+    struct Path {
+        const char* name;
+        const std::vector<BookFile>* books;
+        size_t chunkBytes;
+    };
+    std::vector<Path> paths = {
+        { "plain text", &plain, 0 },
+        { "gzip, per book", &gzip, 0 },
+    };
+    if (kZstdSupported) {
+        paths.push_back({ "zstd, per book", &zstd, 0 });
+        paths.push_back({ "zstd, one file (one book id) in frame ranges", &zstdOne, 4 * kFrameBytes });
+    }
+    uint64_t expected = 0;
+    for (bool cold : { false, true }) {
+        for (const Path& path : paths) {
+            uint64_t textBytes = 0;
+            if (cold) {
+                dropCaches(*path.books);
+            } else {
+                runBooks(*path.books, numThreads, path.chunkBytes, textBytes); // warm the page cache
+            }
+            uint64_t sum = 0;
+            double seconds = secondsFor([&] { sum = runBooks(*path.books, numThreads, path.chunkBytes, textBytes); });
+            if (expected == 0) {
+                expected = sum;
+            }
+            std::cout << (cold ? "cold " : "warm ") << path.name << ": " << seconds << " seconds, "
+                      << static_cast<double>(textBytes) / seconds / 1e6 << " MB/s of text"
+                      << (sum == expected && textBytes == plainBytes ? "" : " CHECKSUM DIFFERS") << std::endl;
+            if (sum != expected || textBytes != plainBytes) {
+                std::filesystem::remove_all(dir);
+                return 1;
+            }
+        }
+    }
+    std::filesystem::remove_all(dir);
+    return 0;
+}
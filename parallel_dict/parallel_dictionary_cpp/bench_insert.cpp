@@ -0,0 +1,66 @@
+// Per-insert cost of the locked and single-owner dictionaries. Every thread
+// inserts into its own dictionary, like the per-thread dictionaries in main.
+// Usage: bench_insert [inserts per thread] [numShards]
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "sharded_dictionary.hpp"
+
+template <typename Dictionary>
+double nsPerInsert(unsigned numThreads, const std::vector<std::vector<std::string>>& tokens, size_t numShards)
+{
+    std::vector<std::unique_ptr<Dictionary>> dicts;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        dicts.emplace_back(std::make_unique<Dictionary>(numShards));
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threads.emplace_back([&, i] {
+            const auto& mine = tokens[i];
+            for (size_t k = 0; k < mine.size(); ++k) {
+                dicts[i]->insert(mine[k], static_cast<int>(k / 4096)); // new book every 4096 words
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    return elapsed.count() * 1e9 / static_cast<double>(tokens[0].size());
+}
+
+int main(int argc, char* argv[])
+{
+    size_t insertsPerThread = argc >= 2 ? std::stoul(argv[1]) : 2000000;
+    size_t numShards = argc >= 3 ? std::stoul(argv[2]) : 16;
+    unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<unsigned> threadCounts = { 1, 4 };
+    if (hardwareThreads != 1 && hardwareThreads != 4) {
+        threadCounts.push_back(hardwareThreads);
+    }
+    unsigned maxThreads = *std::max_element(threadCounts.begin(), threadCounts.end());
+    std::vector<std::string> vocabulary = generateVocabulary(50000);
+    std::vector<std::vector<std::string>> tokens;
+    for (unsigned i = 0; i < maxThreads; ++i) {
+        tokens.push_back(generateTokens(vocabulary, insertsPerThread, i + 1));
+    }
+
+    std::cout << insertsPerThread << " inserts per thread, " << numShards << " shards, "
+              << hardwareThreads << " hardware threads" << std::endl;
+    for (unsigned numThreads : threadCounts) {
+        double locked = nsPerInsert<ShardedConcurrentDictionary>(numThreads, tokens, numShards);
+        double owned = nsPerInsert<SingleOwnerDictionary>(numThreads, tokens, numShards);
+        std::cout << numThreads << " threads: mutex " << locked << " ns per insert, single-owner "
+                  << owned << " ns per insert, speedup " << locked / owned << "x" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+// Dictionary policy combinations (dictionary_policies.hpp): every hash x shard
+// map x posting storage, inserted into one shared dictionary by all threads
+// under each real lock, and into per-thread NoLock dictionaries like the
+// default ingest. Each combination is its own instantiation of
+// BasicShardedDictionary, so what is timed is the code the program would run.
+// Usage: bench_policies [inserts per thread] [numShards] [threads]
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "sharded_dictionary.hpp"
+
+template <typename... Policies>
+struct PolicyList { };
+
+template <typename... Policies, typename Fn>
+void forEachPolicy(PolicyList<Policies...>, Fn&& fn)
+{
+    (fn(std::type_identity<Policies> {}), ...);
+}
+
+template <typename Policy>
+inline constexpr const char* kPolicyName = "";
+template <>
+inline constexpr const char* kPolicyName<std::mutex> = "mutex";
+template <>
+inline constexpr const char* kPolicyName<SpinLock> = "spinlock";
+template <>
+inline constexpr const char* kPolicyName<NoLock> = "none";
+template <>
+inline constexpr const char* kPolicyName<WordHash> = "std::hash";
+template <>
+inline constexpr const char* kPolicyName<WyHash> = "wyhash";
+template <>
+inline constexpr const char* kPolicyName<ModuloShards> = "modulo";
+template <>
+inline constexpr const char* kPolicyName<MaskShards> = "mask";
+template <>
+inline constexpr const char* kPolicyName<PostingList> = "PostingList";
+template <>
+inline constexpr const char* kPolicyName<SortedVectorPostings> = "sorted vector";
+template <>
+inline constexpr const char* kPolicyName<HashSetPostings> = "unordered_set";
+
+using Hashes = PolicyList<WordHash, WyHash>;
+using ShardMaps = PolicyList<ModuloShards, MaskShards>;
+using PostingStores = PolicyList<PostingList, SortedVectorPostings, HashSetPostings>;
+
+struct Result {
+    double nsPerInsert = 0;
+    size_t memoryBytes = 0;
+    uint64_t checksum = 0; // occurrences plus book references, the same for every combination
+};
+
+// book ids of thread t's tokens, a new book every 4096 words
+int bookIdOf(unsigned t, size_t k, size_t tokensPerThread)
+{
+    return static_cast<int>(t * (tokensPerThread / 4096 + 1) + k / 4096);
+}
+
+template <typename Dictionary>
+uint64_t checksum(const Dictionary& dict)
+{
+    uint64_t sum = 0;
+    dict.forEach([&](std::string_view, const typename Dictionary::Entry& entry) {
+        sum += static_cast<uint64_t>(entry.wordCount) + entry.bookIds.size();
+    });
+    return sum;
+}
+
+// all threads insert into one dictionary
+template <typename Dictionary>
+Result runShared(const std::vector<std::vector<std::string>>& tokens, size_t numShards)
+{
+    Dictionary dict(numShards);
+    double seconds = secondsFor([&] {
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < tokens.size(); ++t) {
+            threads.emplace_back([&, t] {
+                const auto& mine = tokens[t];
+                for (size_t k = 0; k < mine.size(); ++k) {
+                    dict.insert(mine[k], bookIdOf(t, k, mine.size()));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    });
+    return { seconds * 1e9 / static_cast<double>(tokens.size() * tokens[0].size()), dict.memoryBytes(),
+        checksum(dict) };
+}
+
+// every thread inserts into its own dictionary, merged into one at the end
+template <typename Dictionary>
+Result runOwned(const std::vector<std::vector<std::string>>& tokens, size_t numShards)
+{
+    Dictionary dict(numShards);
+    double seconds = secondsFor([&] {
+        std::vector<std::unique_ptr<Dictionary>> dicts;
+        for (size_t t = 0; t < tokens.size(); ++t) {
+            dicts.emplace_back(std::make_unique<Dictionary>(numShards));
+        }
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < tokens.size(); ++t) {
+            threads.emplace_back([&, t] {
+                const auto& mine = tokens[t];
+                for (size_t k = 0; k < mine.size(); ++k) {
+                    dicts[t]->insert(mine[k], bookIdOf(t, k, mine.size()));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        dict.mergeAll(dicts, static_cast<unsigned>(tokens.size()), false);
+    });
+    return { seconds * 1e9 / static_cast<double>(tokens.size() * tokens[0].size()), dict.memoryBytes(),
+        checksum(dict) };
+}
+
+int main(int argc, char* argv[])
+{
+    size_t insertsPerThread = argc >= 2 ? std::stoul(argv[1]) : 1000000;
+    size_t numShards = argc >= 3 ? std::stoul(argv[2]) : 24;
+    unsigned numThreads = argc >= 4 ? static_cast<unsigned>(std::stoul(argv[3]))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<std::string> vocabulary = generateVocabulary(50000);
+    std::vector<std::vector<std::string>> tokens;
+    for (unsigned t = 0; t < numThreads; ++t) {
+        tokens.push_back(generateTokens(vocabulary, insertsPerThread, t + 1));
+    }
+    std::cout << insertsPerThread << " inserts per thread, " << numThreads << " threads, " << numShards
+              << " shards (mask: " << MaskShards(numShards).count() << ")" << std::endl;
+    std::cout << std::left << std::setw(10) << "lock" << std::setw(11) << "hash" << std::setw(8) << "shards"
+              << std::setw(15) << "postings" << "ns/insert  MB" << std::endl;
+
+    uint64_t expected = 0;
+    bool mismatch = false;
+    auto report = [&](const char* lock, const char* hash, const char* map, const char* postings, Result result) {
+        if (expected == 0) {
+            expected = result.checksum;
+        }
+        mismatch |= result.checksum != expected;
+        std::cout << std::left << std::setw(10) << lock << std::setw(11) << hash << std::setw(8) << map
+                  << std::setw(15) << postings << std::setw(11) << std::fixed << std::setprecision(1)
+                  << result.nsPerInsert << static_cast<double>(result.memoryBytes) / (1024.0 * 1024.0)
+                  << (result.checksum == expected ? "" : "  CHECKSUM DIFFERS") << std::endl;
+    };
+
+    forEachPolicy(PolicyList<std::mutex, SpinLock, NoLock> {}, [&]<typename Lock>(std::type_identity<Lock>) {
+        forEachPolicy(Hashes {}, [&]<typename Hash>(std::type_identity<Hash>) {
+            forEachPolicy(ShardMaps {}, [&]<typename Map>(std::type_identity<Map>) {
+                forEachPolicy(PostingStores {}, [&]<typename Postings>(std::type_identity<Postings>) {
+                    using Dictionary = BasicShardedDictionary<Lock, Hash, Map, Postings>;
+                    Result result;
+                    if constexpr (std::is_same_v<Lock, NoLock>) {
+                        result = runOwned<Dictionary>(tokens, numShards);
+                    } else {
+                        result = runShared<Dictionary>(tokens, numShards);
+                    }
+                    report(kPolicyName<Lock>, kPolicyName<Hash>, kPolicyName<Map>, kPolicyName<Postings>, result);
+                });
+            });
+        });
+    });
+    return mismatch ? 1 : 0;
+}
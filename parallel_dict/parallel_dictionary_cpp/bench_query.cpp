@@ -0,0 +1,119 @@
+// Query latency under concurrent ingestion. Writer threads insert into one
+// ShardedConcurrentDictionary while a publisher thread republishes it and
+// reader threads take a snapshot and look a word up, as fast as they can.
+// Reports reader latency percentiles and writer throughput with and without
+// readers running.
+// Usage: bench_query [inserts per writer] [writers] [readers] [publish ms]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "sharded_dictionary.hpp"
+
+struct RunResult {
+    double insertsPerSecond = 0;
+    std::vector<double> latenciesNs; // one per query, all readers
+    size_t publishes = 0;
+};
+
+RunResult run(const std::vector<std::vector<std::string>>& tokens, const std::vector<std::string>& vocabulary,
+    unsigned numReaders, std::chrono::milliseconds publishInterval)
+{
+    ShardedConcurrentDictionary dict(16);
+    dict.publish();
+    std::atomic<bool> done { false };
+    RunResult result;
+
+    std::thread publisher([&] {
+        while (!done.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(publishInterval);
+            dict.publish();
+            ++result.publishes;
+        }
+    });
+
+    std::vector<std::vector<double>> latencies(numReaders);
+    std::vector<std::thread> readers;
+    for (unsigned r = 0; r < numReaders; ++r) {
+        readers.emplace_back([&, r] {
+            size_t found = 0;
+            for (size_t k = r; !done.load(std::memory_order_relaxed); k += 7) {
+                const std::string& word = vocabulary[k % vocabulary.size()];
+                auto start = std::chrono::steady_clock::now();
+                found += dict.snapshot().lookup(word).has_value();
+                auto end = std::chrono::steady_clock::now();
+                latencies[r].push_back(std::chrono::duration<double, std::nano>(end - start).count());
+            }
+            if (found == 0) {
+                latencies[r].clear();
+            }
+        });
+    }
+
+    double seconds = secondsFor([&] {
+        std::vector<std::thread> writers;
+        for (size_t w = 0; w < tokens.size(); ++w) {
+            writers.emplace_back([&, w] {
+                const auto& mine = tokens[w];
+                for (size_t k = 0; k < mine.size(); ++k) {
+                    dict.insert(mine[k], static_cast<int>(w * 1000000 + k / 4096));
+                }
+            });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+    });
+    done.store(true, std::memory_order_release);
+    publisher.join();
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    size_t totalInserts = tokens.size() * tokens[0].size();
+    result.insertsPerSecond = static_cast<double>(totalInserts) / seconds;
+    for (auto& mine : latencies) {
+        result.latenciesNs.insert(result.latenciesNs.end(), mine.begin(), mine.end());
+    }
+    std::sort(result.latenciesNs.begin(), result.latenciesNs.end());
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t insertsPerWriter = argc >= 2 ? std::stoul(argv[1]) : 2000000;
+    unsigned numWriters = argc >= 3 ? static_cast<unsigned>(std::stoul(argv[2])) : 2;
+    unsigned numReaders = argc >= 4 ? static_cast<unsigned>(std::stoul(argv[3])) : 2;
+    std::chrono::milliseconds publishInterval(argc >= 5 ? std::stoul(argv[4]) : 20);
+
+    std::vector<std::string> vocabulary = generateVocabulary(100000);
+    std::vector<std::vector<std::string>> tokens;
+    for (unsigned w = 0; w < std::max(1u, numWriters); ++w) {
+        tokens.push_back(generateTokens(vocabulary, insertsPerWriter, w + 1));
+    }
+    std::cout << tokens.size() << " writers x " << insertsPerWriter << " inserts, " << numReaders
+              << " readers, publish every " << publishInterval.count() << " ms" << std::endl;
+
+    RunResult alone = run(tokens, vocabulary, 0, publishInterval);
+    RunResult loaded = run(tokens, vocabulary, numReaders, publishInterval);
+
+    std::cout << "inserts without readers: " << alone.insertsPerSecond / 1e6 << " M/s, with readers: "
+              << loaded.insertsPerSecond / 1e6 << " M/s (" << loaded.publishes << " publishes)" << std::endl;
+    const auto& sorted = loaded.latenciesNs;
+    if (sorted.empty()) {
+        std::cout << "no queries completed" << std::endl;
+        return 0;
+    }
+    auto percentile = [&](double p) {
+        return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())))];
+    };
+    std::cout << sorted.size() << " queries, latency ns: p50 " << percentile(0.50) << ", p90 " << percentile(0.90)
+              << ", p99 " << percentile(0.99) << ", p99.9 " << percentile(0.999) << ", max " << sorted.back()
+              << std::endl;
+    return 0;
+}
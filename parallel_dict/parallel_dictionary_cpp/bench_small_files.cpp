@@ -0,0 +1,166 @@
+// Many-small-files ingestion: the current per-thread mmap path against the
+// staged pipeline with its pread and io_uring readers. Files are generated
+// into a temporary directory; every path is timed warm (files in the page
+// cache) and cold (pages dropped with posix_fadvise first, best effort).
+// Usage: bench_small_files [files] [bytes per file] [threads]
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench_common.hpp"
+#include "ingest_pipeline.hpp"
+#include "mapped_file.hpp"
+#include "sharded_dictionary.hpp"
+#include "tokenizer.hpp"
+
+std::vector<BookFile> writeFiles(const std::filesystem::path& dir, size_t numFiles, size_t bytesPerFile)
+{
+    std::vector<std::string> vocabulary = generateVocabulary(50000);
+    std::vector<BookFile> books;
+    for (size_t i = 0; i < numFiles; ++i) {
+        std::string text;
+        for (const std::string& word : generateTokens(vocabulary, bytesPerFile / 7 + 1, static_cast<unsigned>(i + 1))) {
+            text += word;
+            text += text.size() % 80 < 8 ? '\n' : ' ';
+            if (text.size() >= bytesPerFile) {
+                break;
+            }
+        }
+        std::string path = (dir / ("book" + std::to_string(i) + ".txt")).string();
+        std::ofstream(path, std::ios::binary) << text;
+        books.push_back({ path, text.size(), Compression::None, {} });
+    }
+    return books;
+}
+
+// asks the kernel to drop the files' cached pages so the next read goes to disk
+void dropCaches(const std::vector<BookFile>& books)
+{
+    for (const BookFile& book : books) {
+        int fd = ::open(book.path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fdatasync(fd);
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+}
+
+// total occurrences plus distinct words, the same for every path
+uint64_t checksum(const SingleOwnerDictionary& dict)
+{
+    uint64_t sum = 0;
+    dict.forEach([&](std::string_view, const DictionaryEntry& entry) {
+        sum += static_cast<uint64_t>(entry.wordCount) + 1;
+    });
+    return sum;
+}
+
+// what main does by default: threads claim whole books, map and tokenize them
+// into their own dictionaries, which are merged at the end
+uint64_t runCurrent(const std::vector<BookFile>& books, unsigned numThreads)
+{
+    std::vector<std::unique_ptr<SingleOwnerDictionary>> threadDicts;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threadDicts.emplace_back(std::make_unique<SingleOwnerDictionary>(16));
+    }
+    std::atomic<size_t> next { 0 };
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t] {
+            WordTokenizer tokenizer;
+            for (size_t i = next++; i < books.size(); i = next++) {
+                MappedFile file(books[i].path);
+                tokenizer.forEachWord(file.view(), [&](std::string_view word) {
+                    threadDicts[t]->insert(word, static_cast<int>(i));
+                });
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    SingleOwnerDictionary dict(16);
+    dict.mergeAll(threadDicts, numThreads, false);
+    return checksum(dict);
+}
+
+uint64_t runPipeline(const std::vector<BookFile>& books, unsigned numThreads, ReadBackend backend, bool& fellBack)
+{
+    PipelineConfig config;
+    config.backend = backend;
+    config.readers = 1;
+    config.inserters = std::max(1u, (numThreads - 1) / 3);
+    config.tokenizers = std::max(1u, numThreads - 1 - config.inserters);
+    config.bufferBytes = 256 * 1024;
+    SingleOwnerDictionary dict(16);
+    PipelineStats stats = IngestPipeline<SingleOwnerDictionary>(books, dict, config).run();
+    fellBack = stats.uringUnavailable;
+    return checksum(dict);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t numFiles = argc >= 2 ? std::stoul(argv[1]) : 20000;
+    size_t bytesPerFile = argc >= 3 ? std::stoul(argv[2]) : 4096;
+    unsigned numThreads = argc >= 4 ? static_cast<unsigned>(std::stoul(argv[3]))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+
+    std::filesystem::path dir
+        = std::filesystem::temp_directory_path() / ("bench_small_files." + std::to_string(::getpid()));
+    std::filesystem::create_directories(dir);
+    std::vector<BookFile> books = writeFiles(dir, numFiles, bytesPerFile);
+    uint64_t totalBytes = 0;
+    for (const BookFile& book : books) {
+        totalBytes += book.size;
+    }
+    std::cout << numFiles << " files, " << totalBytes / numFiles << " bytes each, " << numThreads << " threads"
+              << std::endl;
+
+    struct Path {
+        const char* name;
+        std::function<uint64_t()> run;
+    };
+    bool fellBack = false;
+    std::vector<Path> paths = {
+        { "current (mmap per book)", [&] { return runCurrent(books, numThreads); } },
+        { "pipeline, pread", [&] { return runPipeline(books, numThreads, ReadBackend::Pread, fellBack); } },
+        { "pipeline, io_uring", [&] { return runPipeline(books, numThreads, ReadBackend::Uring, fellBack); } },
+    };
+    uint64_t expected = 0;
+    for (bool cold : { false, true }) {
+        for (const Path& path : paths) {
+            if (cold) {
+                dropCaches(books);
+            } else {
+                path.run(); // warm the page cache
+            }
+            uint64_t sum = 0;
+            double seconds = secondsFor([&] { sum = path.run(); });
+            if (expected == 0) {
+                expected = sum;
+            }
+            std::cout << (cold ? "cold " : "warm ") << path.name << ": " << seconds << " seconds, "
+                      << static_cast<double>(numFiles) / seconds << " files/s, "
+                      << static_cast<double>(totalBytes) / seconds / 1e6 << " MB/s"
+                      << (fellBack && &path == &paths.back() ? " (io_uring unavailable, ran pread)" : "")
+                      << (sum == expected ? "" : " CHECKSUM DIFFERS") << std::endl;
+            if (sum != expected) {
+                std::filesystem::remove_all(dir);
+                return 1;
+            }
+        }
+    }
+    std::filesystem::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,262 @@
+// Sweeps parallel_dictionary over thread counts and shard counts on one
+// corpus (made with gen_corpus, or any books directory). Every run is a
+// fresh child process, so peak RSS is that configuration's alone. Reports
+// words/s, peak RSS and the per-phase times the binary logs ("<phase> took
+// <s> seconds.") and writes them as JSON to compare across commits. With
+// --workers the sweep is over map-reduce worker processes instead of threads.
+// Usage: bench_sweep <books dir> [--threads=1,2,4 | --workers=1,2,4] [--shards=1,16,64] [--repeats=N]
+//                    [--binary=./parallel_dictionary] [--out=FILE] [--label=TEXT] [-- extra args]
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench_common.hpp"
+#include "mapped_file.hpp"
+#include "tokenizer.hpp"
+
+struct RunResult {
+    bool ok = false;
+    double seconds = 0;
+    long peakRssKb = 0;
+    std::vector<std::pair<std::string, double>> phases;
+};
+
+// phases from lines ending in " took <s> seconds."
+std::vector<std::pair<std::string, double>> parsePhases(const std::string& log)
+{
+    std::vector<std::pair<std::string, double>> phases;
+    std::istringstream lines(log);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t took = line.rfind(" took ");
+        if (took == std::string::npos || line.size() < 9 || line.compare(line.size() - 9, 9, " seconds.") != 0) {
+            continue;
+        }
+        try {
+            phases.emplace_back(line.substr(0, took), std::stod(line.substr(took + 6)));
+        } catch (const std::exception&) {
+        }
+    }
+    return phases;
+}
+
+// runs binary with args, stdout discarded and stderr captured for the phase times
+RunResult runOnce(const std::string& binary, const std::vector<std::string>& args)
+{
+    RunResult result;
+    int errPipe[2];
+    if (::pipe(errPipe) != 0) {
+        return result;
+    }
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(binary.c_str()));
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    std::string log;
+    double seconds = secondsFor([&] {
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            int devNull = ::open("/dev/null", O_WRONLY);
+            ::dup2(devNull, STDOUT_FILENO);
+            ::dup2(errPipe[1], STDERR_FILENO);
+            ::close(errPipe[0]);
+            ::execv(binary.c_str(), argv.data());
+            ::_exit(127);
+        }
+        ::close(errPipe[1]);
+        char buffer[4096];
+        ssize_t got;
+        while ((got = ::read(errPipe[0], buffer, sizeof(buffer))) > 0) {
+            log.append(buffer, static_cast<size_t>(got));
+        }
+        ::close(errPipe[0]);
+        int status = 0;
+        rusage usage {};
+        if (pid > 0 && ::wait4(pid, &status, 0, &usage) == pid) {
+            result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            result.peakRssKb = usage.ru_maxrss;
+        }
+    });
+    result.seconds = seconds;
+    result.phases = parsePhases(log);
+    if (!result.ok) {
+        std::cerr << binary << " failed:\n" << log << std::endl;
+    }
+    return result;
+}
+
+// words the binary will insert, counted with the same tokenizer
+std::pair<uint64_t, uint64_t> countWordsAndBytes(const std::string& directory)
+{
+    WordTokenizer tokenizer;
+    uint64_t words = 0, bytes = 0;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+        if (entry.is_regular_file()) {
+            MappedFile file(entry.path().string());
+            bytes += file.view().size();
+            tokenizer.forEachWord(file.view(), [&](std::string_view) { ++words; });
+        }
+    }
+    return { words, bytes };
+}
+
+bool parseList(const std::string& text, std::vector<size_t>& out)
+{
+    out.clear();
+    std::istringstream items(text);
+    std::string item;
+    try {
+        while (std::getline(items, item, ',')) {
+            out.push_back(std::stoul(item));
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return !out.empty() && std::find(out.begin(), out.end(), 0) == out.end();
+}
+
+std::string jsonString(const std::string& text)
+{
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += static_cast<unsigned char>(c) < 0x20 ? ' ' : c;
+    }
+    return quoted + "\"";
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "Usage: bench_sweep <books dir> [--threads=1,2,4 | --workers=1,2,4] [--shards=1,16,64]"
+                     " [--repeats=N] [--binary=./parallel_dictionary] [--out=FILE] [--label=TEXT] [-- extra args]"
+                  << std::endl;
+        return 1;
+    }
+    std::string booksDir = argv[1];
+    unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> threadCounts = { 1, 2, 4 };
+    for (size_t t = 8; t <= hardwareThreads; t *= 2) {
+        threadCounts.push_back(t);
+    }
+    std::vector<size_t> workerCounts; // empty sweeps threads
+    std::vector<size_t> shardCounts = { 1, 16, 64, 256 };
+    size_t repeats = 3;
+    std::string binary = "./parallel_dictionary";
+    std::string outPath;
+    std::string label;
+    std::vector<std::string> extraArgs;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool valid = true;
+        if (arg == "--") {
+            extraArgs.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            valid = parseList(arg.substr(10), threadCounts);
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            valid = parseList(arg.substr(10), workerCounts);
+        } else if (arg.rfind("--shards=", 0) == 0) {
+            valid = parseList(arg.substr(9), shardCounts);
+        } else if (arg.rfind("--repeats=", 0) == 0) {
+            std::vector<size_t> value;
+            valid = parseList(arg.substr(10), value) && value.size() == 1;
+            repeats = valid ? value[0] : repeats;
+        } else if (arg.rfind("--binary=", 0) == 0) {
+            binary = arg.substr(9);
+        } else if (arg.rfind("--out=", 0) == 0) {
+            outPath = arg.substr(6);
+        } else if (arg.rfind("--label=", 0) == 0) {
+            label = arg.substr(8);
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            std::cerr << "Invalid option: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    auto [words, bytes] = countWordsAndBytes(booksDir);
+    std::cout << booksDir << ": " << words << " words, " << bytes / (1024 * 1024) << " MB, " << hardwareThreads
+              << " hardware threads, median of " << repeats << " runs" << std::endl;
+
+    std::ostringstream json;
+    json << "{\n  \"label\": " << jsonString(label) << ",\n  \"corpus\": " << jsonString(booksDir)
+         << ",\n  \"words\": " << words << ",\n  \"bytes\": " << bytes << ",\n  \"hardware_threads\": "
+         << hardwareThreads << ",\n  \"repeats\": " << repeats << ",\n  \"runs\": [";
+    bool first = true;
+    const std::string unit = workerCounts.empty() ? "threads" : "workers";
+    for (size_t count : workerCounts.empty() ? threadCounts : workerCounts) {
+        for (size_t shards : shardCounts) {
+            std::vector<std::string> args
+                = { booksDir, std::to_string(shards), "--" + unit + "=" + std::to_string(count) };
+            args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+            std::vector<RunResult> runs;
+            for (size_t r = 0; r < repeats; ++r) {
+                runs.push_back(runOnce(binary, args));
+                if (!runs.back().ok) {
+                    return 1;
+                }
+            }
+            std::sort(runs.begin(), runs.end(), [](const RunResult& a, const RunResult& b) {
+                return a.seconds < b.seconds;
+            });
+            const RunResult& median = runs[runs.size() / 2];
+            long peakRssKb = 0;
+            for (const RunResult& run : runs) {
+                peakRssKb = std::max(peakRssKb, run.peakRssKb);
+            }
+            double wordsPerSecond = static_cast<double>(words) / median.seconds;
+
+            std::cout << count << " " << unit << ", " << shards << " shards: " << median.seconds << " s (min "
+                      << runs.front().seconds << "), " << wordsPerSecond / 1e6 << " M words/s, "
+                      << peakRssKb / 1024 << " MB peak RSS";
+            for (const auto& [phase, seconds] : median.phases) {
+                std::cout << ", " << phase << " " << seconds << " s";
+            }
+            std::cout << std::endl;
+
+            json << (first ? "\n" : ",\n") << "    {\"" << unit << "\": " << count << ", \"shards\": " << shards
+                 << ", \"seconds\": " << median.seconds << ", \"min_seconds\": " << runs.front().seconds
+                 << ", \"words_per_second\": " << wordsPerSecond << ", \"peak_rss_kb\": " << peakRssKb
+                 << ", \"phases\": {";
+            for (size_t p = 0; p < median.phases.size(); ++p) {
+                json << (p == 0 ? "" : ", ") << jsonString(median.phases[p].first) << ": "
+                     << median.phases[p].second;
+            }
+            json << "}}";
+            first = false;
+        }
+    }
+    json << "\n  ]\n}\n";
+
+    if (!outPath.empty()) {
+        std::ofstream out(outPath, std::ios::trunc);
+        out << json.str();
+        if (!out) {
+            std::cerr << "Failed to write " << outPath << std::endl;
+            return 1;
+        }
+        std::cout << "Results written to " << outPath << std::endl;
+    }
+    return 0;
+}
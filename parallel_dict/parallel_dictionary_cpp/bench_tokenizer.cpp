@@ -0,0 +1,114 @@
+// Microbenchmark for the tokenizer kernels in tokenizer.hpp.
+// Usage: bench_tokenizer [text file] [repeats]
+// Without a file a deterministic mixed-case text with punctuation is generated.
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tokenizer.hpp"
+
+std::string generateText(size_t bytes)
+{
+    std::mt19937 gen(0); // Seeded for reproducibility
+    std::uniform_int_distribution<int> wordLength(1, 12);
+    std::uniform_int_distribution<int> letter(0, 25);
+    std::uniform_int_distribution<int> percent(0, 99);
+    const char separators[] = " ,.;:'-\n\t0123456789\"()";
+    std::string text;
+    text.reserve(bytes + 32);
+    while (text.size() < bytes) {
+        int length = wordLength(gen);
+        bool capital = percent(gen) < 10;
+        for (int i = 0; i < length; ++i) {
+            char c = static_cast<char>('a' + letter(gen));
+            text.push_back((capital && i == 0) || percent(gen) < 2 ? static_cast<char>(c - 32) : c);
+        }
+        text.push_back(percent(gen) < 80 ? ' ' : separators[percent(gen) % (sizeof(separators) - 1)]);
+        if (percent(gen) == 0) {
+            text.push_back(static_cast<char>(0xC3)); // some non-ascii bytes
+            text.push_back(static_cast<char>(0xA9));
+        }
+    }
+    return text;
+}
+
+template <typename Func>
+double timeIt(const char name[], size_t bytes, int repeats, Func run)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int r = 0; r < repeats; ++r) {
+        run();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+    double mbPerSec = static_cast<double>(bytes) * repeats / elapsed.count() / 1e6;
+    std::cout << name << " took " << elapsed.count() / repeats << " seconds, " << mbPerSec << " MB/s" << std::endl;
+    return mbPerSec;
+}
+
+std::vector<std::string> collectWords(WordTokenizer& tokenizer, const std::string& text)
+{
+    std::vector<std::string> words;
+    tokenizer.forEachWord(text, [&](std::string_view word) { words.emplace_back(word); });
+    return words;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string text;
+    if (argc >= 2) {
+        std::ifstream file(argv[1], std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file: " << argv[1] << std::endl;
+            return 1;
+        }
+        std::stringstream ss;
+        ss << file.rdbuf();
+        text = ss.str();
+    } else {
+        text = generateText(64 * 1024 * 1024);
+    }
+    int repeats = argc >= 3 ? std::stoi(argv[2]) : 5;
+    std::cout << "Tokenizing " << text.size() << " bytes, " << repeats << " repeats" << std::endl;
+
+    // correctness: every kernel has to produce exactly what splitToWords does
+    std::vector<std::string> reference = splitToWords(text);
+    std::vector<std::pair<const char*, TokenizeKernel>> kernels = { { "scalar", tokenizeScalar } };
+#ifdef PD_TOKENIZER_X86
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.emplace_back("avx2", tokenizeAvx2);
+    } else {
+        std::cout << "avx2 not supported, skipping" << std::endl;
+    }
+#endif
+    for (const auto& [name, kernel] : kernels) {
+        WordTokenizer tokenizer(kernel);
+        bool same = collectWords(tokenizer, text) == reference;
+        std::cout << name << " output " << (same ? "matches" : "DIFFERS FROM") << " splitToWords ("
+                  << reference.size() << " words)" << std::endl;
+        if (!same) {
+            return 1;
+        }
+    }
+
+    // sink so the word loops aren't optimized away
+    size_t checksum = 0;
+    double baseline = timeIt("splitToWords", text.size(), repeats, [&] {
+        for (const auto& word : splitToWords(text)) {
+            checksum += word.size();
+        }
+    });
+    for (const auto& [name, kernel] : kernels) {
+        WordTokenizer tokenizer(kernel);
+        double mbPerSec = timeIt(name, text.size(), repeats, [&] {
+            tokenizer.forEachWord(text, [&](std::string_view word) { checksum += word.size() + word[0]; });
+        });
+        std::cout << "  " << mbPerSec / baseline << "x splitToWords" << std::endl;
+    }
+    std::cout << "checksum " << checksum << std::endl;
+    return 0;
+}
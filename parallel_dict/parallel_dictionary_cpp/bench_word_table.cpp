@@ -0,0 +1,88 @@
+// Shard table comparison: the open-addressing OpenWordTable against the
+// std::unordered_map<std::string, DictionaryEntry> shards used before it.
+// Usage: bench_word_table [tokens] [vocabulary size]
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "bench_common.hpp"
+#include "sharded_dictionary.hpp"
+
+struct TransparentHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const { return std::hash<std::string_view> {}(key); }
+};
+
+using StdWordTable = std::unordered_map<std::string, DictionaryEntry, TransparentHash, std::equal_to<>>;
+
+int main(int argc, char* argv[])
+{
+    size_t numTokens = argc >= 2 ? std::stoul(argv[1]) : 5000000;
+    size_t vocabularySize = argc >= 3 ? std::stoul(argv[2]) : 200000;
+    std::vector<std::string> vocabulary = generateVocabulary(vocabularySize);
+    std::vector<std::string> tokens = generateTokens(vocabulary, numTokens, 1);
+    std::cout << numTokens << " tokens over a " << vocabularySize << " word vocabulary" << std::endl;
+
+    // what insert() does per word: find or add, bump the count, add the book
+    size_t checksum = 0;
+    StdWordTable stdTable;
+    double stdInsert = secondsFor([&] {
+        for (size_t k = 0; k < tokens.size(); ++k) {
+            std::string_view word = tokens[k];
+            auto it = stdTable.find(word);
+            if (it == stdTable.end()) {
+                it = stdTable.emplace(std::string(word), DictionaryEntry {}).first;
+            }
+            it->second.wordCount++;
+            it->second.bookIds.insert(static_cast<int>(k / 4096));
+        }
+    });
+    double stdLookup = secondsFor([&] {
+        for (const auto& word : vocabulary) {
+            auto it = stdTable.find(std::string_view(word));
+            checksum += it == stdTable.end() ? 0 : static_cast<size_t>(it->second.wordCount);
+        }
+    });
+
+    WordTable openTable;
+    double openInsert = secondsFor([&] {
+        for (size_t k = 0; k < tokens.size(); ++k) {
+            std::string_view word = tokens[k];
+            auto& entry = *openTable.tryEmplace(word, WordHash {}(word)).first;
+            entry.wordCount++;
+            entry.bookIds.insert(static_cast<int>(k / 4096));
+        }
+    });
+    double openLookup = secondsFor([&] {
+        for (const auto& word : vocabulary) {
+            const DictionaryEntry* entry = openTable.find(word, WordHash {}(word));
+            checksum += entry == nullptr ? 0 : static_cast<size_t>(entry->wordCount);
+        }
+    });
+
+    double stdErase = secondsFor([&] {
+        std::erase_if(stdTable, [](const auto& item) { return item.second.wordCount == 1; });
+    });
+    double openErase = secondsFor([&] {
+        openTable.eraseIf([](std::string_view, const DictionaryEntry& entry) { return entry.wordCount == 1; });
+    });
+    if (stdTable.size() != openTable.size()) {
+        std::cout << "size mismatch after erase: " << stdTable.size() << " vs " << openTable.size() << std::endl;
+        return 1;
+    }
+
+    auto report = [](const char name[], double stdSeconds, double openSeconds, size_t ops) {
+        std::cout << name << ": unordered_map " << stdSeconds * 1e9 / ops << " ns, open table "
+                  << openSeconds * 1e9 / ops << " ns, speedup " << stdSeconds / openSeconds << "x" << std::endl;
+    };
+    report("insert", stdInsert, openInsert, tokens.size());
+    report("lookup (every vocabulary word)", stdLookup, openLookup, vocabulary.size());
+    report("erase singles (per entry)", stdErase, openErase, vocabulary.size());
+    std::cout << "open table slots + arena: " << openTable.memoryBytes() / 1024 << " KB for "
+              << openTable.size() << " words" << std::endl;
+    std::cout << "checksum " << checksum << std::endl;
+    return 0;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <utility>
+
+// Bounded lock-free multi-producer multi-consumer queue (Vyukov's array
+// queue). Every cell carries a sequence number that says whether it is ready
+// for the producer or the consumer of a given ticket, so push and pop each
+// take one CAS on their own index and never block one another. Capacity is
+// rounded up to a power of two and fixed, so the memory in flight between
+// two pipeline stages is too.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        mask_ = size - 1;
+        cells_ = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // false if the queue is full
+    bool tryPush(T value)
+    {
+        size_t ticket = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[ticket & mask_];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(ticket);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(ticket + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                ticket = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // false if the queue is empty
+    bool tryPop(T& value)
+    {
+        size_t ticket = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[ticket & mask_];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(ticket + 1);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(ticket + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                ticket = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    // producers and consumers hammer different indices, keep them apart
+    alignas(64) std::atomic<size_t> tail_ { 0 };
+    alignas(64) std::atomic<size_t> head_ { 0 };
+};
+
+// Backoff for a stage waiting on a full or empty queue: spin briefly, then
+// yield so a stage sharing the core can run.
+class QueueBackoff {
+public:
+    void wait()
+    {
+        if (++spins_ < kSpins) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    void reset() { spins_ = 0; }
+
+private:
+    static constexpr unsigned kSpins = 64;
+    unsigned spins_ = 0;
+};
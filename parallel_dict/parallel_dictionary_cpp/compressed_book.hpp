@@ -0,0 +1,314 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+#ifdef PD_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tokenizer.hpp"
+
+// Books stored compressed, gzip (.gz) or zstd (.zst, built in with make
+// ZSTD=1), are decompressed while they are tokenized: the decoder writes
+// into one fixed buffer that is handed to the tokenizer up to the last word
+// boundary and refilled, so no book is ever held decompressed in memory.
+// Books are decoded in parallel like plain ones, one per task, and a zstd
+// book of several frames can be cut into ranges of whole frames that are
+// decoded in parallel too (frames are independent, gzip members aren't
+// findable without decoding).
+
+enum class Compression {
+    None,
+    Gzip,
+    Zstd,
+};
+
+#ifdef PD_ZSTD
+inline constexpr bool kZstdSupported = true;
+#else
+inline constexpr bool kZstdSupported = false;
+#endif
+
+// what a book is stored as, going by its name
+inline Compression compressionFromName(std::string_view path)
+{
+    auto endsWith = [&](std::string_view suffix) {
+        return path.size() > suffix.size() && path.substr(path.size() - suffix.size()) == suffix;
+    };
+    if (endsWith(".gz")) {
+        return Compression::Gzip;
+    }
+    if (endsWith(".zst")) {
+        return Compression::Zstd;
+    }
+    return Compression::None;
+}
+
+// Offsets of the frames of a zstd book, empty when it is a single frame,
+// isn't valid zstd or zstd isn't built in. Only the frame and block headers
+// are read, not decoded.
+inline std::vector<uint64_t> zstdFrameOffsets(std::string_view data)
+{
+    std::vector<uint64_t> offsets;
+#ifdef PD_ZSTD
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t frame = ZSTD_findFrameCompressedSize(data.data() + pos, data.size() - pos);
+        if (ZSTD_isError(frame) || frame == 0) {
+            return {};
+        }
+        offsets.push_back(pos);
+        pos += frame;
+    }
+#else
+    (void)data;
+#endif
+    if (offsets.size() < 2) {
+        offsets.clear();
+    }
+    return offsets;
+}
+
+// The letters a decoded range of a book could share with its neighbours: a
+// range that doesn't start the book may start in the middle of a word the
+// previous range ends with, so its leading letters are held back in head,
+// and likewise the trailing letters of a range that doesn't end it in tail.
+// solid is a range without a single word break, all of it is in head.
+struct RangeEdges {
+    std::string head;
+    std::string tail;
+    bool solid = false;
+};
+
+// Output buffer of a decoder: it writes into space(), commit() hands text up
+// to the last non-letter to the consumer and keeps the cut word at the front
+// for the next round, finish() deals with what is left.
+class WordBoundaryBuffer {
+public:
+    static constexpr size_t kBufferBytes = 256 * 1024;
+
+    WordBoundaryBuffer(bool holdHead, bool holdTail, RangeEdges& edges)
+        : buffer_(kBufferBytes)
+        , holdHead_(holdHead)
+        , holdTail_(holdTail)
+        , edges_(edges)
+    {
+    }
+
+    // free space after what is carried over, grown when one word filled it all
+    char* space()
+    {
+        if (filled_ == buffer_.size()) {
+            buffer_.resize(buffer_.size() * 2);
+        }
+        return buffer_.data() + filled_;
+    }
+
+    size_t spaceSize() const { return buffer_.size() - filled_; }
+
+    // calls text(std::string_view) with the complete words of the n bytes
+    // just written to space() and what was carried over
+    template <typename Fn>
+    void commit(size_t n, Fn&& text)
+    {
+        filled_ += n;
+        size_t cut = filled_;
+        while (cut > 0 && isAsciiLetter(static_cast<unsigned char>(buffer_[cut - 1]))) {
+            --cut;
+        }
+        if (cut == 0) {
+            return;
+        }
+        std::string_view ready(buffer_.data(), cut);
+        if (holdHead_ && !headDone_) {
+            size_t letters = 0;
+            while (isAsciiLetter(static_cast<unsigned char>(ready[letters]))) {
+                ++letters;
+            }
+            edges_.head.assign(ready.data(), letters);
+            ready.remove_prefix(letters);
+            headDone_ = true;
+        }
+        text(ready);
+        decoded_ += cut;
+        std::memmove(buffer_.data(), buffer_.data() + cut, filled_ - cut);
+        filled_ -= cut;
+    }
+
+    // the last word, held back in edges or handed to text
+    template <typename Fn>
+    void finish(Fn&& text)
+    {
+        std::string_view rest(buffer_.data(), filled_);
+        if (holdHead_ && !headDone_) {
+            edges_.head.assign(rest);
+            edges_.solid = holdTail_;
+        } else if (holdTail_) {
+            edges_.tail.assign(rest);
+        } else {
+            text(rest);
+        }
+        decoded_ += filled_;
+        filled_ = 0;
+    }
+
+    // decompressed bytes so far
+    uint64_t decoded() const { return decoded_; }
+
+private:
+    std::vector<char> buffer_;
+    size_t filled_ = 0;
+    uint64_t decoded_ = 0;
+    bool holdHead_;
+    bool holdTail_;
+    bool headDone_ = false;
+    RangeEdges& edges_;
+};
+
+// gzip or zlib, concatenated members included, through out
+template <typename Fn>
+bool inflateBook(std::string_view data, WordBoundaryBuffer& out, Fn&& text)
+{
+    z_stream stream {};
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) { // +32 detects the gzip or zlib header
+        return false;
+    }
+    size_t pos = 0;
+    bool ok = true;
+    while (true) {
+        if (stream.avail_in == 0 && pos < data.size()) {
+            size_t feed = std::min<size_t>(data.size() - pos, UINT_MAX);
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data() + pos));
+            stream.avail_in = static_cast<uInt>(feed);
+            pos += feed;
+        }
+        stream.next_out = reinterpret_cast<Bytef*>(out.space());
+        stream.avail_out = static_cast<uInt>(std::min<size_t>(out.spaceSize(), UINT_MAX));
+        uInt before = stream.avail_out;
+        int status = inflate(&stream, Z_NO_FLUSH);
+        out.commit(before - stream.avail_out, text);
+        if (status == Z_STREAM_END) {
+            if (stream.avail_in == 0 && pos == data.size()) {
+                break;
+            }
+            inflateReset(&stream); // another member follows
+        } else if (status != Z_OK) {
+            ok = false; // corrupt, or Z_BUF_ERROR: truncated
+            break;
+        }
+    }
+    inflateEnd(&stream);
+    return ok;
+}
+
+#ifdef PD_ZSTD
+// the frames in data through out
+template <typename Fn>
+bool decompressZstdFrames(std::string_view data, WordBoundaryBuffer& out, Fn&& text)
+{
+    ZSTD_DStream* stream = ZSTD_createDStream();
+    if (stream == nullptr) {
+        return false;
+    }
+    ZSTD_initDStream(stream);
+    ZSTD_inBuffer in { data.data(), data.size(), 0 };
+    size_t status = 0;
+    bool ok = true;
+    while (true) {
+        ZSTD_outBuffer chunk { out.space(), out.spaceSize(), 0 };
+        status = ZSTD_decompressStream(stream, &chunk, &in);
+        if (ZSTD_isError(status)) {
+            ok = false;
+            break;
+        }
+        out.commit(chunk.pos, text);
+        // all input taken and the output not full: everything is flushed
+        if (in.pos == in.size && chunk.pos < chunk.size) {
+            break;
+        }
+    }
+    ZSTD_freeDStream(stream);
+    return ok && status == 0; // non-zero: the last frame is truncated
+}
+#endif
+
+// Decompresses data, or the frames starting in [begin, end) of it, and calls
+// text(std::string_view) with the result in pieces that never cut a word.
+// A range that doesn't cover the whole book holds the letters at its ends
+// back in edges (see RangeEdges). Adds the decompressed size to decoded.
+// False if the data is corrupt or zstd isn't built in.
+template <typename Fn>
+bool forEachDecompressedText(std::string_view data, Compression compression, size_t begin, size_t end,
+    RangeEdges& edges, uint64_t& decoded, Fn&& text)
+{
+    begin = std::min(begin, data.size());
+    end = std::min(end, data.size());
+    WordBoundaryBuffer out(begin != 0, end != data.size(), edges);
+    std::string_view range = data.substr(begin, end - begin);
+    bool ok = false;
+    if (compression == Compression::Gzip) {
+        ok = inflateBook(range, out, text);
+#ifdef PD_ZSTD
+    } else if (compression == Compression::Zstd) {
+        ok = decompressZstdFrames(range, out, text);
+#endif
+    }
+    out.finish(text);
+    decoded += out.decoded();
+    return ok;
+}
+
+// Joins the words cut between the ranges a book was split into. Every range
+// adds its edges when it is done; the thread adding the last range of a book
+// gets the book's joined words back. Thread safe.
+class BookSeams {
+public:
+    // calls word(std::string_view letters) for each word completed by the
+    // range [begin, ...) of bookIndex, once all ranges of it are in
+    template <typename Fn>
+    void add(size_t bookIndex, size_t numRanges, size_t begin, RangeEdges&& edges, Fn&& word)
+    {
+        std::vector<std::pair<size_t, RangeEdges>> ranges;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& pending = books_[bookIndex];
+            pending.emplace_back(begin, std::move(edges));
+            if (pending.size() < numRanges) {
+                return;
+            }
+            ranges = std::move(pending);
+            books_.erase(bookIndex);
+        }
+        std::sort(ranges.begin(), ranges.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        // the first range keeps its head, the last its tail
+        std::string current;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            const RangeEdges& range = ranges[i].second;
+            current += range.head;
+            if (range.solid) {
+                continue;
+            }
+            if (!current.empty()) {
+                word(std::string_view(current));
+            }
+            current = range.tail;
+        }
+        if (!current.empty()) {
+            word(std::string_view(current));
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<size_t, std::vector<std::pair<size_t, RangeEdges>>> books_;
+};
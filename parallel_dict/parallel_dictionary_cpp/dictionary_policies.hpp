@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Policies BasicShardedDictionary is specialized on at compile time, the
+// defaults are what the program runs with, the rest are there to measure
+// against them (bench_policies). Every policy is a plain type the dictionary
+// calls directly, nothing is virtual.
+//
+//   Lock      lock(), unlock(), try_lock(): std::mutex, SpinLock, NoLock
+//   Hash      uint64_t operator()(std::string_view): WordHash, WyHash
+//   ShardMap  constructed from the requested shard count, count() and
+//             operator()(hash) -> shard: ModuloShards, MaskShards
+//   Postings  insert(id), erase(id), size(), empty(), forEach(fn) in
+//             increasing order, unionWith(&&), memoryBytes(): PostingList,
+//             SortedVectorPostings, HashSetPostings (unordered)
+
+// lock policy for dictionaries only ever touched by one thread, lock_guard
+// over it compiles to nothing
+struct NoLock {
+    void lock() { }
+    void unlock() { }
+    bool try_lock() { return true; }
+};
+
+// Test-and-test-and-set lock for critical sections of a few dozen
+// instructions. Waiters spin on a plain load, and yield after a while so a
+// preempted holder on an oversubscribed machine still gets to run.
+class SpinLock {
+public:
+    void lock()
+    {
+        while (locked_.exchange(true, std::memory_order_acquire)) {
+            for (unsigned spins = 0; locked_.load(std::memory_order_relaxed); ++spins) {
+                if (spins < 64) {
+                    pause();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    bool try_lock()
+    {
+        return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() { locked_.store(false, std::memory_order_release); }
+
+private:
+    std::atomic<bool> locked_ { false };
+
+    static void pause()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+};
+
+// wyhash (final4), two 64x64->128 multiplies per 16 bytes; words are short,
+// so almost every call is the <= 16 byte path
+struct WyHash {
+    uint64_t operator()(std::string_view key) const
+    {
+        constexpr uint64_t kSecret[4]
+            = { 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull };
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(key.data());
+        size_t length = key.size();
+        uint64_t seed = mix(kSecret[0], kSecret[1]);
+        uint64_t a = 0, b = 0;
+        if (length <= 16) {
+            if (length >= 4) {
+                size_t step = (length >> 3) << 2;
+                a = (read4(p) << 32) | read4(p + step);
+                b = (read4(p + length - 4) << 32) | read4(p + length - 4 - step);
+            } else if (length > 0) {
+                a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[length >> 1]) << 8) | p[length - 1];
+            }
+        } else {
+            size_t left = length;
+            if (left > 48) {
+                uint64_t seed1 = seed, seed2 = seed;
+                do {
+                    seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+                    seed1 = mix(read8(p + 16) ^ kSecret[2], read8(p + 24) ^ seed1);
+                    seed2 = mix(read8(p + 32) ^ kSecret[3], read8(p + 40) ^ seed2);
+                    p += 48;
+                    left -= 48;
+                } while (left > 48);
+                seed ^= seed1 ^ seed2;
+            }
+            while (left > 16) {
+                seed = mix(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+                p += 16;
+                left -= 16;
+            }
+            a = read8(p + left - 16);
+            b = read8(p + left - 8);
+        }
+        a ^= kSecret[1];
+        b ^= seed;
+        multiply(a, b);
+        return mix(a ^ kSecret[0] ^ length, b ^ kSecret[1]);
+    }
+
+private:
+    static void multiply(uint64_t& a, uint64_t& b)
+    {
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        a = static_cast<uint64_t>(product);
+        b = static_cast<uint64_t>(product >> 64);
+    }
+
+    static uint64_t mix(uint64_t a, uint64_t b)
+    {
+        multiply(a, b);
+        return a ^ b;
+    }
+
+    static uint64_t read8(const unsigned char* p)
+    {
+        uint64_t value;
+        std::memcpy(&value, p, 8);
+        return value;
+    }
+
+    static uint64_t read4(const unsigned char* p)
+    {
+        uint32_t value;
+        std::memcpy(&value, p, 4);
+        return value;
+    }
+};
+
+// hash % count, any shard count
+class ModuloShards {
+public:
+    explicit ModuloShards(size_t count)
+        : count_(std::max<size_t>(count, 1))
+    {
+    }
+
+    size_t count() const { return count_; }
+    size_t operator()(uint64_t hash) const { return hash % count_; }
+
+private:
+    size_t count_;
+};
+
+// hash & (count - 1), the shard count rounded up to a power of two so a
+// shard costs an and instead of a division
+class MaskShards {
+public:
+    explicit MaskShards(size_t count)
+        : mask_(std::bit_ceil(std::max<size_t>(count, 1)) - 1)
+    {
+    }
+
+    size_t count() const { return mask_ + 1; }
+    size_t operator()(uint64_t hash) const { return hash & mask_; }
+
+private:
+    size_t mask_;
+};
+
+// book ids as a plain sorted vector, 4 bytes an id
+class SortedVectorPostings {
+public:
+    void insert(int bookId)
+    {
+        uint32_t id = static_cast<uint32_t>(bookId);
+        if (ids_.empty() || id > ids_.back()) {
+            ids_.push_back(id);
+            return;
+        }
+        auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+        if (*it != id) {
+            ids_.insert(it, id);
+        }
+    }
+
+    bool erase(int bookId)
+    {
+        auto it = std::lower_bound(ids_.begin(), ids_.end(), static_cast<uint32_t>(bookId));
+        if (it == ids_.end() || *it != static_cast<uint32_t>(bookId)) {
+            return false;
+        }
+        ids_.erase(it);
+        return true;
+    }
+
+    size_t size() const { return ids_.size(); }
+    bool empty() const { return ids_.empty(); }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const
+    {
+        for (uint32_t id : ids_) {
+            fn(static_cast<int>(id));
+        }
+    }
+
+    void unionWith(SortedVectorPostings&& other)
+    {
+        if (ids_.empty()) {
+            ids_.swap(other.ids_);
+            return;
+        }
+        std::vector<uint32_t> merged;
+        merged.reserve(ids_.size() + other.ids_.size());
+        std::set_union(ids_.begin(), ids_.end(), other.ids_.begin(), other.ids_.end(), std::back_inserter(merged));
+        ids_.swap(merged);
+    }
+
+    size_t memoryBytes() const { return ids_.capacity() * sizeof(uint32_t); }
+
+private:
+    std::vector<uint32_t> ids_;
+};
+
+// book ids in a std::unordered_set, what the dictionary started out with;
+// forEach is in no particular order
+class HashSetPostings {
+public:
+    void insert(int bookId) { ids_.insert(bookId); }
+    bool erase(int bookId) { return ids_.erase(bookId) != 0; }
+    size_t size() const { return ids_.size(); }
+    bool empty() const { return ids_.empty(); }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const
+    {
+        for (int id : ids_) {
+            fn(id);
+        }
+    }
+
+    void unionWith(HashSetPostings&& other)
+    {
+        if (ids_.size() < other.ids_.size()) {
+            ids_.swap(other.ids_);
+        }
+        ids_.insert(other.ids_.begin(), other.ids_.end());
+    }
+
+    // bucket array plus a node of id, next pointer and cached hash per id
+    size_t memoryBytes() const { return ids_.bucket_count() * sizeof(void*) + ids_.size() * 24; }
+
+private:
+    std::unordered_set<int> ids_;
+};
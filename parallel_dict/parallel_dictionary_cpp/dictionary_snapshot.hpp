@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "posting_list.hpp"
+
+// what a dictionary keeps per word, Postings holds the ids of its books
+template <typename Postings>
+struct BasicDictionaryEntry {
+    int wordCount = 0;
+    Postings bookIds;
+};
+
+using DictionaryEntry = BasicDictionaryEntry<PostingList>;
+
+// hashes the same as std::hash<std::string>, computed once per word for both
+// the shard index and the slot in the shard's table
+struct WordHash {
+    size_t operator()(std::string_view key) const
+    {
+        return std::hash<std::string_view> {}(key);
+    }
+};
+
+// Immutable copy of one shard, sorted by word hash so building it is an
+// integer sort. Built by the writer side when a dictionary publishes and
+// never touched again, so readers need no locks.
+class ShardSnapshot {
+public:
+    struct Item {
+        std::string word;
+        DictionaryEntry entry;
+        size_t hash = 0;
+    };
+
+    explicit ShardSnapshot(std::vector<Item> items)
+        : items_(std::move(items))
+    {
+        for (Item& item : items_) {
+            item.hash = WordHash {}(item.word);
+        }
+        std::sort(items_.begin(), items_.end(), [](const Item& a, const Item& b) { return a.hash < b.hash; });
+    }
+
+    const DictionaryEntry* find(std::string_view word) const
+    {
+        size_t hash = WordHash {}(word);
+        auto it = std::lower_bound(items_.begin(), items_.end(), hash,
+            [](const Item& item, size_t key) { return item.hash < key; });
+        for (; it != items_.end() && it->hash == hash; ++it) {
+            if (it->word == word) {
+                return &it->entry;
+            }
+        }
+        return nullptr;
+    }
+
+    const std::vector<Item>& items() const { return items_; }
+
+private:
+    std::vector<Item> items_;
+};
+
+// A dictionary as of one publish: one shard snapshot per shard. Shards that
+// did not change since the previous publish share its ShardSnapshot.
+struct DictionarySnapshot {
+    uint64_t version = 0;
+    std::vector<std::shared_ptr<const ShardSnapshot>> shards;
+
+    const DictionaryEntry* find(std::string_view word) const
+    {
+        if (shards.empty()) {
+            return nullptr;
+        }
+        return shards[WordHash {}(word) % shards.size()]->find(word);
+    }
+};
+
+// Read side of the query API. Holds published snapshots of one or more
+// dictionaries (e.g. every per-thread dictionary during ingestion) and
+// answers queries over their sum. Copies are cheap, and the snapshots it
+// holds stay alive and unchanged however far the writers move on.
+class QuerySnapshot {
+public:
+    struct WordStats {
+        int wordCount = 0;
+        size_t bookCount = 0;
+    };
+
+    QuerySnapshot() = default;
+
+    explicit QuerySnapshot(std::vector<std::shared_ptr<const DictionarySnapshot>> layers)
+        : layers_(std::move(layers))
+    {
+    }
+
+    std::optional<WordStats> lookup(std::string_view word) const
+    {
+        if (layers_.size() == 1) {
+            const DictionaryEntry* entry = layers_[0]->find(word);
+            if (entry == nullptr) {
+                return std::nullopt;
+            }
+            return WordStats { entry->wordCount, entry->bookIds.size() };
+        }
+        std::optional<DictionaryEntry> merged = combined(word);
+        if (!merged) {
+            return std::nullopt;
+        }
+        return WordStats { merged->wordCount, merged->bookIds.size() };
+    }
+
+    bool contains(std::string_view word) const
+    {
+        for (const auto& layer : layers_) {
+            if (layer->find(word) != nullptr) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // ids of the books containing word, in increasing order
+    std::vector<int> books(std::string_view word) const
+    {
+        std::vector<int> ids;
+        if (std::optional<DictionaryEntry> merged = combined(word)) {
+            merged->bookIds.forEach([&](int bookId) { ids.push_back(bookId); });
+        }
+        return ids;
+    }
+
+    // the k most frequent words, most frequent first, ties broken by word
+    std::vector<std::pair<std::string, int>> topK(size_t k) const
+    {
+        std::vector<std::pair<std::string_view, int>> counts;
+        if (layers_.size() == 1) {
+            for (const auto& shard : layers_[0]->shards) {
+                for (const auto& item : shard->items()) {
+                    counts.emplace_back(item.word, item.entry.wordCount);
+                }
+            }
+        } else {
+            std::unordered_map<std::string_view, int> totals;
+            for (const auto& layer : layers_) {
+                for (const auto& shard : layer->shards) {
+                    for (const auto& item : shard->items()) {
+                        totals[item.word] += item.entry.wordCount;
+                    }
+                }
+            }
+            counts.assign(totals.begin(), totals.end());
+        }
+        auto byCount = [](const auto& a, const auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        };
+        k = std::min(k, counts.size());
+        std::partial_sort(counts.begin(), counts.begin() + k, counts.end(), byCount);
+        std::vector<std::pair<std::string, int>> top;
+        for (size_t i = 0; i < k; ++i) {
+            top.emplace_back(std::string(counts[i].first), counts[i].second);
+        }
+        return top;
+    }
+
+private:
+    std::vector<std::shared_ptr<const DictionarySnapshot>> layers_;
+
+    std::optional<DictionaryEntry> combined(std::string_view word) const
+    {
+        std::optional<DictionaryEntry> merged;
+        for (const auto& layer : layers_) {
+            const DictionaryEntry* entry = layer->find(word);
+            if (entry == nullptr) {
+                continue;
+            }
+            if (!merged) {
+                merged.emplace();
+            }
+            merged->wordCount += entry->wordCount;
+            merged->bookIds.unionWith(PostingList(entry->bookIds));
+        }
+        return merged;
+    }
+};
@@ -0,0 +1,255 @@
+// Deterministic synthetic corpus for benchmarking parallel_dictionary.
+// Words are drawn from a Zipfian vocabulary, file sizes from a fixed,
+// uniform or lognormal distribution around the mean. The same options give
+// the same books: all randomness comes from splitmix64 seeded per book, not
+// from the standard library distributions, whose output varies by library.
+//
+// Usage: gen_corpus <dir> [--files=N] [--mean-kb=N] [--size-dist=fixed|uniform|lognormal]
+//                         [--vocab=N] [--zipf=S] [--seed=N]
+//
+// Books are written to <dir>/books. <dir>/corpus.params records the options
+// they were made with; when it matches, the corpus is left as it is.
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct CorpusOptions {
+    size_t files = 1000;
+    size_t meanKb = 64;
+    std::string sizeDist = "lognormal";
+    size_t vocab = 100000;
+    double zipf = 1.0;
+    uint64_t seed = 1;
+
+    std::string describe() const
+    {
+        std::ostringstream out;
+        out << "files=" << files << " mean-kb=" << meanKb << " size-dist=" << sizeDist << " vocab=" << vocab
+            << " zipf=" << zipf << " seed=" << seed << "\n";
+        return out.str();
+    }
+};
+
+class SplitMix64 {
+public:
+    explicit SplitMix64(uint64_t seed)
+        : state_(seed)
+    {
+    }
+
+    uint64_t next()
+    {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, 1)
+    double unit() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+
+    // standard normal, Box-Muller
+    double normal()
+    {
+        double u = 1.0 - unit();
+        return std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * M_PI * unit());
+    }
+
+private:
+    uint64_t state_;
+};
+
+// distinct lowercase words; frequent (low rank) words tend to be shorter,
+// like in real text
+std::vector<std::string> makeVocabulary(size_t size, uint64_t seed)
+{
+    SplitMix64 rng(seed);
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> words;
+    words.reserve(size);
+    while (words.size() < size) {
+        size_t base = 2 + static_cast<size_t>(std::log2(static_cast<double>(words.size() + 1)) / 2);
+        size_t length = std::min<size_t>(base + rng.next() % 4, 16);
+        std::string word;
+        for (size_t i = 0; i < length; ++i) {
+            word.push_back(static_cast<char>('a' + rng.next() % 26));
+        }
+        if (seen.insert(word).second) {
+            words.push_back(std::move(word));
+        }
+    }
+    return words;
+}
+
+// cumulative 1 / rank^s weights, normalized to end at 1
+std::vector<double> zipfCdf(size_t size, double s)
+{
+    std::vector<double> cdf(size);
+    double total = 0;
+    for (size_t i = 0; i < size; ++i) {
+        total += 1.0 / std::pow(static_cast<double>(i + 1), s);
+        cdf[i] = total;
+    }
+    for (double& value : cdf) {
+        value /= total;
+    }
+    return cdf;
+}
+
+size_t bookBytes(const CorpusOptions& options, SplitMix64& rng)
+{
+    double mean = static_cast<double>(options.meanKb) * 1024;
+    double bytes = mean;
+    if (options.sizeDist == "uniform") {
+        bytes = 2 * mean * rng.unit();
+    } else if (options.sizeDist == "lognormal") {
+        const double sigma = 1.0; // heavy tail: a few books many times the mean
+        bytes = mean * std::exp(sigma * rng.normal() - sigma * sigma / 2);
+    }
+    return std::max<size_t>(static_cast<size_t>(bytes), 64);
+}
+
+// a book of about bytes characters: sentences of Zipfian words, capitalized
+// and punctuated, wrapped at ~72 columns
+std::string makeBook(size_t bytes, const std::vector<std::string>& vocabulary, const std::vector<double>& cdf,
+    SplitMix64& rng)
+{
+    std::string text;
+    text.reserve(bytes + 32);
+    size_t column = 0;
+    bool sentenceStart = true;
+    while (text.size() < bytes) {
+        size_t rank = static_cast<size_t>(std::upper_bound(cdf.begin(), cdf.end(), rng.unit()) - cdf.begin());
+        const std::string& word = vocabulary[std::min(rank, vocabulary.size() - 1)];
+        if (column + word.size() > 72) {
+            text.push_back('\n');
+            column = 0;
+        } else if (column != 0) {
+            text.push_back(' ');
+            ++column;
+        }
+        size_t at = text.size();
+        text += word;
+        if (sentenceStart) {
+            text[at] = static_cast<char>(text[at] - 'a' + 'A');
+        }
+        column += word.size();
+        uint64_t roll = rng.next() % 100;
+        sentenceStart = roll < 7;
+        if (sentenceStart) {
+            text.push_back('.');
+            ++column;
+        } else if (roll < 12) {
+            text.push_back(',');
+            ++column;
+        }
+    }
+    text.push_back('\n');
+    return text;
+}
+
+bool parseOption(const std::string& arg, CorpusOptions& options)
+{
+    auto value = [&](const char name[], std::string& out) {
+        std::string prefix = std::string(name) + "=";
+        if (arg.rfind(prefix, 0) != 0) {
+            return false;
+        }
+        out = arg.substr(prefix.size());
+        return true;
+    };
+    std::string v;
+    try {
+        if (value("--files", v)) {
+            options.files = std::stoul(v);
+        } else if (value("--mean-kb", v)) {
+            options.meanKb = std::stoul(v);
+        } else if (value("--size-dist", v)) {
+            options.sizeDist = v;
+            return v == "fixed" || v == "uniform" || v == "lognormal";
+        } else if (value("--vocab", v)) {
+            options.vocab = std::stoul(v);
+        } else if (value("--zipf", v)) {
+            options.zipf = std::stod(v);
+        } else if (value("--seed", v)) {
+            options.seed = std::stoull(v);
+        } else {
+            return false;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argv[1][0] == '-') {
+        std::cerr << "Usage: gen_corpus <dir> [--files=N] [--mean-kb=N] [--size-dist=fixed|uniform|lognormal]"
+                     " [--vocab=N] [--zipf=S] [--seed=N]"
+                  << std::endl;
+        return 1;
+    }
+    std::filesystem::path dir = argv[1];
+    CorpusOptions options;
+    for (int i = 2; i < argc; ++i) {
+        if (!parseOption(argv[i], options)) {
+            std::cerr << "Invalid option: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+    if (options.files == 0 || options.vocab == 0 || options.meanKb == 0) {
+        std::cerr << "--files, --vocab and --mean-kb must be at least 1." << std::endl;
+        return 1;
+    }
+
+    std::filesystem::path paramsPath = dir / "corpus.params";
+    std::filesystem::path booksDir = dir / "books";
+    {
+        std::ifstream params(paramsPath);
+        std::stringstream existing;
+        existing << params.rdbuf();
+        if (params.is_open() && existing.str() == options.describe()) {
+            std::cout << "Corpus in " << booksDir.string() << " is up to date." << std::endl;
+            return 0;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::remove(paramsPath, ec);
+    std::filesystem::remove_all(booksDir, ec);
+    std::filesystem::create_directories(booksDir, ec);
+    if (ec) {
+        std::cerr << "Failed to create " << booksDir.string() << ": " << ec.message() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> vocabulary = makeVocabulary(options.vocab, options.seed);
+    std::vector<double> cdf = zipfCdf(vocabulary.size(), options.zipf);
+    uint64_t totalBytes = 0;
+    for (size_t i = 0; i < options.files; ++i) {
+        SplitMix64 rng(options.seed * 0x100000001B3ull + i + 1); // every book has its own stream
+        std::string text = makeBook(bookBytes(options, rng), vocabulary, cdf, rng);
+        char name[32];
+        std::snprintf(name, sizeof(name), "book%06zu.txt", i);
+        std::ofstream out(booksDir / name, std::ios::binary);
+        out.write(text.data(), static_cast<std::streamsize>(text.size()));
+        if (!out) {
+            std::cerr << "Failed to write " << (booksDir / name).string() << std::endl;
+            return 1;
+        }
+        totalBytes += text.size();
+    }
+    // written last, so an interrupted run is regenerated next time
+    std::ofstream(paramsPath) << options.describe();
+    std::cout << "Wrote " << options.files << " books, " << totalBytes / (1024 * 1024) << " MB to "
+              << booksDir.string() << std::endl;
+    return 0;
+}
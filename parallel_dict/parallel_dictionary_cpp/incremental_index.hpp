@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "word_table.hpp"
+
+// Side files that let an index saved with --update-index be brought up to
+// date by ingesting only what changed in the books directory:
+//
+//   <index>.manifest  text, one line per indexed book:
+//                     book id, size, mtime, content hash, path (tab separated)
+//   <index>.books     binary, per book the count of every word it contains,
+//                     so a changed or removed book can be retracted without
+//                     its old contents
+//
+// Both are replaced together with the index on every update.
+
+struct ManifestEntry {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t hash = 0;
+    int bookId = -1;
+};
+
+// Non-cryptographic 64-bit hash of a whole file's bytes, 8 bytes per step.
+// Only used to tell a rewritten book from one that was just touched.
+inline uint64_t contentHash(std::string_view bytes)
+{
+    auto mix = [](uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        return h;
+    };
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ bytes.size();
+    size_t i = 0;
+    for (; i + 8 <= bytes.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + i, 8);
+        hash = mix(hash ^ word) * 0xC4CEB9FE1A85EC53ull;
+    }
+    uint64_t tail = 0;
+    if (i < bytes.size()) {
+        std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+    }
+    return mix(hash ^ tail);
+}
+
+// last write time in filesystem clock ticks, 0 if it can't be read
+inline int64_t modificationTime(const std::string& path)
+{
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    return ec ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+// false if the manifest exists but is malformed; a missing one is empty
+inline bool loadManifest(const std::string& path, std::vector<ManifestEntry>& entries)
+{
+    entries.clear();
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        return !std::filesystem::exists(path);
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        ManifestEntry entry;
+        unsigned long long size = 0, hash = 0;
+        long long mtime = 0;
+        int consumed = 0;
+        if (std::sscanf(line.c_str(), "%d\t%llu\t%lld\t%llx\t%n", &entry.bookId, &size, &mtime, &hash, &consumed) != 4
+            || consumed == 0 || entry.bookId < 0) {
+            return false;
+        }
+        entry.size = size;
+        entry.mtime = mtime;
+        entry.hash = hash;
+        entry.path = line.substr(static_cast<size_t>(consumed));
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+inline bool saveManifest(const std::string& path, const std::vector<ManifestEntry>& entries)
+{
+    std::ofstream out(path, std::ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+    out << "# book id\tsize\tmtime\tcontent hash\tpath\n";
+    char fields[96];
+    for (const ManifestEntry& entry : entries) {
+        std::snprintf(fields, sizeof(fields), "%d\t%llu\t%lld\t%016llx\t", entry.bookId,
+            static_cast<unsigned long long>(entry.size), static_cast<long long>(entry.mtime),
+            static_cast<unsigned long long>(entry.hash));
+        out << fields << entry.path << '\n';
+    }
+    return static_cast<bool>(out);
+}
+
+// Per-book word counts file. Each record is
+//   uint32 book id, uint32 number of words, uint64 payload bytes,
+//   then per word: varint count, varint length, the word's bytes
+// after an 8-byte magic and a uint32 version, uint32 reserved.
+inline constexpr char kBookTermsMagic[8] = { 'P', 'D', 'B', 'O', 'O', 'K', 'S', '\0' };
+inline constexpr uint32_t kBookTermsVersion = 1;
+
+struct BookTermsRecordHeader {
+    uint32_t bookId;
+    uint32_t numWords;
+    uint64_t payloadBytes;
+};
+
+// appends the record for one book's word counts to out
+inline void appendBookTerms(std::string& out, int bookId, const OpenWordTable<int>& counts)
+{
+    auto varint = [&](uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    };
+    size_t headerAt = out.size();
+    out.append(sizeof(BookTermsRecordHeader), '\0');
+    counts.forEach([&](std::string_view word, int count) {
+        varint(static_cast<uint64_t>(count));
+        varint(word.size());
+        out += word;
+    });
+    BookTermsRecordHeader header { static_cast<uint32_t>(bookId), static_cast<uint32_t>(counts.size()),
+        out.size() - headerAt - sizeof(BookTermsRecordHeader) };
+    std::memcpy(&out[headerAt], &header, sizeof(header));
+}
+
+// Mapped view of a per-book word counts file.
+class BookTermsReader {
+public:
+    explicit BookTermsReader(const std::string& path)
+        : file_(path)
+    {
+        std::string_view bytes = file_.view();
+        if (!file_.isOpen() || bytes.size() < 16 || std::memcmp(bytes.data(), kBookTermsMagic, 8) != 0) {
+            return;
+        }
+        uint32_t version;
+        std::memcpy(&version, bytes.data() + 8, sizeof(version));
+        if (version == kBookTermsVersion) {
+            records_ = bytes.substr(16);
+        }
+    }
+
+    bool isOpen() const { return records_.data() != nullptr; }
+
+    // calls fn(int bookId, std::string_view record) for every record, the
+    // view covers the whole record so it can be copied out as is. False if
+    // the file is truncated.
+    template <typename Fn>
+    bool forEachRecord(Fn&& fn) const
+    {
+        size_t pos = 0;
+        while (pos + sizeof(BookTermsRecordHeader) <= records_.size()) {
+            BookTermsRecordHeader header;
+            std::memcpy(&header, records_.data() + pos, sizeof(header));
+            size_t end = pos + sizeof(header) + header.payloadBytes;
+            if (end > records_.size()) {
+                return false;
+            }
+            fn(static_cast<int>(header.bookId), records_.substr(pos, end - pos));
+            pos = end;
+        }
+        return pos == records_.size();
+    }
+
+    // calls fn(std::string_view word, int count) for every word of a record
+    template <typename Fn>
+    static void forEachWord(std::string_view record, Fn&& fn)
+    {
+        size_t pos = sizeof(BookTermsRecordHeader);
+        auto varint = [&] {
+            uint64_t value = 0;
+            for (int shift = 0; pos < record.size(); shift += 7) {
+                uint8_t byte = static_cast<uint8_t>(record[pos++]);
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+            return value;
+        };
+        while (pos < record.size()) {
+            int count = static_cast<int>(varint());
+            size_t length = static_cast<size_t>(varint());
+            fn(record.substr(pos, length), count);
+            pos += length;
+        }
+    }
+
+private:
+    MappedFile file_;
+    std::string_view records_;
+};
+
+// writes the file header and then every record in records
+inline bool writeBookTerms(const std::string& path, const std::vector<std::string_view>& records)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+    uint32_t versionAndReserved[2] = { kBookTermsVersion, 0 };
+    out.write(kBookTermsMagic, sizeof(kBookTermsMagic));
+    out.write(reinterpret_cast<const char*>(versionAndReserved), sizeof(versionAndReserved));
+    for (std::string_view record : records) {
+        out.write(record.data(), static_cast<std::streamsize>(record.size()));
+    }
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "posting_list.hpp"
+
+// On-disk index, one file meant to be mmapped and used in place:
+//
+//   IndexHeader
+//   IndexTerm[numTerms]     sorted by word, binary searched directly
+//   IndexBook[numBooks]     book id -> path
+//   string bytes            words and book paths, not NUL terminated
+//   posting bytes           per term, delta varint book ids in increasing order
+//
+// Integers are in host byte order, which must be little-endian, and every
+// section is 8-byte aligned. Opening checks the header and that every term and
+// book record points inside its section; posting bytes are checked as they are
+// decoded.
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t numTerms;
+    uint64_t numBooks;
+    uint64_t termsOffset;
+    uint64_t booksOffset;
+    uint64_t stringsOffset;
+    uint64_t postingsOffset;
+    uint64_t fileSize;
+};
+
+struct IndexTerm {
+    uint64_t wordOffset; // into the string bytes
+    uint64_t postingOffset; // into the posting bytes
+    uint32_t wordLength;
+    uint32_t wordCount;
+    uint32_t bookCount;
+    uint32_t postingBytes;
+};
+
+struct IndexBook {
+    uint64_t pathOffset; // into the string bytes
+    uint64_t pathLength;
+};
+
+static_assert(std::endian::native == std::endian::little, "index files are little-endian");
+static_assert(sizeof(IndexHeader) == 72 && sizeof(IndexTerm) == 32 && sizeof(IndexBook) == 16,
+    "index records are written as raw bytes");
+
+inline constexpr char kIndexMagic[8] = { 'P', 'D', 'I', 'N', 'D', 'E', 'X', '\0' };
+inline constexpr uint32_t kIndexVersion = 1;
+
+// Collects terms and writes them out as an index file. Terms can be added in
+// any order, they are sorted on write.
+class IndexWriter {
+public:
+    void addBook(std::string_view path) { books_.emplace_back(path); }
+
+    void addTerm(std::string_view word, int wordCount, const PostingList& bookIds)
+    {
+        Term term;
+        term.word = std::string(word);
+        term.wordCount = static_cast<uint32_t>(wordCount);
+        term.postingOffset = postings_.size();
+        uint32_t previous = 0;
+        bookIds.forEach([&](int bookId) {
+            uint32_t id = static_cast<uint32_t>(bookId);
+            uint32_t delta = term.bookCount == 0 ? id : id - previous;
+            while (delta >= 0x80) {
+                postings_.push_back(static_cast<char>(delta | 0x80));
+                delta >>= 7;
+            }
+            postings_.push_back(static_cast<char>(delta));
+            previous = id;
+            ++term.bookCount;
+        });
+        term.postingBytes = static_cast<uint32_t>(postings_.size() - term.postingOffset);
+        terms_.push_back(std::move(term));
+    }
+
+    // false if the file could not be written
+    bool write(const std::string& path)
+    {
+        std::sort(terms_.begin(), terms_.end(), [](const Term& a, const Term& b) { return a.word < b.word; });
+
+        std::string strings;
+        std::vector<IndexTerm> termRecords;
+        termRecords.reserve(terms_.size());
+        for (const Term& term : terms_) {
+            termRecords.push_back({ strings.size(), term.postingOffset, static_cast<uint32_t>(term.word.size()),
+                term.wordCount, term.bookCount, term.postingBytes });
+            strings += term.word;
+        }
+        std::vector<IndexBook> bookRecords;
+        bookRecords.reserve(books_.size());
+        for (const std::string& book : books_) {
+            bookRecords.push_back({ strings.size(), book.size() });
+            strings += book;
+        }
+
+        IndexHeader header {};
+        std::memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+        header.version = kIndexVersion;
+        header.numTerms = termRecords.size();
+        header.numBooks = bookRecords.size();
+        header.termsOffset = sizeof(IndexHeader);
+        header.booksOffset = header.termsOffset + termRecords.size() * sizeof(IndexTerm);
+        header.stringsOffset = header.booksOffset + bookRecords.size() * sizeof(IndexBook);
+        header.postingsOffset = align8(header.stringsOffset + strings.size());
+        header.fileSize = header.postingsOffset + postings_.size();
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            return false;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(termRecords.data()), termRecords.size() * sizeof(IndexTerm));
+        out.write(reinterpret_cast<const char*>(bookRecords.data()), bookRecords.size() * sizeof(IndexBook));
+        out.write(strings.data(), strings.size());
+        out.write("\0\0\0\0\0\0\0", header.postingsOffset - header.stringsOffset - strings.size());
+        out.write(postings_.data(), postings_.size());
+        return static_cast<bool>(out);
+    }
+
+private:
+    struct Term {
+        std::string word;
+        uint64_t postingOffset = 0;
+        uint32_t wordCount = 0;
+        uint32_t bookCount = 0;
+        uint32_t postingBytes = 0;
+    };
+
+    std::vector<Term> terms_;
+    std::vector<std::string> books_;
+    std::string postings_;
+
+    static uint64_t align8(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+};
+
+// Read-only view of an index file. Opening maps the file and validates the
+// header and records, lookups binary search the mapped term table with no
+// parsing.
+class IndexReader {
+public:
+    explicit IndexReader(const std::string& path)
+        : file_(path, false)
+    {
+        std::string_view bytes = file_.view();
+        if (!file_.isOpen() || bytes.size() < sizeof(IndexHeader)) {
+            error_ = "not an index file";
+            return;
+        }
+        std::memcpy(&header_, bytes.data(), sizeof(header_));
+        if (std::memcmp(header_.magic, kIndexMagic, sizeof(kIndexMagic)) != 0) {
+            error_ = "bad magic";
+        } else if (header_.version != kIndexVersion) {
+            error_ = "unsupported version " + std::to_string(header_.version);
+        } else if (header_.fileSize != bytes.size() || header_.numTerms > bytes.size() / sizeof(IndexTerm)
+            || header_.numBooks > bytes.size() / sizeof(IndexBook)
+            || header_.termsOffset > header_.booksOffset || header_.booksOffset > header_.stringsOffset
+            || header_.termsOffset + header_.numTerms * sizeof(IndexTerm) > header_.booksOffset
+            || header_.booksOffset + header_.numBooks * sizeof(IndexBook) > header_.stringsOffset
+            || header_.stringsOffset > header_.postingsOffset || header_.postingsOffset > header_.fileSize
+            || header_.termsOffset % 8 != 0 || header_.booksOffset % 8 != 0) {
+            error_ = "truncated or corrupt";
+        } else {
+            terms_ = reinterpret_cast<const IndexTerm*>(bytes.data() + header_.termsOffset);
+            books_ = reinterpret_cast<const IndexBook*>(bytes.data() + header_.booksOffset);
+            strings_ = bytes.substr(header_.stringsOffset, header_.postingsOffset - header_.stringsOffset);
+            postings_ = bytes.substr(header_.postingsOffset);
+            if (!recordsInBounds()) {
+                error_ = "truncated or corrupt";
+            }
+        }
+    }
+
+    IndexReader(const IndexReader&) = delete;
+    IndexReader& operator=(const IndexReader&) = delete;
+
+    bool isOpen() const { return error_.empty(); }
+    const std::string& error() const { return error_; }
+
+    size_t numTerms() const { return isOpen() ? header_.numTerms : 0; }
+    size_t numBooks() const { return isOpen() ? header_.numBooks : 0; }
+
+    std::string_view word(size_t termIndex) const
+    {
+        const IndexTerm& term = terms_[termIndex];
+        return strings_.substr(term.wordOffset, term.wordLength);
+    }
+
+    const IndexTerm& term(size_t termIndex) const { return terms_[termIndex]; }
+
+    std::string_view bookPath(size_t bookId) const
+    {
+        const IndexBook& book = books_[bookId];
+        return strings_.substr(book.pathOffset, book.pathLength);
+    }
+
+    // index of word in the term table
+    std::optional<size_t> find(std::string_view word) const
+    {
+        size_t low = 0, high = numTerms();
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (this->word(mid) < word) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low < numTerms() && this->word(low) == word) {
+            return low;
+        }
+        return std::nullopt;
+    }
+
+    // calls fn(int) for every book id of the term, in increasing order; stops
+    // early at a malformed varint or an id past the book table
+    template <typename Fn>
+    void forEachBook(size_t termIndex, Fn&& fn) const
+    {
+        const IndexTerm& term = terms_[termIndex];
+        std::string_view bytes = postings_.substr(term.postingOffset, term.postingBytes);
+        uint32_t id = 0;
+        size_t pos = 0;
+        for (uint32_t i = 0; i < term.bookCount && pos < bytes.size(); ++i) {
+            uint64_t delta = 0;
+            bool complete = false;
+            for (int shift = 0; pos < bytes.size() && shift < 35; shift += 7) {
+                uint8_t byte = static_cast<uint8_t>(bytes[pos++]);
+                delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    complete = true;
+                    break;
+                }
+            }
+            uint64_t next = i == 0 ? delta : id + delta;
+            if (!complete || next >= header_.numBooks) {
+                return;
+            }
+            id = static_cast<uint32_t>(next);
+            fn(static_cast<int>(id));
+        }
+    }
+
+    PostingList postings(size_t termIndex) const
+    {
+        PostingList bookIds;
+        forEachBook(termIndex, [&](int bookId) { bookIds.insert(bookId); });
+        return bookIds;
+    }
+
+private:
+    // every word, path and posting range lies inside its section
+    bool recordsInBounds() const
+    {
+        for (size_t i = 0; i < header_.numTerms; ++i) {
+            const IndexTerm& term = terms_[i];
+            if (term.wordOffset > strings_.size() || term.wordLength > strings_.size() - term.wordOffset
+                || term.postingOffset > postings_.size() || term.postingBytes > postings_.size() - term.postingOffset) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < header_.numBooks; ++i) {
+            const IndexBook& book = books_[i];
+            if (book.pathOffset > strings_.size() || book.pathLength > strings_.size() - book.pathOffset) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    MappedFile file_;
+    IndexHeader header_ {};
+    const IndexTerm* terms_ = nullptr;
+    const IndexBook* books_ = nullptr;
+    std::string_view strings_;
+    std::string_view postings_;
+    std::string error_;
+};
+
+// Writes every word of dict plus the book list to path.
+template <typename Dictionary, typename BookList>
+bool writeIndex(const std::string& path, const Dictionary& dict, const BookList& books)
+{
+    IndexWriter writer;
+    for (const auto& book : books) {
+        writer.addBook(book.path);
+    }
+    dict.forEach([&](std::string_view word, const auto& entry) {
+        writer.addTerm(word, entry.wordCount, entry.bookIds);
+    });
+    return writer.write(path);
+}
+
+// Rebuilds a dictionary from an index file, entries are merged into whatever
+// dict already holds.
+template <typename Dictionary>
+void loadIndex(const IndexReader& reader, Dictionary& dict)
+{
+    for (size_t i = 0; i < reader.numTerms(); ++i) {
+        dict.mergeEntry(reader.word(i), static_cast<int>(reader.term(i).wordCount), reader.postings(i));
+    }
+}
@@ -0,0 +1,550 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bounded_queue.hpp"
+#include "scheduler.hpp"
+#include "sharded_dictionary.hpp"
+#include "tokenizer.hpp"
+#include "uring.hpp"
+
+// how the pipeline's readers get bytes off disk
+enum class ReadBackend {
+    Pread, // a pool of reader threads doing blocking open / pread / close
+    Uring, // each reader keeps many books in flight on its own io_uring
+};
+
+struct PipelineConfig {
+    ReadBackend backend = ReadBackend::Pread;
+    unsigned uringDepth = 64; // books in flight per io_uring reader
+    unsigned readers = 1;
+    unsigned tokenizers = 1;
+    unsigned inserters = 1;
+    size_t bufferBytes = 1024 * 1024;
+    size_t batchWords = 4096;
+};
+
+// what one stage did, summed over its threads
+struct StageStats {
+    unsigned threads = 0;
+    uint64_t items = 0; // buffers read, buffers tokenized or batches inserted
+    uint64_t bytes = 0;
+    uint64_t words = 0;
+    double busySeconds = 0;
+    double waitSeconds = 0; // blocked on an empty or full queue
+
+    void add(const StageStats& other)
+    {
+        threads += other.threads;
+        items += other.items;
+        bytes += other.bytes;
+        words += other.words;
+        busySeconds += other.busySeconds;
+        waitSeconds += other.waitSeconds;
+    }
+};
+
+struct PipelineStats {
+    StageStats read;
+    StageStats tokenize;
+    StageStats insert;
+    double seconds = 0;
+    std::vector<std::string> failedBooks; // could not be opened or read to the end
+    bool uringUnavailable = false; // asked for io_uring, fell back to pread
+};
+
+// Staged ingestion: reader threads read books into pooled buffers, tokenizer
+// threads turn full buffers into batches of words already bucketed by the
+// inserter that owns their shard, and each inserter thread applies whole
+// batches to its own shards of dict, so no shard is ever locked by two
+// threads. Stages hand buffers and batches over through BoundedQueues and
+// both come from fixed pools, so memory stays flat however far one stage
+// runs ahead.
+//
+// Dictionary needs hashWord, insertHashed and shardIndex; since inserters own
+// disjoint shards, a NoLock dictionary is safe. Book ids are indices into
+// books, like the other ingest paths.
+template <typename Dictionary>
+class IngestPipeline {
+public:
+    IngestPipeline(const std::vector<BookFile>& books, Dictionary& dict, PipelineConfig config)
+        : books_(books)
+        , dict_(dict)
+        , config_(config)
+    {
+        config_.readers = std::max(1u, config_.readers);
+        config_.tokenizers = std::max(1u, config_.tokenizers);
+        config_.inserters = static_cast<unsigned>(std::clamp<size_t>(config_.inserters, 1, dict.numShards()));
+        config_.bufferBytes = std::max<size_t>(config_.bufferBytes, 4096);
+        config_.batchWords = std::max<size_t>(config_.batchWords, 1);
+        config_.uringDepth = std::clamp(config_.uringDepth, 1u, 4096u);
+    }
+
+    const PipelineConfig& config() const { return config_; }
+
+    PipelineStats run()
+    {
+        // two buffers per reader and tokenizer keeps both sides busy; every
+        // tokenizer may hold a half-full batch per inserter, plus a few queued
+        size_t numBuffers = 2 * (config_.readers + config_.tokenizers);
+        if (config_.backend == ReadBackend::Uring) {
+            // a reader waiting for a buffer must not hold them all in reads it
+            // hasn't reaped, or no tokenizer could ever free one
+            numBuffers += static_cast<size_t>(config_.readers) * config_.uringDepth;
+        }
+        size_t numBatches = (config_.tokenizers + 4) * config_.inserters;
+        BoundedQueue<Buffer*> freeBuffers(numBuffers), fullBuffers(numBuffers);
+        BoundedQueue<TokenBatch*> freeBatches(numBatches);
+        std::vector<std::unique_ptr<BoundedQueue<TokenBatch*>>> batchQueues;
+        std::vector<std::unique_ptr<Buffer>> buffers;
+        std::vector<std::unique_ptr<TokenBatch>> batches;
+        for (size_t i = 0; i < numBuffers; ++i) {
+            buffers.push_back(std::make_unique<Buffer>(config_.bufferBytes));
+            freeBuffers.tryPush(buffers.back().get());
+        }
+        for (size_t i = 0; i < numBatches; ++i) {
+            batches.push_back(std::make_unique<TokenBatch>());
+            freeBatches.tryPush(batches.back().get());
+        }
+        for (unsigned i = 0; i < config_.inserters; ++i) {
+            batchQueues.push_back(std::make_unique<BoundedQueue<TokenBatch*>>(numBatches));
+        }
+        freeBuffers_ = &freeBuffers;
+        fullBuffers_ = &fullBuffers;
+        freeBatches_ = &freeBatches;
+        batchQueues_ = &batchQueues;
+        readersLeft_ = config_.readers;
+        tokenizersLeft_ = config_.tokenizers;
+        nextBook_ = 0;
+
+        PipelineStats stats;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < config_.readers; ++i) {
+            threads.emplace_back([&] { timed(stats.read, [&](StageStats& mine) { readStage(mine, stats); }); });
+        }
+        for (unsigned i = 0; i < config_.tokenizers; ++i) {
+            threads.emplace_back([&] { timed(stats.tokenize, [&](StageStats& mine) { tokenizeStage(mine); }); });
+        }
+        for (unsigned i = 0; i < config_.inserters; ++i) {
+            threads.emplace_back([&, i] { timed(stats.insert, [&](StageStats& mine) { insertStage(i, mine); }); });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+private:
+    struct Buffer {
+        explicit Buffer(size_t capacity)
+            : data(std::make_unique<char[]>(capacity))
+            , capacity(capacity)
+        {
+        }
+
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t length = 0;
+        int bookId = 0;
+    };
+
+    struct BatchedWord {
+        uint64_t hash;
+        uint32_t offset;
+        uint32_t length;
+        int bookId;
+    };
+
+    // words for one inserter, their bytes back to back
+    struct TokenBatch {
+        std::string bytes;
+        std::vector<BatchedWord> words;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    const std::vector<BookFile>& books_;
+    Dictionary& dict_;
+    PipelineConfig config_;
+    BoundedQueue<Buffer*>* freeBuffers_ = nullptr;
+    BoundedQueue<Buffer*>* fullBuffers_ = nullptr;
+    BoundedQueue<TokenBatch*>* freeBatches_ = nullptr;
+    std::vector<std::unique_ptr<BoundedQueue<TokenBatch*>>>* batchQueues_ = nullptr;
+    std::atomic<size_t> nextBook_ { 0 };
+    std::atomic<unsigned> readersLeft_ { 0 };
+    std::atomic<unsigned> tokenizersLeft_ { 0 };
+    std::mutex statsMutex_;
+
+    // runs one stage thread and adds its counters to the stage total
+    template <typename Stage>
+    void timed(StageStats& total, Stage&& stage)
+    {
+        StageStats mine;
+        mine.threads = 1;
+        auto start = Clock::now();
+        stage(mine);
+        mine.busySeconds = std::chrono::duration<double>(Clock::now() - start).count() - mine.waitSeconds;
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        total.add(mine);
+    }
+
+    template <typename T>
+    static void push(BoundedQueue<T>& queue, T value, StageStats& stats)
+    {
+        if (queue.tryPush(value)) {
+            return;
+        }
+        auto start = Clock::now();
+        QueueBackoff backoff;
+        while (!queue.tryPush(value)) {
+            backoff.wait();
+        }
+        stats.waitSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // pops into value, false once the queue is empty and producersLeft is 0
+    template <typename T>
+    static bool pop(BoundedQueue<T>& queue, T& value, const std::atomic<unsigned>& producersLeft, StageStats& stats)
+    {
+        if (queue.tryPop(value)) {
+            return true;
+        }
+        auto start = Clock::now();
+        QueueBackoff backoff;
+        bool got = false;
+        for (;;) {
+            if (queue.tryPop(value)) {
+                got = true;
+                break;
+            }
+            // producers push before they sign off, so one more try sees everything
+            if (producersLeft.load(std::memory_order_acquire) == 0) {
+                got = queue.tryPop(value);
+                break;
+            }
+            backoff.wait();
+        }
+        stats.waitSeconds += std::chrono::duration<double>(Clock::now() - start).count();
+        return got;
+    }
+
+    void readStage(StageStats& stats, PipelineStats& pipelineStats)
+    {
+        if (config_.backend == ReadBackend::Uring) {
+            IoUring ring(config_.uringDepth);
+            if (ring.isOpen() && ring.supports(IORING_OP_OPENAT) && ring.supports(IORING_OP_READ)
+                && ring.supports(IORING_OP_CLOSE)) {
+                uringReadStage(ring, stats, pipelineStats);
+                readersLeft_.fetch_sub(1, std::memory_order_release);
+                return;
+            }
+            uringFailed(pipelineStats);
+        }
+        preadStage(stats, pipelineStats);
+        readersLeft_.fetch_sub(1, std::memory_order_release);
+    }
+
+    void bookFailed(size_t bookIndex, PipelineStats& pipelineStats)
+    {
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        pipelineStats.failedBooks.push_back(books_[bookIndex].path);
+    }
+
+    void uringFailed(PipelineStats& pipelineStats)
+    {
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        pipelineStats.uringUnavailable = true;
+    }
+
+    // a free buffer with carry copied to its start
+    Buffer* startBuffer(const std::string& carry, StageStats& stats)
+    {
+        static const std::atomic<unsigned> kNeverDone { 1 };
+        Buffer* buffer = nullptr;
+        pop(*freeBuffers_, buffer, kNeverDone, stats);
+        buffer->length = std::min(carry.size(), buffer->capacity);
+        std::memcpy(buffer->data.get(), carry.data(), buffer->length);
+        return buffer;
+    }
+
+    // Hands a filled buffer to the tokenizers. Unless the book ended, a word
+    // cut by the buffer end is held back in carry for the next buffer (a word
+    // filling the whole buffer is split, there is nowhere else to put it).
+    void finishBuffer(Buffer* buffer, bool atEnd, size_t bookIndex, std::string& carry, StageStats& stats)
+    {
+        size_t filled = buffer->length;
+        stats.bytes += filled - std::min(carry.size(), filled);
+        carry.clear();
+        size_t cut = filled;
+        if (!atEnd) {
+            while (cut > 0 && isAsciiLetter(static_cast<unsigned char>(buffer->data[cut - 1]))) {
+                --cut;
+            }
+            if (cut == 0) {
+                cut = filled;
+            }
+            carry.assign(buffer->data.get() + cut, filled - cut);
+        }
+        buffer->length = cut;
+        buffer->bookId = static_cast<int>(bookIndex);
+        ++stats.items;
+        push(*fullBuffers_, buffer, stats);
+    }
+
+    // Thread-pool backend: each reader opens its next book and preads it
+    // buffer by buffer. A short read is taken as the end of the file, so a
+    // book smaller than a buffer costs open, one pread and close. A failed
+    // read reports the book as failed, its buffers already handed on stay
+    // counted.
+    void preadStage(StageStats& stats, PipelineStats& pipelineStats)
+    {
+        std::string carry; // start of a word cut by the end of the previous buffer
+        for (size_t i = nextBook_++; i < books_.size(); i = nextBook_++) {
+            preadBook(i, carry, stats, pipelineStats);
+        }
+    }
+
+    void preadBook(size_t i, std::string& carry, StageStats& stats, PipelineStats& pipelineStats)
+    {
+        int fd = ::open(books_[i].path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            bookFailed(i, pipelineStats);
+            return;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        carry.clear();
+        off_t offset = 0;
+        for (bool atEnd = false; !atEnd;) {
+            Buffer* buffer = startBuffer(carry, stats);
+            size_t wanted = buffer->capacity - buffer->length;
+            ssize_t got;
+            do {
+                got = ::pread(fd, buffer->data.get() + buffer->length, wanted, offset);
+            } while (got < 0 && errno == EINTR);
+            if (got < 0) {
+                push(*freeBuffers_, buffer, stats);
+                carry.clear();
+                bookFailed(i, pipelineStats);
+                break;
+            }
+            buffer->length += static_cast<size_t>(got);
+            offset += got;
+            atEnd = static_cast<size_t>(got) < wanted;
+            finishBuffer(buffer, atEnd, i, carry, stats);
+        }
+        ::close(fd);
+    }
+
+    // io_uring backend: up to uringDepth books in flight per reader, each
+    // stepping through openat, reads and close as separate requests, so one
+    // thread keeps the device and the page cache busy with many small files.
+    void uringReadStage(IoUring& ring, StageStats& stats, PipelineStats& pipelineStats)
+    {
+        enum class Step { Open, Read, Close };
+        struct Slot {
+            size_t bookIndex = 0;
+            int fd = -1;
+            uint64_t offset = 0;
+            size_t wanted = 0;
+            Buffer* buffer = nullptr;
+            std::string carry;
+            Step step = Step::Open;
+            bool busy = false;
+        };
+        std::vector<Slot> slots(config_.uringDepth);
+        std::vector<size_t> idle;
+        for (size_t s = slots.size(); s-- > 0;) {
+            idle.push_back(s);
+        }
+        size_t inFlight = 0;
+        bool booksLeft = true;
+
+        auto startRead = [&](size_t s) {
+            Slot& slot = slots[s];
+            slot.buffer = startBuffer(slot.carry, stats);
+            slot.wanted = slot.buffer->capacity - slot.buffer->length;
+            io_uring_sqe* sqe = ring.nextSqe(); // one request per slot, never full
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = slot.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(slot.buffer->data.get() + slot.buffer->length);
+            sqe->len = static_cast<uint32_t>(slot.wanted);
+            sqe->off = slot.offset;
+            sqe->user_data = s;
+            slot.step = Step::Read;
+        };
+        auto startClose = [&](size_t s) {
+            io_uring_sqe* sqe = ring.nextSqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = slots[s].fd;
+            sqe->user_data = s;
+            slots[s].step = Step::Close;
+        };
+
+        for (;;) {
+            while (booksLeft && !idle.empty()) {
+                size_t i = nextBook_++;
+                if (i >= books_.size()) {
+                    booksLeft = false;
+                    break;
+                }
+                size_t s = idle.back();
+                idle.pop_back();
+                Slot& slot = slots[s];
+                slot.bookIndex = i;
+                slot.busy = true;
+                slot.offset = 0;
+                slot.carry.clear();
+                slot.step = Step::Open;
+                io_uring_sqe* sqe = ring.nextSqe();
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = reinterpret_cast<uint64_t>(books_[i].path.c_str());
+                sqe->open_flags = O_RDONLY;
+                sqe->user_data = s;
+                ++inFlight;
+            }
+            if (inFlight == 0) {
+                return;
+            }
+            auto waitStart = Clock::now();
+            int submitted = ring.submit(1);
+            stats.waitSeconds += std::chrono::duration<double>(Clock::now() - waitStart).count();
+            if (submitted < 0 && submitted != -EINTR && submitted != -EAGAIN && submitted != -EBUSY) {
+                // The ring broke down. Books in flight are reported as failed,
+                // their buffers may still be written by the kernel so they are
+                // left out of the pool, and the rest of the books are preaded.
+                for (Slot& slot : slots) {
+                    if (slot.busy) {
+                        bookFailed(slot.bookIndex, pipelineStats);
+                    }
+                }
+                uringFailed(pipelineStats);
+                preadStage(stats, pipelineStats);
+                return;
+            }
+            io_uring_cqe cqe;
+            while (ring.popCompletion(cqe)) {
+                size_t s = static_cast<size_t>(cqe.user_data);
+                Slot& slot = slots[s];
+                switch (slot.step) {
+                case Step::Open:
+                    if (cqe.res == -EINVAL) {
+                        // the kernel took the opcode but not the request, pread this book
+                        preadBook(slot.bookIndex, slot.carry, stats, pipelineStats);
+                        --inFlight;
+                        slot.busy = false;
+                        idle.push_back(s);
+                    } else if (cqe.res < 0) {
+                        bookFailed(slot.bookIndex, pipelineStats);
+                        --inFlight;
+                        slot.busy = false;
+                        idle.push_back(s);
+                    } else {
+                        slot.fd = cqe.res;
+                        startRead(s);
+                    }
+                    break;
+                case Step::Read: {
+                    if (cqe.res < 0) {
+                        push(*freeBuffers_, slot.buffer, stats);
+                        slot.buffer = nullptr;
+                        slot.carry.clear();
+                        bookFailed(slot.bookIndex, pipelineStats);
+                        startClose(s);
+                        break;
+                    }
+                    size_t got = static_cast<size_t>(cqe.res);
+                    slot.buffer->length += got;
+                    slot.offset += got;
+                    bool atEnd = got < slot.wanted;
+                    finishBuffer(slot.buffer, atEnd, slot.bookIndex, slot.carry, stats);
+                    slot.buffer = nullptr;
+                    if (atEnd) {
+                        startClose(s);
+                    } else {
+                        startRead(s);
+                    }
+                    break;
+                }
+                case Step::Close:
+                    --inFlight;
+                    slot.busy = false;
+                    idle.push_back(s);
+                    break;
+                }
+            }
+        }
+    }
+
+    void tokenizeStage(StageStats& stats)
+    {
+        static const std::atomic<unsigned> kNeverDone { 1 };
+        WordTokenizer tokenizer;
+        std::vector<TokenBatch*> open(config_.inserters, nullptr);
+        auto ship = [&](unsigned owner) {
+            push(*(*batchQueues_)[owner], open[owner], stats);
+            open[owner] = nullptr;
+        };
+        Buffer* buffer = nullptr;
+        while (pop(*fullBuffers_, buffer, readersLeft_, stats)) {
+            int bookId = buffer->bookId;
+            tokenizer.forEachWord({ buffer->data.get(), buffer->length }, [&](std::string_view word) {
+                uint64_t hash = Dictionary::hashWord(word);
+                unsigned owner = static_cast<unsigned>(dict_.shardIndex(hash) % config_.inserters);
+                TokenBatch*& batch = open[owner];
+                if (batch == nullptr) {
+                    pop(*freeBatches_, batch, kNeverDone, stats);
+                }
+                batch->words.push_back({ hash, static_cast<uint32_t>(batch->bytes.size()),
+                    static_cast<uint32_t>(word.size()), bookId });
+                batch->bytes += word;
+                ++stats.words;
+                if (batch->words.size() >= config_.batchWords) {
+                    ship(owner);
+                }
+            });
+            stats.bytes += buffer->length;
+            ++stats.items;
+            push(*freeBuffers_, buffer, stats);
+        }
+        for (unsigned owner = 0; owner < config_.inserters; ++owner) {
+            if (open[owner] != nullptr) {
+                ship(owner);
+            }
+        }
+        tokenizersLeft_.fetch_sub(1, std::memory_order_release);
+    }
+
+    void insertStage(unsigned index, StageStats& stats)
+    {
+        TokenBatch* batch = nullptr;
+        while (pop(*(*batchQueues_)[index], batch, tokenizersLeft_, stats)) {
+            std::string_view bytes = batch->bytes;
+            for (const BatchedWord& word : batch->words) {
+                dict_.insertHashed(bytes.substr(word.offset, word.length), word.hash, word.bookId);
+            }
+            stats.words += batch->words.size();
+            stats.bytes += batch->bytes.size();
+            ++stats.items;
+            batch->words.clear();
+            batch->bytes.clear();
+            push(*freeBatches_, batch, stats);
+        }
+    }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Run instrumentation, built in with -DPD_INSTRUMENT (make INSTRUMENT=1).
+// Without it every counter is still there but add() is an empty inline
+// function, lock timing is a plain lock and the report stays empty, so the
+// hot paths compile to what they were.
+#ifdef PD_INSTRUMENT
+inline constexpr bool kInstrumented = true;
+#else
+inline constexpr bool kInstrumented = false;
+#endif
+
+// counter written by one thread at a time (its owner, or under a lock)
+class InstrumentCounter {
+public:
+    void add(uint64_t n)
+    {
+        if constexpr (kInstrumented) {
+            value_ += n;
+        }
+    }
+
+    uint64_t value() const { return value_; }
+
+private:
+    uint64_t value_ = 0;
+};
+
+// what one ingest thread did; a line of its own so neighbours don't share it
+struct alignas(64) ThreadStats {
+    InstrumentCounter books; // books or book ranges
+    InstrumentCounter words;
+    InstrumentCounter bytes;
+    InstrumentCounter scanNs; // in the tokenizer, the inserts it calls included
+    InstrumentCounter insertNs; // in dictionary inserts
+};
+
+// what happened to one shard of a dictionary
+struct ShardStats {
+    InstrumentCounter inserts; // word occurrences inserted
+    InstrumentCounter lockWaits; // acquisitions that found the lock taken
+    InstrumentCounter lockWaitNs; // time spent blocked in those
+    uint64_t words = 0; // distinct words, filled in when read
+
+    void add(const ShardStats& other)
+    {
+        inserts.add(other.inserts.value());
+        lockWaits.add(other.lockWaits.value());
+        lockWaitNs.add(other.lockWaitNs.value());
+        words += other.words;
+    }
+};
+
+// Locks mutex; when instrumented, an acquisition that doesn't get the lock
+// straight away is counted and timed into stats. The uncontended path costs
+// one try_lock either way.
+template <typename Lock>
+std::unique_lock<Lock> lockCounted(Lock& mutex, ShardStats& stats)
+{
+    if constexpr (kInstrumented) {
+        if (!mutex.try_lock()) {
+            auto start = std::chrono::steady_clock::now();
+            mutex.lock();
+            auto waited = std::chrono::steady_clock::now() - start;
+            stats.lockWaits.add(1);
+            stats.lockWaitNs.add(
+                static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count()));
+        }
+        return std::unique_lock<Lock>(mutex, std::adopt_lock);
+    } else {
+        return std::unique_lock<Lock>(mutex);
+    }
+}
+
+// Runs fn() and, when instrumented, adds its wall time to counter. Inserts
+// are timed one by one, so an instrumented build ingests somewhat slower.
+template <typename Fn>
+void timedNs(InstrumentCounter& counter, Fn&& fn)
+{
+    if constexpr (kInstrumented) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        counter.add(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    } else {
+        fn();
+    }
+}
+
+// CPU time used by the whole process so far, all threads
+inline double processCpuSeconds()
+{
+    timespec now {};
+    ::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) * 1e-9;
+}
+
+// Collects phases, per-thread and per-shard stats of a run and formats them
+// as one JSON object. Recording is a no-op when not instrumented.
+class RunReport {
+public:
+    void addPhase(const std::string& name, double wallSeconds, double cpuSeconds)
+    {
+        if constexpr (kInstrumented) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            phases_.push_back({ name, wallSeconds, cpuSeconds });
+        }
+    }
+
+    void setThreads(const std::vector<ThreadStats>& threads)
+    {
+        if constexpr (kInstrumented) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            threads_ = threads;
+        }
+    }
+
+    // locked: whether inserts took the shard locks; single-owner
+    // dictionaries never wait, so their lock waits are always 0
+    void setShards(const std::vector<ShardStats>& shards, bool locked)
+    {
+        if constexpr (kInstrumented) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            shards_ = shards;
+            shardsLocked_ = locked;
+        }
+    }
+
+    std::string json() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string out = "{\"phases\": [";
+        char field[256];
+        for (size_t i = 0; i < phases_.size(); ++i) {
+            std::snprintf(field, sizeof(field), "%s{\"name\": \"%s\", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f}",
+                i == 0 ? "" : ", ", phases_[i].name.c_str(), phases_[i].wallSeconds, phases_[i].cpuSeconds);
+            out += field;
+        }
+        out += "], \"threads\": [";
+        for (size_t i = 0; i < threads_.size(); ++i) {
+            uint64_t insertNs = threads_[i].insertNs.value();
+            uint64_t tokenizeNs = threads_[i].scanNs.value() - std::min(insertNs, threads_[i].scanNs.value());
+            std::snprintf(field, sizeof(field),
+                "%s{\"books\": %llu, \"words\": %llu, \"bytes\": %llu, \"tokenize_seconds\": %.6f, "
+                "\"insert_seconds\": %.6f}",
+                i == 0 ? "" : ", ", static_cast<unsigned long long>(threads_[i].books.value()),
+                static_cast<unsigned long long>(threads_[i].words.value()),
+                static_cast<unsigned long long>(threads_[i].bytes.value()), static_cast<double>(tokenizeNs) * 1e-9,
+                static_cast<double>(insertNs) * 1e-9);
+            out += field;
+        }
+        out += "], \"shards_locked\": ";
+        out += shardsLocked_ ? "true" : "false";
+        out += ", \"shards\": [";
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            std::snprintf(field, sizeof(field),
+                "%s{\"inserts\": %llu, \"words\": %llu, \"lock_waits\": %llu, \"lock_wait_seconds\": %.6f}",
+                i == 0 ? "" : ", ", static_cast<unsigned long long>(shards_[i].inserts.value()),
+                static_cast<unsigned long long>(shards_[i].words),
+                static_cast<unsigned long long>(shards_[i].lockWaits.value()),
+                static_cast<double>(shards_[i].lockWaitNs.value()) * 1e-9);
+            out += field;
+        }
+        out += "]}";
+        return out;
+    }
+
+private:
+    struct Phase {
+        std::string name;
+        double wallSeconds;
+        double cpuSeconds;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<Phase> phases_;
+    std::vector<ThreadStats> threads_;
+    std::vector<ShardStats> shards_;
+    bool shardsLocked_ = false;
+};
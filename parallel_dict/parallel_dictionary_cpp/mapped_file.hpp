@@ -0,0 +1,54 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// read-only mapping of a whole file, unmapped on destruction. sequential is
+// passed on to the kernel as a readahead hint, random lookups should clear it.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path, bool sequential = true)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            size_ = static_cast<size_t>(st.st_size);
+            if (size_ == 0) {
+                open_ = true; // mmap rejects zero-length mappings, nothing to read anyway
+            } else {
+                void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    ::madvise(addr, size_, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+                    data_ = static_cast<const char*>(addr);
+                    open_ = true;
+                }
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const { return open_; }
+    std::string_view view() const { return { data_, data_ != nullptr ? size_ : 0 }; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool open_ = false;
+};
@@ -1,17 +1,36 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <filesystem>
 #include <fstream>
-#include <functional>
 #include <iostream>
-#include <memory> // For std::unique_ptr
+#include <memory>
 #include <mutex>
-#include <shared_mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "incremental_index.hpp"
+#include "instrumentation.hpp"
+#include "index_file.hpp"
+#include "ingest_pipeline.hpp"
+#include "mapped_file.hpp"
+#include "scheduler.hpp"
+#include "sharded_dictionary.hpp"
+#include "shuffle.hpp"
+#include "sketch.hpp"
+#include "spill.hpp"
+#include "tokenizer.hpp"
+
 // threaded logger (with a mutex)
 class Logger {
 public:
@@ -26,153 +45,303 @@ private:
     std::mutex logMutex_;
 };
 
-// sharding for faster speed, using unordered map
-class ShardedConcurrentDictionary {
+// Logs the wall time of each phase of a run as "<phase> took <s> seconds."
+// and, when instrumented, records it in report with the CPU time it used
+class PhaseTimer {
 public:
-    // constructor
-    explicit ShardedConcurrentDictionary(size_t numShards = 16)
+    PhaseTimer(Logger& logger, RunReport& report)
+        : logger_(logger)
+        , report_(report)
+        , start_(std::chrono::steady_clock::now())
     {
-        for (size_t i = 0; i < numShards; ++i) {
-            shards_.emplace_back(std::make_unique<Shard>());
+        if constexpr (kInstrumented) {
+            cpuStart_ = processCpuSeconds();
         }
     }
 
-    // delete copy constructor and copy operator
-    ShardedConcurrentDictionary(const ShardedConcurrentDictionary&) = delete;
-    ShardedConcurrentDictionary& operator=(const ShardedConcurrentDictionary&) = delete;
-
-    // delete move constructor and move operator
-    ShardedConcurrentDictionary(ShardedConcurrentDictionary&&) = delete;
-    ShardedConcurrentDictionary& operator=(ShardedConcurrentDictionary&&) = delete;
-
-    void insert(const std::string& word, int bookId)
+    // ends the phase running since the last lap and starts the next one
+    void lap(const std::string& phase)
     {
-        size_t shardIndex = getShardIndex(word);
-        Shard& shard = *shards_[shardIndex];
-        std::lock_guard<std::mutex> lock(shard.mutex);
-        auto& entry = shard.dict[word];
-        entry.wordCount++;
-        entry.bookIds.insert(bookId);
-    }
-
-    void merge(const ShardedConcurrentDictionary& other)
-    {
-        for (size_t i = 0; i < shards_.size(); ++i) {
-            const Shard& otherShard = *other.shards_[i];
-            std::lock_guard<std::mutex> lockOther(otherShard.mutex);
-            for (const auto& [word, entry] : otherShard.dict) {
-                size_t shardIndex = getShardIndex(word);
-                Shard& thisShard = *shards_[shardIndex];
-                std::lock_guard<std::mutex> lockThis(thisShard.mutex);
-                auto& myEntry = thisShard.dict[word];
-                myEntry.wordCount += entry.wordCount;
-                myEntry.bookIds.insert(entry.bookIds.begin(), entry.bookIds.end());
-            }
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - start_;
+        logger_.log(phase + " took " + std::to_string(elapsed.count()) + " seconds.");
+        start_ = now;
+        if constexpr (kInstrumented) {
+            double cpu = processCpuSeconds();
+            report_.addPhase(phase, elapsed.count(), cpu - cpuStart_);
+            cpuStart_ = cpu;
         }
     }
 
-    void removeSingleOccurrences()
+private:
+    Logger& logger_;
+    RunReport& report_;
+    std::chrono::steady_clock::time_point start_;
+    double cpuStart_ = 0;
+};
+
+// how processBooks reads each book
+enum class IngestMode {
+    Stream, // ifstream + getline, tokenized line by line
+    Mmap, // mmap the book and insert string_view tokens, no per-word copies
+};
+
+// how books are handed out to the worker threads
+enum class ScheduleMode {
+    Static, // equal contiguous ranges of books per thread
+    Steal, // size-aware work stealing, large books split into byte ranges
+};
+
+// Republishes a thread's dictionary for --serve-queries readers, at most
+// once per interval. Called between books, so a snapshot never holds part
+// of a book's range; a zero interval never publishes. A publish copies the
+// shards written since the last one, so the wait after each publish is also
+// stretched to 10x its cost, keeping publishing under ~10% of the worker.
+class PublishTimer {
+public:
+    explicit PublishTimer(std::chrono::milliseconds interval)
+        : interval_(interval)
+        , last_(std::chrono::steady_clock::now())
     {
-        for (auto& shardPtr : shards_) {
-            Shard& shard = *shardPtr;
-            std::lock_guard<std::mutex> lock(shard.mutex);
-            for (auto it = shard.dict.begin(); it != shard.dict.end();) {
-                if (it->second.wordCount == 1) {
-                    it = shard.dict.erase(it);
-                } else {
-                    ++it;
-                }
-            }
-        }
     }
 
-    void print() const
+    void tick(SingleOwnerDictionary& dict)
     {
-        for (const auto& shardPtr : shards_) {
-            const Shard& shard = *shardPtr;
-            std::lock_guard<std::mutex> lock(shard.mutex);
-            for (const auto& [word, entry] : shard.dict) {
-                std::cout << word << ": " << entry.wordCount
-                          << " times, in " << entry.bookIds.size() << " books\n";
-            }
+        if (interval_.count() == 0) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_ >= wait_) {
+            dict.publish();
+            last_ = std::chrono::steady_clock::now();
+            wait_ = std::max<std::chrono::steady_clock::duration>(interval_, 10 * (last_ - now));
         }
     }
 
 private:
-    struct Entry {
-        int wordCount = 0;
-        std::unordered_set<int> bookIds;
-    };
+    std::chrono::milliseconds interval_;
+    std::chrono::steady_clock::duration wait_ { interval_ };
+    std::chrono::steady_clock::time_point last_;
+};
 
-    struct Shard {
-        std::unordered_map<std::string, Entry> dict;
-        mutable std::mutex mutex;
+// Function to process bytes [begin, end) of a book through a memory map,
+// returns false if the file could not be mapped. Both ends are moved forward
+// past a word they cut, so adjacent ranges see every word exactly once. A
+// compressed book is decompressed on the way (compressed_book.hpp), a range
+// of its frames hands the words cut at its ends to seams; false too if it
+// turns out to be corrupt.
+template <typename Dictionary>
+bool processBookMapped(const BookFile& book, Dictionary& dict, int bookId, WordTokenizer& tokenizer,
+    ThreadStats& stats, const BookTask& task = BookTask {}, BookSeams* seams = nullptr)
+{
+    MappedFile file(book.path);
+    if (!file.isOpen()) {
+        return false;
+    }
+    std::string_view text = file.view();
+    auto insert = [&](std::string_view word) {
+        timedNs(stats.insertNs, [&] { dict.insert(word, bookId); });
+        stats.words.add(1);
     };
+    auto scan = [&](std::string_view piece) {
+        timedNs(stats.scanNs, [&] { tokenizer.forEachWord(piece, insert); });
+    };
+    if (book.compression != Compression::None) {
+        RangeEdges edges;
+        uint64_t decoded = 0;
+        bool ok = forEachDecompressedText(text, book.compression, task.begin, task.end, edges, decoded, scan);
+        stats.bytes.add(decoded);
+        stats.books.add(1);
+        if (ok && task.numRanges > 1 && seams != nullptr) {
+            seams->add(task.bookIndex, task.numRanges, task.begin, std::move(edges), scan);
+        }
+        return ok;
+    }
+    size_t begin = task.begin, end = task.end;
+    auto cutsWord = [&](size_t pos) {
+        return pos > 0 && pos < text.size() && isAsciiLetter(static_cast<unsigned char>(text[pos - 1]))
+            && isAsciiLetter(static_cast<unsigned char>(text[pos]));
+    };
+    begin = std::min(begin, text.size());
+    end = std::min(end, text.size());
+    while (cutsWord(begin)) {
+        ++begin;
+    }
+    while (cutsWord(end)) {
+        ++end;
+    }
+    if (begin < end) {
+        scan(text.substr(begin, end - begin));
+        stats.bytes.add(end - begin);
+    }
+    stats.books.add(1);
+    return true;
+}
 
-    std::vector<std::unique_ptr<Shard>> shards_;
-
-    size_t getShardIndex(const std::string& key) const
-    {
-        return std::hash<std::string> {}(key) % shards_.size();
+// Writes the instrumentation report as JSON to path, or to stderr without
+// one. Nothing is written when not instrumented.
+int writeReport(const RunReport& report, const std::string& path, Logger& logger)
+{
+    if constexpr (!kInstrumented) {
+        return 0;
     }
-};
+    if (path.empty()) {
+        logger.log(report.json());
+        return 0;
+    }
+    std::ofstream out(path, std::ios::trunc);
+    out << report.json() << "\n";
+    if (!out) {
+        logger.log("Failed to write instrumentation report: " + path);
+        return 1;
+    }
+    return 0;
+}
 
-// Helper function to split a string into words without modifying the input
-std::vector<std::string> splitToWords(const std::string& text)
+// Function to process a whole book through an ifstream. Compressed books are
+// only ever decoded from a mapping, getting here means that failed, and the
+// words decoded before the error are already in dict.
+void processBookStream(const BookFile& book, SingleOwnerDictionary& dict, int bookId, WordTokenizer& tokenizer,
+    ThreadStats& stats, Logger& logger)
 {
-    std::vector<std::string> words;
-    words.reserve(text.size() / 5); // Assuming average word length of 5
-    size_t pos = 0, length = text.length();
-    while (pos < length) {
-        // Skip non-alphabetic characters
-        while (pos < length && !std::isalpha(static_cast<unsigned char>(text[pos])))
-            ++pos;
-        size_t start = pos;
-        // Collect alphabetic characters
-        while (pos < length && std::isalpha(static_cast<unsigned char>(text[pos]))) {
-            ++pos;
-        }
-        if (start < pos) {
-            // Extract the word and convert to lowercase
-            std::string word = text.substr(start, pos - start);
-            std::transform(word.begin(), word.end(), word.begin(),
-                [](unsigned char c) { return std::tolower(c); });
-            words.emplace_back(std::move(word));
-        }
-    }
-    return words;
+    if (book.compression != Compression::None) {
+        logger.log("Failed to decompress file: " + book.path + ", only partly indexed");
+        return;
+    }
+    std::ifstream file(book.path);
+    if (!file.is_open()) {
+        logger.log("Failed to open file: " + book.path);
+        return;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        timedNs(stats.scanNs, [&] {
+            tokenizer.forEachWord(line, [&](std::string_view word) {
+                timedNs(stats.insertNs, [&] { dict.insert(word, bookId); });
+                stats.words.add(1);
+            });
+        });
+        stats.bytes.add(line.size() + 1);
+    }
+    stats.books.add(1);
 }
 
 // Function to process a set of books in a single thread
-void processBooks(const std::vector<std::string>& books, ShardedConcurrentDictionary& dict,
-    int startBookId, Logger& logger)
+void processBooks(const std::vector<BookFile>& books, SingleOwnerDictionary& dict, ThreadStats& stats,
+    int startBookId, Logger& logger, IngestMode mode, std::chrono::milliseconds publishInterval)
 {
+    WordTokenizer tokenizer;
+    PublishTimer publisher(publishInterval);
     for (size_t i = 0; i < books.size(); ++i) {
-        const auto& bookFile = books[i];
-        std::ifstream file(bookFile);
-        if (!file.is_open()) {
-            logger.log("Failed to open file: " + bookFile);
+        const BookFile& book = books[i];
+        int bookId = startBookId + static_cast<int>(i);
+        // fall back to the stream reader for anything that can't be mapped,
+        // compressed books are always mapped
+        bool stream = mode != IngestMode::Mmap && book.compression == Compression::None;
+        if (stream || !processBookMapped(book, dict, bookId, tokenizer, stats)) {
+            processBookStream(book, dict, bookId, tokenizer, stats, logger);
+        }
+        publisher.tick(dict);
+    }
+}
+
+// Function to drain tasks from the scheduler in a single thread, book ids are
+// indices into books just like the static split
+void processBookTasks(WorkStealingScheduler& scheduler, unsigned worker, const std::vector<BookFile>& books,
+    SingleOwnerDictionary& dict, ThreadStats& stats, Logger& logger, IngestMode mode,
+    std::chrono::milliseconds publishInterval)
+{
+    WordTokenizer tokenizer;
+    PublishTimer publisher(publishInterval);
+    BookTask task;
+    while (scheduler.next(worker, task)) {
+        const BookFile& book = books[task.bookIndex];
+        int bookId = static_cast<int>(task.bookIndex);
+        if ((mode == IngestMode::Mmap || book.compression != Compression::None)
+            && processBookMapped(book, dict, bookId, tokenizer, stats, task, &scheduler.seams())) {
+            publisher.tick(dict);
             continue;
         }
-        std::string line;
-        int bookId = startBookId + static_cast<int>(i);
-        while (std::getline(file, line)) {
-            auto words = splitToWords(line);
-            for (const auto& word : words) {
-                dict.insert(word, bookId);
+        // ranges are only produced when mapping, a whole book is safe to stream
+        if (task.begin == 0 && task.end == BookTask::kToEnd) {
+            processBookStream(book, dict, bookId, tokenizer, stats, logger);
+        } else if (book.compression != Compression::None) {
+            logger.log("Failed to decompress file: " + book.path + ", only partly indexed");
+        } else {
+            logger.log("Failed to map file: " + book.path);
+        }
+        publisher.tick(dict);
+    }
+}
+
+// Answers queries read from stdin while the workers are still ingesting, one
+// per line: a word, or "top N". Answers come from the latest snapshot every
+// thread dictionary published, so they lag ingestion by up to the publish
+// interval and never block a worker. Runs until stop is set or stdin closes.
+void serveQueries(const std::vector<std::unique_ptr<SingleOwnerDictionary>>& threadDicts,
+    const std::atomic<bool>& stop, Logger& logger)
+{
+    std::string pending;
+    char buffer[4096];
+    while (!stop.load(std::memory_order_acquire)) {
+        pollfd input { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&input, 1, 100) <= 0) {
+            continue;
+        }
+        ssize_t got = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (got <= 0) {
+            return;
+        }
+        pending.append(buffer, static_cast<size_t>(got));
+        for (size_t newline; (newline = pending.find('\n')) != std::string::npos; pending.erase(0, newline + 1)) {
+            std::string query = pending.substr(0, newline);
+            std::transform(query.begin(), query.end(), query.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (query.empty()) {
+                continue;
             }
+            std::vector<std::shared_ptr<const DictionarySnapshot>> layers;
+            uint64_t versions = 0;
+            for (const auto& dict : threadDicts) {
+                if (auto layer = dict->publishedSnapshot()) {
+                    versions += layer->version;
+                    layers.push_back(std::move(layer));
+                }
+            }
+            QuerySnapshot snapshot(std::move(layers));
+            std::string answer = "[snapshot " + std::to_string(versions) + "] ";
+            if (query.rfind("top ", 0) == 0) {
+                size_t k = std::strtoul(query.c_str() + 4, nullptr, 10);
+                answer += "top " + std::to_string(k) + ":";
+                for (const auto& [word, count] : snapshot.topK(k)) {
+                    answer += " " + word + "=" + std::to_string(count);
+                }
+            } else if (auto stats = snapshot.lookup(query)) {
+                answer += query + ": " + std::to_string(stats->wordCount) + " times, in "
+                    + std::to_string(stats->bookCount) + " books";
+            } else {
+                answer += query + ": not found";
+            }
+            logger.log(answer);
         }
     }
 }
 
 // all files from directory, recursively
-std::vector<std::string> getAllBookFiles(const std::string& directory, Logger& logger)
+std::vector<BookFile> getAllBookFiles(const std::string& directory, Logger& logger)
 {
-    std::vector<std::string> bookFiles;
+    std::vector<BookFile> bookFiles;
     try {
         for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
             if (entry.is_regular_file()) {
-                bookFiles.emplace_back(entry.path().string());
+                std::error_code ec;
+                uintmax_t size = entry.file_size(ec);
+                std::string path = entry.path().string();
+                Compression compression = compressionFromName(path);
+                if (compression == Compression::Zstd && !kZstdSupported) {
+                    logger.log("Skipping " + path + ": built without zstd (make ZSTD=1).");
+                    continue;
+                }
+                bookFiles.push_back({ std::move(path), ec ? 0 : size, compression, {} });
             }
         }
     } catch (const std::filesystem::filesystem_error& e) {
@@ -181,6 +350,943 @@ std::vector<std::string> getAllBookFiles(const std::string& directory, Logger& l
     return bookFiles;
 }
 
+// Finds the frames of the zstd books larger than chunkBytes, so the
+// scheduler can cut them into ranges decoded in parallel
+void findBookFrames(std::vector<BookFile>& books, size_t chunkBytes)
+{
+    for (BookFile& book : books) {
+        if (book.compression == Compression::Zstd && chunkBytes != 0 && book.size > chunkBytes) {
+            MappedFile file(book.path);
+            book.frames = zstdFrameOffsets(file.view());
+        }
+    }
+}
+
+int runFromIndex(const std::string& path, const std::vector<std::string>& lookups, size_t numShards, Logger& logger)
+{
+    IndexReader reader(path);
+    if (!reader.isOpen()) {
+        logger.log("Failed to load index " + path + ": " + reader.error());
+        return 1;
+    }
+    if (lookups.empty()) {
+        ShardedConcurrentDictionary dict(numShards);
+        loadIndex(reader, dict);
+        dict.print();
+        return 0;
+    }
+    for (std::string word : lookups) {
+        std::transform(word.begin(), word.end(), word.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::optional<size_t> term = reader.find(word);
+        if (!term) {
+            std::cout << word << ": not found\n";
+            continue;
+        }
+        std::cout << word << ": " << reader.term(*term).wordCount
+                  << " times, in " << reader.term(*term).bookCount << " books\n";
+    }
+    return 0;
+}
+
+// Function to drain tasks into a fixed-memory approximate counter
+void countBookTasks(WorkStealingScheduler& scheduler, unsigned worker, const std::vector<BookFile>& books,
+    ApproximateCounter& counter, Logger& logger)
+{
+    WordTokenizer tokenizer;
+    ThreadStats stats; // not reported for approximate runs
+    BookTask task;
+    while (scheduler.next(worker, task)) {
+        const BookFile& book = books[task.bookIndex];
+        if (!processBookMapped(book, counter, static_cast<int>(task.bookIndex), tokenizer, stats, task,
+                &scheduler.seams())) {
+            logger.log("Failed to read file: " + book.path);
+        }
+    }
+}
+
+// Compares the approximate counts with an exact dictionary of the same books
+void reportApproximationError(const ApproximateCounter& counter, const ShardedConcurrentDictionary& exact,
+    size_t topK, Logger& logger)
+{
+    std::vector<std::pair<std::string, int>> exactCounts;
+    exact.forEach([&](std::string_view word, const DictionaryEntry& entry) {
+        exactCounts.emplace_back(std::string(word), entry.wordCount);
+    });
+
+    // every word's sketch estimate against its true count
+    const CountMinSketch& sketch = counter.sketch();
+    double bound = sketch.errorBound();
+    double sumError = 0;
+    uint64_t maxError = 0;
+    size_t withinBound = 0;
+    for (const auto& [word, count] : exactCounts) {
+        uint64_t error = counter.estimate(word) - static_cast<uint64_t>(count);
+        sumError += static_cast<double>(error);
+        maxError = std::max(maxError, error);
+        withinBound += static_cast<double>(error) <= bound;
+    }
+    size_t numWords = std::max<size_t>(exactCounts.size(), 1);
+    logger.log("Estimates over " + std::to_string(exactCounts.size()) + " words: mean error "
+        + std::to_string(sumError / static_cast<double>(numWords)) + ", max error " + std::to_string(maxError)
+        + ", " + std::to_string(100.0 * static_cast<double>(withinBound) / static_cast<double>(numWords))
+        + "% within the bound " + std::to_string(bound));
+
+    // reported top-K against the true top-K
+    std::sort(exactCounts.begin(), exactCounts.end(), [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    std::unordered_map<std::string_view, size_t> rank;
+    for (size_t i = 0; i < exactCounts.size(); ++i) {
+        rank.emplace(exactCounts[i].first, i);
+    }
+    std::vector<std::pair<std::string, uint64_t>> approxTop = counter.top(topK);
+    size_t k = std::min(topK, exactCounts.size());
+    size_t hits = 0;
+    double sumRelative = 0, maxRelative = 0;
+    for (const auto& [word, estimate] : approxTop) {
+        auto it = rank.find(word);
+        if (it == rank.end()) {
+            continue; // every counted word is in the exact dictionary
+        }
+        hits += it->second < k;
+        int count = exactCounts[it->second].second;
+        double relative = static_cast<double>(estimate - static_cast<uint64_t>(count)) / count;
+        sumRelative += relative;
+        maxRelative = std::max(maxRelative, relative);
+    }
+    logger.log("Top " + std::to_string(k) + ": recall " + std::to_string(k ? 100.0 * static_cast<double>(hits) / static_cast<double>(k) : 100.0)
+        + "%, mean relative error " + std::to_string(approxTop.empty() ? 0 : sumRelative / static_cast<double>(approxTop.size()))
+        + ", max relative error " + std::to_string(maxRelative));
+}
+
+// Counts words in fixed memory instead of building the dictionary: each
+// thread feeds its own ApproximateCounter of budgetBytes / numThreads, they
+// are merged at the end and the topK most frequent words are printed. With
+// check, the exact dictionary is also built to report the error.
+int runApproximate(const std::vector<BookFile>& books, unsigned numThreads, size_t chunkBytes, size_t budgetBytes,
+    size_t topK, const std::vector<std::string>& lookups, bool check, size_t numShards, Logger& logger)
+{
+    std::vector<std::unique_ptr<ApproximateCounter>> counters;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        counters.emplace_back(std::make_unique<ApproximateCounter>(budgetBytes / numThreads, topK));
+    }
+    WorkStealingScheduler scheduler(books, numThreads, chunkBytes);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threads.emplace_back(countBookTasks, std::ref(scheduler), i, std::cref(books), std::ref(*counters[i]),
+            std::ref(logger));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ApproximateCounter& counter = *counters[0];
+    counter.flush();
+    for (unsigned i = 1; i < numThreads; ++i) {
+        counter.merge(*counters[i]);
+        counters[i].reset();
+    }
+
+    const CountMinSketch& sketch = counter.sketch();
+    logger.log("Approximate counts of " + std::to_string(sketch.total()) + " words in "
+        + std::to_string(counter.memoryBytes() / 1024) + " KB per thread: sketch " + std::to_string(sketch.depth())
+        + " x " + std::to_string(sketch.width()) + ", " + std::to_string(counter.heavyHitters().capacity())
+        + " heavy hitters, error at most " + std::to_string(sketch.errorBound()));
+
+    for (std::string word : lookups) {
+        std::transform(word.begin(), word.end(), word.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::cout << word << ": ~" << counter.estimate(word) << " times\n";
+    }
+    if (lookups.empty()) {
+        for (const auto& [word, count] : counter.top(topK)) {
+            std::cout << word << ": ~" << count << " times\n";
+        }
+    }
+
+    if (check) {
+        std::vector<std::unique_ptr<SingleOwnerDictionary>> threadDicts;
+        std::vector<ThreadStats> threadStats(numThreads);
+        WorkStealingScheduler exactScheduler(books, numThreads, chunkBytes);
+        threads.clear();
+        for (unsigned i = 0; i < numThreads; ++i) {
+            threadDicts.emplace_back(std::make_unique<SingleOwnerDictionary>(numShards));
+            threads.emplace_back(processBookTasks, std::ref(exactScheduler), i, std::cref(books),
+                std::ref(*threadDicts[i]), std::ref(threadStats[i]), std::ref(logger), IngestMode::Mmap,
+                std::chrono::milliseconds(0));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ShardedConcurrentDictionary exact(numShards);
+        exact.mergeAll(threadDicts, numThreads, false);
+        reportApproximationError(counter, exact, topK, logger);
+    }
+    return 0;
+}
+
+// one line per pipeline stage, throughput is per thread while not waiting
+// on a queue, which is what sizing the stage needs
+void reportStage(const char name[], const StageStats& stage, Logger& logger)
+{
+    double busy = std::max(stage.busySeconds, 1e-9);
+    std::string line = std::string(name) + ": " + std::to_string(stage.threads) + " threads, "
+        + std::to_string(stage.items) + " items, " + std::to_string(stage.bytes / (1024 * 1024)) + " MB";
+    if (stage.words != 0) {
+        line += ", " + std::to_string(stage.words) + " words";
+    }
+    line += ", busy " + std::to_string(stage.busySeconds) + " s, waiting " + std::to_string(stage.waitSeconds)
+        + " s, " + std::to_string(static_cast<double>(stage.bytes) / busy / 1e6) + " MB/s";
+    if (stage.words != 0) {
+        line += ", " + std::to_string(static_cast<double>(stage.words) / busy / 1e6) + " M words/s";
+    }
+    logger.log(line + " per busy thread");
+}
+
+// Function to build the dictionary through the staged read / tokenize /
+// insert pipeline instead of one thread per group of books
+int runPipeline(const std::vector<BookFile>& books, PipelineConfig config, size_t numShards,
+    const std::string& saveIndexPath, RunReport& report, Logger& logger)
+{
+    // inserters own disjoint shards, so the final dictionary needs no locks
+    SingleOwnerDictionary dict(numShards);
+    IngestPipeline<SingleOwnerDictionary> pipeline(books, dict, config);
+    config = pipeline.config();
+    std::string readers = config.backend == ReadBackend::Uring
+        ? " io_uring readers (" + std::to_string(config.uringDepth) + " books in flight each), "
+        : " pread readers, ";
+    logger.log("Pipeline: " + std::to_string(config.readers) + readers + std::to_string(config.tokenizers) + " tokenizers, " + std::to_string(config.inserters) + " inserters.");
+    PhaseTimer phases(logger, report);
+    PipelineStats stats = pipeline.run();
+    if (stats.uringUnavailable) {
+        logger.log("io_uring is not available, read with pread instead.");
+    }
+    for (const std::string& path : stats.failedBooks) {
+        logger.log("Failed to read file: " + path);
+    }
+    reportStage("read", stats.read, logger);
+    reportStage("tokenize", stats.tokenize, logger);
+    reportStage("insert", stats.insert, logger);
+    phases.lap("Pipeline");
+
+    if constexpr (kInstrumented) {
+        std::vector<ShardStats> shards;
+        for (size_t i = 0; i < dict.numShards(); ++i) {
+            shards.push_back(dict.shardStats(i));
+        }
+        report.setShards(shards, false);
+    }
+    dict.removeSingleOccurrences();
+    phases.lap("Removing singles");
+    if (!saveIndexPath.empty()) {
+        if (!writeIndex(saveIndexPath, dict, books)) {
+            logger.log("Failed to write index: " + saveIndexPath);
+            return 1;
+        }
+        phases.lap("Saving index");
+    }
+    dict.print();
+    phases.lap("Print");
+    return 0;
+}
+
+// spill files are written and read through buffers this big
+constexpr size_t kSpillBufferBytes = 256 * 1024;
+
+// Function to drain tasks like processBookTasks into a dictionary that is
+// written out to spill as a sorted run and emptied whenever it grows past
+// budgetBytes, and once more at the end. Returns false if a run could not be
+// written.
+bool spillBookTasks(WorkStealingScheduler& scheduler, unsigned worker, const std::vector<BookFile>& books,
+    size_t numShards, size_t budgetBytes, SpillDirectory& spill, ThreadStats& stats, Logger& logger)
+{
+    WordTokenizer tokenizer;
+    SingleOwnerDictionary dict(numShards);
+    // measuring walks the whole dictionary, so only after every budget / 8
+    // bytes of text; a word never costs much more than its bytes in the text,
+    // and compressed books are taken to hold about 4x their size in text
+    constexpr uintmax_t kCompressionRatio = 4;
+    size_t textSinceCheck = 0;
+    auto spillRun = [&] {
+        std::string run = spill.newRunPath();
+        if (!writeSpillRun(run, dict, kSpillBufferBytes)) {
+            logger.log("Failed to write spill file: " + run);
+            return false;
+        }
+        spill.addRun(run);
+        dict.reset();
+        return true;
+    };
+    BookTask task;
+    while (scheduler.next(worker, task)) {
+        const BookFile& book = books[task.bookIndex];
+        int bookId = static_cast<int>(task.bookIndex);
+        if (!processBookMapped(book, dict, bookId, tokenizer, stats, task, &scheduler.seams())) {
+            if (task.begin == 0 && task.end == BookTask::kToEnd) {
+                processBookStream(book, dict, bookId, tokenizer, stats, logger);
+            } else {
+                logger.log("Failed to map file: " + book.path);
+            }
+        }
+        textSinceCheck += (std::min<uintmax_t>(task.end, book.size) - task.begin)
+            * (book.compression != Compression::None ? kCompressionRatio : 1);
+        if (textSinceCheck >= budgetBytes / 8) {
+            textSinceCheck = 0;
+            if (dict.memoryBytes() >= budgetBytes && !spillRun()) {
+                return false;
+            }
+        }
+    }
+    return dict.numWords() == 0 || spillRun();
+}
+
+// Builds the dictionary in about budgetBytes of memory however large the
+// corpus: every thread spills sorted runs of its dictionary to temporary
+// files under spillParent (spillBookTasks), then the runs are merged a
+// fan-in at a time, one buffer per run, until one streaming pass can print
+// the result. Words are printed in byte order instead of shard order.
+int runOutOfCore(const std::vector<BookFile>& books, unsigned numThreads, size_t chunkBytes, size_t budgetBytes,
+    const std::string& spillParent, size_t numShards, RunReport& report, Logger& logger)
+{
+    SpillDirectory spill(spillParent);
+    if (!spill.isOpen()) {
+        logger.log("Failed to create a spill directory in " + spillParent);
+        return 1;
+    }
+    // half the budget for the thread dictionaries, the rest covers sorting a
+    // run, the spill buffers, the mapped books and the allocator's slack
+    size_t threadBudget = std::max<size_t>(budgetBytes / 2 / numThreads, 1024 * 1024);
+    size_t fanIn = std::max<size_t>(budgetBytes / 4 / kSpillBufferBytes, 2);
+    logger.log("Out of core: spilling thread dictionaries past " + std::to_string(threadBudget / 1024)
+        + " KB to " + spill.path() + ", merging " + std::to_string(fanIn) + " runs at a time.");
+
+    PhaseTimer phases(logger, report);
+    WorkStealingScheduler scheduler(books, numThreads, chunkBytes);
+    std::vector<ThreadStats> threadStats(numThreads);
+    std::atomic<bool> failed { false };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threads.emplace_back([&, i] {
+            if (!spillBookTasks(scheduler, i, books, numShards, threadBudget, spill, threadStats[i], logger)) {
+                failed.store(true);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    report.setThreads(threadStats);
+    if (failed.load()) {
+        return 1;
+    }
+    std::vector<std::string> runs = spill.takeRuns();
+    phases.lap("Ingest");
+    logger.log("Spilled " + std::to_string(runs.size()) + " runs.");
+
+    // intermediate passes until the rest fit in one, oldest runs first
+    while (runs.size() > fanIn) {
+        std::vector<std::string> group(runs.begin(), runs.begin() + static_cast<std::ptrdiff_t>(fanIn));
+        std::string merged = spill.newRunPath();
+        SpillRunWriter writer(merged, kSpillBufferBytes);
+        auto write = [&](const std::string& word, uint64_t count, const std::vector<uint32_t>& ids) {
+            writer.write(word, count, ids.size(), [&](auto&& fn) {
+                for (uint32_t id : ids) {
+                    fn(id);
+                }
+            });
+        };
+        bool ok = writer.isOpen() && mergeSpillRuns(group, kSpillBufferBytes, write);
+        if (!writer.close() || !ok) {
+            logger.log("Failed to merge spill files into " + merged);
+            return 1;
+        }
+        for (const std::string& run : group) {
+            spill.removeRun(run);
+        }
+        runs.erase(runs.begin(), runs.begin() + static_cast<std::ptrdiff_t>(fanIn));
+        runs.push_back(merged);
+    }
+    phases.lap("Merge");
+
+    // last pass straight to stdout, words with only 1 appearance are dropped
+    std::string text;
+    auto print = [&](const std::string& word, uint64_t count, const std::vector<uint32_t>& ids) {
+        if (count == 1) {
+            return;
+        }
+        text += word;
+        text += ": ";
+        text += std::to_string(count);
+        text += " times, in ";
+        text += std::to_string(ids.size());
+        text += " books\n";
+        if (text.size() >= kSpillBufferBytes) {
+            std::cout << text;
+            text.clear();
+        }
+    };
+    bool ok = mergeSpillRuns(runs, kSpillBufferBytes, print);
+    std::cout << text;
+    if (!ok) {
+        logger.log("Failed to read spill files back.");
+        return 1;
+    }
+    phases.lap("Print");
+    return 0;
+}
+
+// what a map-reduce worker tells the coordinator, once after mapping (the
+// map fields) and once after reducing (all of them)
+struct WorkerReport {
+    uint64_t books = 0;
+    uint64_t words = 0; // distinct words it reduced, after removing singles
+    uint64_t bytesSent = 0;
+    uint64_t recordsSent = 0;
+    uint64_t bytesReceived = 0;
+    double mapSeconds = 0;
+    double shuffleSeconds = 0; // from the end of its map until every stream is in
+};
+
+// one byte each way over the control socket to hand out the turn to print
+constexpr char kPrintTurn = 'p';
+constexpr char kPrintDone = 'd';
+
+// Worker self of numWorkers in a map-reduce run, in its own process. Maps
+// books (ids from firstBookId) into a local dictionary, sends the shards
+// every other worker reduces (shard s goes to worker s % numWorkers) over
+// peers[r] while folding the streams coming in into its own shards, drops
+// the singles and prints its shards when the coordinator says so.
+int runMapReduceWorker(const std::vector<BookFile>& books, int firstBookId, size_t self, size_t numWorkers,
+    size_t numShards, const std::vector<int>& peers, int control, Logger& logger)
+{
+    WorkerReport report;
+    auto mapStart = std::chrono::steady_clock::now();
+    SingleOwnerDictionary dict(numShards);
+    ThreadStats stats;
+    processBooks(books, dict, stats, firstBookId, logger, IngestMode::Mmap, std::chrono::milliseconds(0));
+    auto shuffleStart = std::chrono::steady_clock::now();
+    report.books = books.size();
+    report.mapSeconds = std::chrono::duration<double>(shuffleStart - mapStart).count();
+    if (!writeAll(control, &report, sizeof(report))) {
+        return 1;
+    }
+
+    // the sender only reads shards other workers own and the receiver only
+    // writes this worker's, so the two never touch the same shard
+    std::atomic<bool> sendFailed { false };
+    std::thread sender([&] {
+        std::string buffer;
+        auto send = [&](int fd) {
+            if (!writeAll(fd, buffer.data(), buffer.size())) {
+                sendFailed.store(true);
+            }
+            report.bytesSent += buffer.size();
+            buffer.clear();
+        };
+        for (size_t step = 1; step < numWorkers; ++step) {
+            size_t to = (self + step) % numWorkers; // staggered so no worker is everyone's first target
+            for (size_t s = to; s < numShards; s += numWorkers) {
+                dict.forEachInShard(s, [&](std::string_view word, const DictionaryEntry& entry) {
+                    appendShuffleRecord(buffer, word, entry.wordCount, entry.bookIds);
+                    ++report.recordsSent;
+                    if (buffer.size() >= kSpillBufferBytes) {
+                        send(peers[to]);
+                    }
+                });
+            }
+            appendShuffleEnd(buffer);
+            send(peers[to]);
+        }
+    });
+
+    std::vector<ShuffleDecoder> decoders(numWorkers);
+    std::vector<pollfd> open;
+    for (size_t r = 0; r < numWorkers; ++r) {
+        if (r != self) {
+            open.push_back({ peers[r], POLLIN, 0 });
+        }
+    }
+    std::vector<char> chunk(kSpillBufferBytes);
+    bool receiveFailed = false;
+    auto fold = [&](std::string_view word, int count, PostingList&& bookIds) {
+        dict.mergeEntry(word, count, std::move(bookIds));
+    };
+    while (!open.empty() && !receiveFailed) {
+        if (::poll(open.data(), open.size(), -1) < 0) {
+            receiveFailed = errno != EINTR;
+            continue;
+        }
+        for (size_t i = 0; i < open.size();) {
+            if (open[i].revents == 0) {
+                ++i;
+                continue;
+            }
+            size_t from = static_cast<size_t>(std::find(peers.begin(), peers.end(), open[i].fd) - peers.begin());
+            ssize_t got = ::read(open[i].fd, chunk.data(), chunk.size());
+            if (got <= 0 && !(got < 0 && errno == EINTR)) {
+                receiveFailed = true; // a peer went away before ending its stream
+                break;
+            }
+            if (got > 0) {
+                report.bytesReceived += static_cast<uint64_t>(got);
+                decoders[from].feed(chunk.data(), static_cast<size_t>(got));
+            }
+            if (decoders[from].drain(fold)) {
+                open.erase(open.begin() + static_cast<std::ptrdiff_t>(i));
+            } else {
+                open[i].revents = 0;
+                ++i;
+            }
+        }
+    }
+    sender.join();
+    if (receiveFailed || sendFailed.load()) {
+        logger.log("Worker " + std::to_string(self) + " lost a shuffle connection.");
+        return 1;
+    }
+    for (size_t s = 0; s < numShards; ++s) {
+        if (s % numWorkers != self) {
+            dict.clearShard(s);
+        }
+    }
+    dict.removeSingleOccurrences();
+    report.words = dict.numWords();
+    report.shuffleSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - shuffleStart).count();
+    if (!writeAll(control, &report, sizeof(report))) {
+        return 1;
+    }
+
+    char turn = 0;
+    if (!readAll(control, &turn, 1) || turn != kPrintTurn) {
+        return 1;
+    }
+    dict.print();
+    std::cout.flush();
+    return writeAll(control, &kPrintDone, 1) ? 0 : 1;
+}
+
+// Map-reduce over numWorkers processes on this machine, each standing in for
+// a node: the coordinator (this process) splits the books into contiguous
+// ranges of about equal bytes, forks a worker per range and connects every
+// pair of workers with a Unix domain socket for the shuffle (see
+// runMapReduceWorker and shuffle.hpp). It then only collects the workers'
+// reports, logs how much the shuffle moved, and lets them print one after
+// another so their output isn't interleaved.
+int runMapReduce(const std::vector<BookFile>& books, size_t numWorkers, size_t numShards, RunReport& report,
+    Logger& logger)
+{
+    uintmax_t totalBytes = 0;
+    for (const BookFile& book : books) {
+        totalBytes += book.size;
+    }
+    // worker w gets the books from starts[w], cut where the running byte
+    // total passes w / numWorkers of the whole
+    std::vector<size_t> starts(numWorkers + 1, books.size());
+    starts[0] = 0;
+    uintmax_t seen = 0;
+    size_t next = 1;
+    for (size_t i = 0; i < books.size() && next < numWorkers; ++i) {
+        while (next < numWorkers && seen >= totalBytes * next / numWorkers) {
+            starts[next++] = i;
+        }
+        seen += books[i].size;
+    }
+
+    // peers[w][r] is worker w's end of its socket to worker r
+    std::vector<std::vector<int>> peers(numWorkers, std::vector<int>(numWorkers, -1));
+    std::vector<int> controls(numWorkers, -1), workerControls(numWorkers, -1);
+    bool socketsOk = true;
+    for (size_t w = 0; w < numWorkers && socketsOk; ++w) {
+        int pair[2];
+        socketsOk = ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0;
+        if (socketsOk) {
+            controls[w] = pair[0];
+            workerControls[w] = pair[1];
+        }
+        for (size_t r = w + 1; r < numWorkers && socketsOk; ++r) {
+            socketsOk = ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0;
+            if (socketsOk) {
+                peers[w][r] = pair[0];
+                peers[r][w] = pair[1];
+            }
+        }
+    }
+    // closes every worker's sockets but those of worker keep
+    auto closeWorkerEnds = [&](size_t keep) {
+        for (size_t w = 0; w < numWorkers; ++w) {
+            if (w == keep) {
+                continue;
+            }
+            for (int fd : peers[w]) {
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+            if (workerControls[w] >= 0) {
+                ::close(workerControls[w]);
+            }
+        }
+    };
+    auto closeControls = [&] {
+        for (int fd : controls) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    };
+    if (!socketsOk) {
+        logger.log("Failed to create the shuffle sockets.");
+        closeWorkerEnds(numWorkers);
+        closeControls();
+        return 1;
+    }
+
+    logger.log("Map-reduce over " + std::to_string(numWorkers) + " worker processes, worker w reduces shards s with "
+        "s % " + std::to_string(numWorkers) + " == w.");
+    PhaseTimer phases(logger, report);
+    std::vector<pid_t> pids;
+    for (size_t w = 0; w < numWorkers; ++w) {
+        pid_t pid = ::fork();
+        if (pid == 0) {
+            // a peer that dies shows up as a failed write, not a signal
+            std::signal(SIGPIPE, SIG_IGN);
+            closeWorkerEnds(w);
+            closeControls();
+            std::vector<BookFile> mine(books.begin() + static_cast<std::ptrdiff_t>(starts[w]),
+                books.begin() + static_cast<std::ptrdiff_t>(starts[w + 1]));
+            int status = runMapReduceWorker(mine, static_cast<int>(starts[w]), w, numWorkers, numShards, peers[w],
+                workerControls[w], logger);
+            std::cout.flush();
+            ::_exit(status);
+        }
+        if (pid < 0) {
+            logger.log("Failed to start worker " + std::to_string(w) + ".");
+            break;
+        }
+        pids.push_back(pid);
+    }
+    closeWorkerEnds(numWorkers); // the coordinator only keeps the control sockets
+    auto finish = [&](bool failed) {
+        for (pid_t pid : pids) {
+            if (failed) {
+                ::kill(pid, SIGKILL);
+            }
+            int status = 0;
+            failed = ::waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || failed;
+        }
+        closeControls();
+        if (failed) {
+            logger.log("A map-reduce worker failed.");
+        }
+        return failed ? 1 : 0;
+    };
+    if (pids.size() != numWorkers) {
+        return finish(true);
+    }
+
+    std::vector<WorkerReport> reports(numWorkers);
+    for (size_t w = 0; w < numWorkers; ++w) {
+        if (!readAll(controls[w], &reports[w], sizeof(WorkerReport))) {
+            return finish(true);
+        }
+    }
+    phases.lap("Map");
+    for (size_t w = 0; w < numWorkers; ++w) {
+        if (!readAll(controls[w], &reports[w], sizeof(WorkerReport))) {
+            return finish(true);
+        }
+    }
+    // the shuffle of early workers overlaps the map of the late ones, this is
+    // what is left of it after the last map ends, folding included
+    phases.lap("Shuffle");
+
+    uint64_t bytesSent = 0, recordsSent = 0;
+    double slowestShuffle = 0;
+    for (size_t w = 0; w < numWorkers; ++w) {
+        const WorkerReport& r = reports[w];
+        logger.log("Worker " + std::to_string(w) + ": " + std::to_string(r.books) + " books mapped in "
+            + std::to_string(r.mapSeconds) + " s, sent " + std::to_string(r.recordsSent) + " records ("
+            + std::to_string(r.bytesSent / 1024) + " KB), received " + std::to_string(r.bytesReceived / 1024)
+            + " KB, shuffled in " + std::to_string(r.shuffleSeconds) + " s, reduced to " + std::to_string(r.words)
+            + " words.");
+        bytesSent += r.bytesSent;
+        recordsSent += r.recordsSent;
+        slowestShuffle = std::max(slowestShuffle, r.shuffleSeconds);
+    }
+    logger.log("Shuffle moved " + std::to_string(recordsSent) + " records, "
+        + std::to_string(static_cast<double>(bytesSent) / (1024 * 1024)) + " MB, "
+        + std::to_string(static_cast<double>(bytesSent) / (1024 * 1024) / std::max(slowestShuffle, 1e-9))
+        + " MB/s over the slowest worker's shuffle.");
+
+    for (size_t w = 0; w < numWorkers; ++w) {
+        char done = 0;
+        if (!writeAll(controls[w], &kPrintTurn, 1) || !readAll(controls[w], &done, 1) || done != kPrintDone) {
+            return finish(true);
+        }
+    }
+    phases.lap("Print");
+    return finish(false);
+}
+
+// Function to ingest the delta of an incremental update. Like
+// processBookTasks, but every book is counted on its own first, so its word
+// counts can be recorded for retracting it later, and its content hash is
+// taken from the same mapping. A book that can't be read is flagged in failed.
+void indexDeltaBooks(WorkStealingScheduler& scheduler, unsigned worker, const std::vector<BookFile>& books,
+    const std::vector<int>& bookIds, std::vector<uint64_t>& hashes, std::vector<char>& failed,
+    SingleOwnerDictionary& dict, std::string& bookTerms, Logger& logger)
+{
+    WordTokenizer tokenizer;
+    OpenWordTable<int> counts;
+    BookTask task;
+    while (scheduler.next(worker, task)) {
+        MappedFile file(books[task.bookIndex].path);
+        if (!file.isOpen()) {
+            logger.log("Failed to map file: " + books[task.bookIndex].path);
+            failed[task.bookIndex] = 1;
+            continue;
+        }
+        int bookId = bookIds[task.bookIndex];
+        hashes[task.bookIndex] = contentHash(file.view());
+        auto count = [&](std::string_view word) { ++*counts.tryEmplace(word, WordHash {}(word)).first; };
+        Compression compression = books[task.bookIndex].compression;
+        if (compression == Compression::None) {
+            tokenizer.forEachWord(file.view(), count);
+        } else {
+            RangeEdges edges;
+            uint64_t decoded = 0;
+            if (!forEachDecompressedText(file.view(), compression, 0, BookTask::kToEnd, edges, decoded,
+                    [&](std::string_view text) { tokenizer.forEachWord(text, count); })) {
+                logger.log("Failed to decompress file: " + books[task.bookIndex].path);
+                failed[task.bookIndex] = 1;
+                counts.clear();
+                continue;
+            }
+        }
+        counts.forEach([&](std::string_view word, int count) { dict.insert(word, bookId, count); });
+        appendBookTerms(bookTerms, bookId, counts);
+        counts.clear();
+    }
+}
+
+// Brings the index at indexPath up to date with booksDirectory, building it
+// from scratch the first time, then prints the dictionary like a normal run.
+// Only new and changed books are read. The old index is loaded and removed or
+// changed books are retracted from it on a background thread while the delta
+// is ingested, then the per-thread delta dictionaries are merged into it by
+// shard. The index keeps words seen once, they are only dropped from the
+// printed output, so later updates can still add to them.
+int runIncremental(const std::string& indexPath, const std::string& booksDirectory, size_t numShards,
+    unsigned numThreads, Logger& logger)
+{
+    std::string manifestPath = indexPath + ".manifest";
+    std::string bookTermsPath = indexPath + ".books";
+    std::vector<ManifestEntry> manifest;
+    if (!loadManifest(manifestPath, manifest)) {
+        logger.log("Failed to read manifest " + manifestPath);
+        return 1;
+    }
+    bool haveIndex = !manifest.empty() && std::filesystem::exists(indexPath);
+    if (!haveIndex) {
+        manifest.clear();
+    }
+
+    std::unordered_map<std::string, size_t> known;
+    int nextBookId = 0;
+    for (size_t i = 0; i < manifest.size(); ++i) {
+        known.emplace(manifest[i].path, i);
+        nextBookId = std::max(nextBookId, manifest[i].bookId + 1);
+    }
+    std::vector<char> seen(manifest.size(), 0);
+    std::vector<char> retracted(static_cast<size_t>(nextBookId), 0);
+    std::vector<ManifestEntry> updated; // the manifest after this run
+    std::vector<size_t> deltaEntries; // indices into updated of books to ingest
+    size_t numChanged = 0, numNew = 0, numRemoved = 0;
+
+    for (const BookFile& book : getAllBookFiles(booksDirectory, logger)) {
+        ManifestEntry entry { book.path, book.size, modificationTime(book.path), 0, -1 };
+        auto it = known.find(book.path);
+        if (it != known.end()) {
+            const ManifestEntry& old = manifest[it->second];
+            seen[it->second] = 1;
+            entry.bookId = old.bookId;
+            entry.hash = old.hash;
+            if (old.size == entry.size && old.mtime == entry.mtime) {
+                updated.push_back(std::move(entry));
+                continue;
+            }
+            // touched or rewritten, only the contents can tell
+            MappedFile file(book.path);
+            if (file.isOpen() && contentHash(file.view()) == old.hash) {
+                updated.push_back(std::move(entry));
+                continue;
+            }
+            retracted[static_cast<size_t>(old.bookId)] = 1;
+            ++numChanged;
+        } else {
+            ++numNew;
+        }
+        deltaEntries.push_back(updated.size());
+        updated.push_back(std::move(entry));
+    }
+
+    // removed books give their ids back to new books
+    std::vector<int> freeIds;
+    for (size_t i = 0; i < manifest.size(); ++i) {
+        if (!seen[i]) {
+            retracted[static_cast<size_t>(manifest[i].bookId)] = 1;
+            freeIds.push_back(manifest[i].bookId);
+            ++numRemoved;
+        }
+    }
+    std::sort(freeIds.rbegin(), freeIds.rend());
+    std::vector<BookFile> deltaBooks;
+    std::vector<int> deltaIds;
+    for (size_t index : deltaEntries) {
+        ManifestEntry& entry = updated[index];
+        if (entry.bookId < 0) {
+            if (freeIds.empty()) {
+                entry.bookId = nextBookId++;
+            } else {
+                entry.bookId = freeIds.back();
+                freeIds.pop_back();
+            }
+        }
+        deltaBooks.push_back({ entry.path, entry.size, compressionFromName(entry.path), {} });
+        deltaIds.push_back(entry.bookId);
+    }
+    logger.log(std::to_string(updated.size() - deltaEntries.size()) + " unchanged, " + std::to_string(numChanged)
+        + " changed, " + std::to_string(numNew) + " new, " + std::to_string(numRemoved) + " removed books.");
+
+    // the main index is loaded and retracted from while the delta is ingested
+    ShardedConcurrentDictionary mainDict(numShards);
+    std::string loadError;
+    std::thread loader([&] {
+        if (!haveIndex) {
+            return;
+        }
+        IndexReader reader(indexPath);
+        BookTermsReader bookTerms(bookTermsPath);
+        if (!reader.isOpen() || !bookTerms.isOpen()) {
+            loadError = reader.isOpen() ? "missing " + bookTermsPath : reader.error();
+            return;
+        }
+        loadIndex(reader, mainDict);
+        bool intact = bookTerms.forEachRecord([&](int bookId, std::string_view record) {
+            if (static_cast<size_t>(bookId) < retracted.size() && retracted[static_cast<size_t>(bookId)]) {
+                BookTermsReader::forEachWord(record, [&](std::string_view word, int count) {
+                    mainDict.retract(word, count, bookId);
+                });
+            }
+        });
+        if (!intact) {
+            // books past the damage can't be retracted, rebuild with --save-index
+            loadError = "truncated " + bookTermsPath;
+        }
+    });
+
+    std::vector<std::unique_ptr<SingleOwnerDictionary>> deltaDicts;
+    std::vector<std::string> deltaTerms(numThreads);
+    std::vector<uint64_t> hashes(deltaBooks.size(), 0);
+    std::vector<char> failed(deltaBooks.size(), 0);
+    WorkStealingScheduler scheduler(deltaBooks, numThreads, 0); // whole books, each gets its own counts
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < numThreads; ++i) {
+        deltaDicts.emplace_back(std::make_unique<SingleOwnerDictionary>(numShards));
+        threads.emplace_back(indexDeltaBooks, std::ref(scheduler), i, std::cref(deltaBooks), std::cref(deltaIds),
+            std::ref(hashes), std::ref(failed), std::ref(*deltaDicts[i]), std::ref(deltaTerms[i]), std::ref(logger));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    loader.join();
+    if (!loadError.empty()) {
+        logger.log("Failed to load index " + indexPath + ": " + loadError);
+        return 1;
+    }
+    mainDict.mergeAll(deltaDicts, numThreads, false);
+
+    // unreadable books are left out of the manifest, the next run retries them
+    for (size_t i = 0; i < deltaEntries.size(); ++i) {
+        updated[deltaEntries[i]].hash = hashes[i];
+        if (failed[i]) {
+            updated[deltaEntries[i]].bookId = -1;
+        }
+    }
+    std::erase_if(updated, [](const ManifestEntry& entry) { return entry.bookId < 0; });
+
+    std::vector<BookFile> booksById;
+    for (const ManifestEntry& entry : updated) {
+        if (booksById.size() <= static_cast<size_t>(entry.bookId)) {
+            booksById.resize(static_cast<size_t>(entry.bookId) + 1);
+        }
+        booksById[static_cast<size_t>(entry.bookId)] = { entry.path, entry.size, compressionFromName(entry.path), {} };
+    }
+
+    // every file is written next to its target and renamed over it, the
+    // manifest last, so an interrupted update leaves the old one in use
+    bool written = false;
+    {
+        BookTermsReader oldTerms(bookTermsPath);
+        std::vector<std::string_view> records;
+        bool intact = oldTerms.forEachRecord([&](int bookId, std::string_view record) {
+            if (static_cast<size_t>(bookId) >= retracted.size() || !retracted[static_cast<size_t>(bookId)]) {
+                records.push_back(record);
+            }
+        });
+        if (!intact) {
+            // rewriting it would drop the books past the damage for good
+            loadError = "truncated " + bookTermsPath;
+            logger.log("Failed to load index " + indexPath + ": " + loadError);
+            return 1;
+        }
+        records.insert(records.end(), deltaTerms.begin(), deltaTerms.end());
+        written = writeBookTerms(bookTermsPath + ".tmp", records) && writeIndex(indexPath + ".tmp", mainDict, booksById)
+            && saveManifest(manifestPath + ".tmp", updated);
+    }
+    std::error_code ec;
+    if (written) {
+        std::filesystem::rename(bookTermsPath + ".tmp", bookTermsPath, ec);
+        if (!ec) {
+            std::filesystem::rename(indexPath + ".tmp", indexPath, ec);
+        }
+        if (!ec) {
+            std::filesystem::rename(manifestPath + ".tmp", manifestPath, ec);
+        }
+    }
+    if (!written || ec) {
+        logger.log("Failed to write index: " + indexPath);
+        return 1;
+    }
+
+    mainDict.removeSingleOccurrences();
+    mainDict.print();
+    return 0;
+}
+
+// true if arg is --name=value, value gets everything after the '='
+bool optionValue(const std::string& arg, std::string_view name, std::string& value)
+{
+    if (arg.size() <= name.size() || arg.compare(0, name.size(), name) != 0 || arg[name.size()] != '=') {
+        return false;
+    }
+    value = arg.substr(name.size() + 1);
+    return true;
+}
+
+// parses an unsigned option value, logs and returns false if it isn't one
+bool parseCount(const std::string& value, const std::string& what, size_t& out, Logger& logger)
+{
+    try {
+        size_t used = 0;
+        out = std::stoul(value, &used);
+        if (used == value.size() && value[0] != '-') {
+            return true;
+        }
+    } catch (const std::exception& e) {
+    }
+    logger.log("Invalid " + what + " provided.");
+    return false;
+}
+
 int main(int argc, char* argv[])
 {
     Logger logger;
@@ -188,13 +1294,156 @@ int main(int argc, char* argv[])
     // cli options
     std::string booksDirectory = "/home/adilh/classes/ECE451-Parallel/data/books";
     size_t numShards = 16;
+    IngestMode ingestMode = IngestMode::Mmap;
+    ScheduleMode scheduleMode = ScheduleMode::Steal;
+    size_t chunkBytes = 4 * 1024 * 1024;
+    unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::string saveIndexPath;
+    std::string loadIndexPath;
+    std::vector<std::string> lookups;
+    std::string updateIndexPath;
+    size_t approxBudgetMb = 0; // 0 counts exactly
+    size_t topK = 50;
+    bool approxCheck = false;
+    bool pipelined = false;
+    PipelineConfig pipelineConfig;
+    size_t readers = 0, tokenizers = 0, inserters = 0; // 0 picks from --threads
+    bool serve = false;
+    size_t publishMs = 200;
+    std::string reportPath; // instrumentation report, stderr when empty
+    size_t memoryBudgetMb = 0; // 0 keeps everything in memory
+    std::string spillDirectory = std::filesystem::temp_directory_path().string();
+    size_t numWorkers = 0; // 0 runs in this process alone
 
-    if (argc >= 2) {
-        booksDirectory = argv[1];
+    // --options can go anywhere, everything else is positional
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value;
+        if (arg == "--ingest=mmap") {
+            ingestMode = IngestMode::Mmap;
+        } else if (arg == "--ingest=stream") {
+            ingestMode = IngestMode::Stream;
+        } else if (arg == "--schedule=static") {
+            scheduleMode = ScheduleMode::Static;
+        } else if (arg == "--schedule=steal") {
+            scheduleMode = ScheduleMode::Steal;
+        } else if (optionValue(arg, "--chunk-mb", value)) {
+            size_t chunkMb = 0;
+            if (!parseCount(value, "chunk size", chunkMb, logger)) {
+                return 1;
+            }
+            chunkBytes = chunkMb * 1024 * 1024; // 0 disables splitting
+        } else if (optionValue(arg, "--threads", value)) {
+            size_t threadCount = 0;
+            if (!parseCount(value, "number of threads", threadCount, logger)) {
+                return 1;
+            }
+            if (threadCount == 0) {
+                logger.log("Number of threads must be at least 1.");
+                return 1;
+            }
+            numThreads = static_cast<unsigned int>(threadCount);
+        } else if (optionValue(arg, "--save-index", value)) {
+            saveIndexPath = value;
+        } else if (optionValue(arg, "--load-index", value)) {
+            loadIndexPath = value;
+        } else if (optionValue(arg, "--update-index", value)) {
+            updateIndexPath = value;
+        } else if (optionValue(arg, "--approx-mb", value)) {
+            if (!parseCount(value, "memory budget", approxBudgetMb, logger)) {
+                return 1;
+            }
+            if (approxBudgetMb == 0) {
+                logger.log("Memory budget must be at least 1 MB.");
+                return 1;
+            }
+        } else if (optionValue(arg, "--top", value)) {
+            if (!parseCount(value, "top-K size", topK, logger)) {
+                return 1;
+            }
+        } else if (arg == "--pipeline") {
+            pipelined = true;
+        } else if (arg == "--reader=pread") {
+            pipelineConfig.backend = ReadBackend::Pread;
+        } else if (arg == "--reader=uring") {
+            pipelineConfig.backend = ReadBackend::Uring;
+        } else if (optionValue(arg, "--uring-depth", value)) {
+            size_t depth = 0;
+            if (!parseCount(value, "io_uring depth", depth, logger)) {
+                return 1;
+            }
+            pipelineConfig.uringDepth = static_cast<unsigned>(std::min<size_t>(depth, 4096));
+        } else if (optionValue(arg, "--buffer-kb", value)) {
+            size_t bufferKb = 0;
+            if (!parseCount(value, "buffer size", bufferKb, logger)) {
+                return 1;
+            }
+            pipelineConfig.bufferBytes = bufferKb * 1024;
+        } else if (optionValue(arg, "--readers", value)) {
+            if (!parseCount(value, "number of readers", readers, logger)) {
+                return 1;
+            }
+        } else if (optionValue(arg, "--tokenizers", value)) {
+            if (!parseCount(value, "number of tokenizers", tokenizers, logger)) {
+                return 1;
+            }
+        } else if (optionValue(arg, "--inserters", value)) {
+            if (!parseCount(value, "number of inserters", inserters, logger)) {
+                return 1;
+            }
+        } else if (arg == "--approx-check") {
+            approxCheck = true;
+        } else if (optionValue(arg, "--lookup", value)) {
+            lookups.push_back(value);
+        } else if (arg == "--serve-queries") {
+            serve = true;
+        } else if (optionValue(arg, "--publish-ms", value)) {
+            if (!parseCount(value, "publish interval", publishMs, logger)) {
+                return 1;
+            }
+            if (publishMs == 0) {
+                logger.log("Publish interval must be at least 1 ms.");
+                return 1;
+            }
+        } else if (optionValue(arg, "--memory-mb", value)) {
+            if (!parseCount(value, "memory budget", memoryBudgetMb, logger)) {
+                return 1;
+            }
+            if (memoryBudgetMb == 0) {
+                logger.log("Memory budget must be at least 1 MB.");
+                return 1;
+            }
+        } else if (optionValue(arg, "--spill-dir", value)) {
+            spillDirectory = value;
+        } else if (optionValue(arg, "--workers", value)) {
+            if (!parseCount(value, "number of workers", numWorkers, logger)) {
+                return 1;
+            }
+            if (numWorkers == 0 || numWorkers > 256) {
+                logger.log("Number of workers must be between 1 and 256.");
+                return 1;
+            }
+        } else if (optionValue(arg, "--instrument-out", value)) {
+            if (!kInstrumented) {
+                logger.log("--instrument-out needs a build with instrumentation (make INSTRUMENT=1).");
+                return 1;
+            }
+            reportPath = value;
+        } else if (arg.rfind("--", 0) == 0) {
+            logger.log("Unknown option: " + arg);
+            return 1;
+        } else {
+            positional.push_back(std::move(arg));
+        }
+    }
+
+    if (positional.size() >= 1) {
+        booksDirectory = positional[0];
     }
-    if (argc >= 3) {
+    if (positional.size() >= 2) {
         try {
-            numShards = std::stoul(argv[2]);
+            numShards = std::stoul(positional[1]);
             if (numShards == 0) {
                 logger.log("Number of shards must be at least 1.");
                 return 1;
@@ -208,37 +1457,121 @@ int main(int argc, char* argv[])
         }
     }
 
-    std::vector<std::string> allBooks = getAllBookFiles(booksDirectory, logger);
+    if (!loadIndexPath.empty()) {
+        return runFromIndex(loadIndexPath, lookups, numShards, logger);
+    }
+    if (!lookups.empty() && approxBudgetMb == 0) {
+        logger.log("--lookup needs --load-index or --approx-mb.");
+        return 1;
+    }
+
+    if (!updateIndexPath.empty()) {
+        return runIncremental(updateIndexPath, booksDirectory, numShards, numThreads, logger);
+    }
+
+    RunReport report;
+    PhaseTimer phases(logger, report);
+    std::vector<BookFile> allBooks = getAllBookFiles(booksDirectory, logger);
+    phases.lap("Listing books");
 
     if (allBooks.empty()) {
         logger.log("No books provided.");
         return 1;
     }
+    findBookFrames(allBooks, chunkBytes);
+
+    if (numWorkers != 0) {
+        if (pipelined || approxBudgetMb != 0 || serve || !saveIndexPath.empty() || memoryBudgetMb != 0) {
+            logger.log("--workers can't be combined with --pipeline, --approx-mb, --serve-queries, --save-index or "
+                       "--memory-mb.");
+            return 1;
+        }
+        int status = runMapReduce(allBooks, numWorkers, numShards, report, logger);
+        return status != 0 ? status : writeReport(report, reportPath, logger);
+    }
 
-    const unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
     logger.log("Using " + std::to_string(numThreads) + " threads.");
 
-    // dictionaries for each thread as unique_ptr
-    std::vector<std::unique_ptr<ShardedConcurrentDictionary>> threadDicts;
+    if (memoryBudgetMb != 0) {
+        if (pipelined || approxBudgetMb != 0 || serve || !saveIndexPath.empty()) {
+            logger.log("--memory-mb can't be combined with --pipeline, --approx-mb, --serve-queries or --save-index.");
+            return 1;
+        }
+        int status = runOutOfCore(allBooks, numThreads, chunkBytes, memoryBudgetMb * 1024 * 1024, spillDirectory,
+            numShards, report, logger);
+        return status != 0 ? status : writeReport(report, reportPath, logger);
+    }
+
+    if (pipelined) {
+        if (std::any_of(allBooks.begin(), allBooks.end(),
+                [](const BookFile& book) { return book.compression != Compression::None; })) {
+            logger.log("--pipeline only reads plain text books.");
+            return 1;
+        }
+        // by default one reader, a third of the rest inserting and the others tokenizing
+        pipelineConfig.readers = static_cast<unsigned>(readers != 0 ? readers : 1);
+        unsigned rest = numThreads > pipelineConfig.readers ? numThreads - pipelineConfig.readers : 1;
+        pipelineConfig.inserters = static_cast<unsigned>(inserters != 0 ? inserters : std::max(1u, rest / 3));
+        pipelineConfig.tokenizers = static_cast<unsigned>(
+            tokenizers != 0 ? tokenizers : std::max(1u, rest > pipelineConfig.inserters ? rest - pipelineConfig.inserters : 1));
+        int status = runPipeline(allBooks, pipelineConfig, numShards, saveIndexPath, report, logger);
+        return status != 0 ? status : writeReport(report, reportPath, logger);
+    }
+
+    if (approxBudgetMb != 0) {
+        if (!ApproximateCounter::fitsTopK(approxBudgetMb * 1024 * 1024 / numThreads, topK)) {
+            logger.log("--top=" + std::to_string(topK) + " does not fit in a quarter of the per-thread budget ("
+                + std::to_string(approxBudgetMb) + " MB over " + std::to_string(numThreads)
+                + " threads), raise --approx-mb or lower --top.");
+            return 1;
+        }
+        return runApproximate(allBooks, numThreads, chunkBytes, approxBudgetMb * 1024 * 1024, topK, lookups,
+            approxCheck, numShards, logger);
+    }
+
+    // dictionaries for each thread as unique_ptr, each is only written by its
+    // own thread so they skip shard locking until they are merged
+    std::vector<std::unique_ptr<SingleOwnerDictionary>> threadDicts;
     threadDicts.reserve(numThreads);
     for (unsigned int i = 0; i < numThreads; ++i) {
-        threadDicts.emplace_back(std::make_unique<ShardedConcurrentDictionary>(numShards));
+        threadDicts.emplace_back(std::make_unique<SingleOwnerDictionary>(numShards));
     }
+    std::vector<ThreadStats> threadStats(numThreads);
 
-    size_t totalBooks = allBooks.size();
-    size_t booksPerThread = (totalBooks + numThreads - 1) / numThreads;
+    // workers only publish snapshots when someone is reading them
+    std::chrono::milliseconds publishInterval(serve ? publishMs : 0);
+    std::atomic<bool> stopServing { false };
+    std::thread queryThread;
+    if (serve) {
+        logger.log("Serving queries from stdin while ingesting.");
+        queryThread = std::thread(serveQueries, std::cref(threadDicts), std::cref(stopServing), std::ref(logger));
+    }
 
     std::vector<std::thread> threads;
     threads.reserve(numThreads);
-    for (unsigned int i = 0; i < numThreads; ++i) {
-        size_t startIdx = i * booksPerThread;
-        size_t endIdx = std::min(startIdx + booksPerThread, totalBooks);
-        if (startIdx >= endIdx)
-            break; // no more books
+    // chunks are cut from the mapping, the stream reader only handles whole books
+    WorkStealingScheduler scheduler(allBooks, numThreads, ingestMode == IngestMode::Mmap ? chunkBytes : 0);
+    if (scheduleMode == ScheduleMode::Steal) {
+        logger.log("Scheduling " + std::to_string(scheduler.numTasks()) + " tasks ("
+            + std::to_string(scheduler.numChunks()) + " book chunks).");
+        for (unsigned int i = 0; i < numThreads; ++i) {
+            threads.emplace_back(processBookTasks, std::ref(scheduler), i, std::cref(allBooks),
+                std::ref(*threadDicts[i]), std::ref(threadStats[i]), std::ref(logger), ingestMode, publishInterval);
+        }
+    } else {
+        size_t totalBooks = allBooks.size();
+        size_t booksPerThread = (totalBooks + numThreads - 1) / numThreads;
+
+        for (unsigned int i = 0; i < numThreads; ++i) {
+            size_t startIdx = i * booksPerThread;
+            size_t endIdx = std::min(startIdx + booksPerThread, totalBooks);
+            if (startIdx >= endIdx)
+                break; // no more books
 
-        std::vector<std::string> threadBooks(allBooks.begin() + startIdx, allBooks.begin() + endIdx);
-        threads.emplace_back(processBooks, std::move(threadBooks),
-            std::ref(*threadDicts[i]), static_cast<int>(startIdx), std::ref(logger));
+            std::vector<BookFile> threadBooks(allBooks.begin() + startIdx, allBooks.begin() + endIdx);
+            threads.emplace_back(processBooks, std::move(threadBooks), std::ref(*threadDicts[i]),
+                std::ref(threadStats[i]), static_cast<int>(startIdx), std::ref(logger), ingestMode, publishInterval);
+        }
     }
 
     // merge all threads
@@ -247,17 +1580,47 @@ int main(int argc, char* argv[])
             thread.join();
         }
     }
+    if (queryThread.joinable()) {
+        stopServing.store(true, std::memory_order_release);
+        queryThread.join();
+    }
+    phases.lap("Ingest");
+
+    // per-shard inserts happened in the thread dictionaries, before merging
+    std::vector<ShardStats> shardStats(numShards);
+    if constexpr (kInstrumented) {
+        report.setThreads(threadStats);
+        for (const auto& dict : threadDicts) {
+            for (size_t i = 0; i < numShards; ++i) {
+                shardStats[i].add(dict->shardStats(i));
+            }
+        }
+    }
 
-    // merge dictionaries
+    // merge dictionaries, every merge thread owns whole shard indices and
+    // words with only 1 appearance are removed in the same pass
     ShardedConcurrentDictionary finalDict(numShards);
-    for (const auto& dictPtr : threadDicts) {
-        finalDict.merge(*dictPtr);
+    finalDict.mergeAll(threadDicts, numThreads, true);
+    phases.lap("Merge");
+    if constexpr (kInstrumented) {
+        // distinct words are what is left after the merge, lock waits add up
+        for (size_t i = 0; i < numShards; ++i) {
+            shardStats[i].words = 0;
+            shardStats[i].add(finalDict.shardStats(i));
+        }
+        report.setShards(shardStats, false);
     }
 
-    // remove words with only 1 appearance
-    finalDict.removeSingleOccurrences();
+    if (!saveIndexPath.empty()) {
+        if (!writeIndex(saveIndexPath, finalDict, allBooks)) {
+            logger.log("Failed to write index: " + saveIndexPath);
+            return 1;
+        }
+        phases.lap("Saving index");
+    }
 
     finalDict.print();
+    phases.lap("Print");
 
-    return 0;
+    return writeReport(report, reportPath, logger);
 }
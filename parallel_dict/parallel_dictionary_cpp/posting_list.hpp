@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Compact sorted set of book ids for one word.
+//
+// Sparse lists are delta-encoded varints, so a run of nearby ids costs about
+// a byte each. Once a list is dense enough that a bitmap over [0, largest id]
+// is no bigger than its varints, it switches to the bitmap (the roaring-style
+// container for very common words), and back if a far jump in ids would make
+// the bitmap the larger of the two again.
+//
+// Ids arriving in increasing order, the usual case within a thread, are
+// appended in O(1). Out-of-order ids, which happen when the work-stealing
+// scheduler hands a thread an earlier book, wait in a small pending buffer
+// that is sorted and folded in once it grows past a fraction of the list.
+class PostingList {
+public:
+    PostingList() = default;
+    PostingList(PostingList&&) noexcept = default;
+    PostingList& operator=(PostingList&&) noexcept = default;
+
+    PostingList(const PostingList& other)
+        : bytes_(other.bytes_)
+        , last_(other.last_)
+        , count_(other.count_)
+        , recent_(other.recent_)
+        , dense_(other.dense_)
+    {
+        if (other.pending_) {
+            pending_ = std::make_unique<std::vector<uint32_t>>(*other.pending_);
+        }
+    }
+
+    PostingList& operator=(const PostingList& other)
+    {
+        PostingList copy(other);
+        return *this = std::move(copy);
+    }
+
+    void insert(int bookId)
+    {
+        uint32_t id = static_cast<uint32_t>(bookId);
+        if (count_ != 0 && id == recent_) {
+            return; // same book as the last insert, by far the most common case
+        }
+        recent_ = id;
+        if (dense_ && id <= last_) {
+            setBit(id);
+            return;
+        }
+        if (count_ == 0 || id > last_) {
+            add(id);
+            return;
+        }
+        if (id == last_) {
+            return;
+        }
+        if (!pending_) {
+            pending_ = std::make_unique<std::vector<uint32_t>>();
+        }
+        pending_->push_back(id);
+        if (pending_->size() >= std::max<size_t>(8, count_ / 4)) {
+            flushPending();
+        }
+    }
+
+    // removes bookId if present, returns whether it was. Rare (retracting a
+    // removed book), so varint lists are simply rebuilt.
+    bool erase(int bookId)
+    {
+        uint32_t id = static_cast<uint32_t>(bookId);
+        flushPending();
+        if (count_ == 0 || id > last_) {
+            return false;
+        }
+        recent_ = kNoRecent; // the next insert of any id must not be skipped
+        if (dense_) {
+            uint8_t mask = static_cast<uint8_t>(1u << (id % 8));
+            if ((bytes_[id / 8] & mask) == 0) {
+                return false;
+            }
+            bytes_[id / 8] &= static_cast<uint8_t>(~mask);
+            --count_;
+            while (!bytes_.empty() && bytes_.back() == 0) {
+                bytes_.pop_back();
+            }
+            last_ = bytes_.empty() ? 0 : static_cast<uint32_t>((bytes_.size() - 1) * 8 + 31 - __builtin_clz(bytes_.back()));
+            if (count_ == 0) {
+                dense_ = false;
+            }
+            return true;
+        }
+        std::vector<uint32_t> ids = decode();
+        auto it = std::lower_bound(ids.begin(), ids.end(), id);
+        if (it == ids.end() || *it != id) {
+            return false;
+        }
+        ids.erase(it);
+        assign(ids);
+        return true;
+    }
+
+    // number of distinct ids
+    size_t size() const
+    {
+        if (pending_ && !pending_->empty()) {
+            PostingList copy(*this);
+            copy.flushPending();
+            return copy.count_;
+        }
+        return count_;
+    }
+
+    bool empty() const { return count_ == 0; }
+
+    // calls fn(int) for every id in increasing order
+    template <typename Fn>
+    void forEach(Fn&& fn) const
+    {
+        if (pending_ && !pending_->empty()) {
+            PostingList copy(*this);
+            copy.flushPending();
+            copy.forEach(fn);
+            return;
+        }
+        if (dense_) {
+            for (size_t byte = 0; byte < bytes_.size(); ++byte) {
+                for (unsigned bits = bytes_[byte]; bits != 0; bits &= bits - 1) {
+                    fn(static_cast<int>(byte * 8 + static_cast<size_t>(__builtin_ctz(bits))));
+                }
+            }
+            return;
+        }
+        uint32_t value = 0;
+        for (size_t pos = 0; pos < bytes_.size();) {
+            value += readVarint(pos);
+            fn(static_cast<int>(value));
+        }
+    }
+
+    // sorted-set union, other is left empty
+    void unionWith(PostingList&& other)
+    {
+        flushPending();
+        other.flushPending();
+        if (other.count_ == 0) {
+            return;
+        }
+        if (count_ == 0) {
+            *this = std::move(other);
+            other = PostingList {};
+            return;
+        }
+        if (!dense_ && !other.dense_ && readFirst(other) > last_) {
+            // disjoint and after us, append without decoding ourselves
+            other.forEach([&](int id) { add(static_cast<uint32_t>(id)); });
+        } else if (dense_ || other.dense_) {
+            if (!dense_) {
+                toBitmap();
+            }
+            other.forEach([&](int id) {
+                if (static_cast<uint32_t>(id) <= last_) {
+                    setBit(static_cast<uint32_t>(id));
+                } else {
+                    add(static_cast<uint32_t>(id));
+                }
+            });
+        } else {
+            std::vector<uint32_t> merged;
+            merged.reserve(count_ + other.count_);
+            std::vector<uint32_t> mine = decode();
+            std::vector<uint32_t> theirs = other.decode();
+            std::set_union(mine.begin(), mine.end(), theirs.begin(), theirs.end(), std::back_inserter(merged));
+            assign(merged);
+        }
+        other = PostingList {};
+    }
+
+    // heap bytes owned by the list, for memory accounting
+    size_t memoryBytes() const
+    {
+        return bytes_.capacity() + (pending_ ? sizeof(*pending_) + pending_->capacity() * sizeof(uint32_t) : 0);
+    }
+
+private:
+    std::vector<uint8_t> bytes_; // delta varints, or a bitmap when dense_
+    std::unique_ptr<std::vector<uint32_t>> pending_; // out-of-order ids, usually null
+    uint32_t last_ = 0; // largest id in bytes_
+    uint32_t count_ = 0;
+    uint32_t recent_ = 0;
+    bool dense_ = false;
+
+    // short lists stay varint, a bitmap only pays off once it has a few ids
+    static constexpr uint32_t kMinDenseCount = 32;
+    // recent_ after an erase, never a valid (non-negative int) id
+    static constexpr uint32_t kNoRecent = 0xFFFFFFFFu;
+
+    uint32_t readVarint(size_t& pos) const
+    {
+        uint32_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = bytes_[pos++];
+            value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+    }
+
+    static uint32_t readFirst(const PostingList& list)
+    {
+        size_t pos = 0;
+        return list.readVarint(pos);
+    }
+
+    // id must be larger than every id already in the list, which must be varint
+    void appendVarint(uint32_t id)
+    {
+        uint32_t delta = count_ == 0 ? id : id - last_;
+        while (delta >= 0x80) {
+            bytes_.push_back(static_cast<uint8_t>(delta | 0x80));
+            delta >>= 7;
+        }
+        bytes_.push_back(static_cast<uint8_t>(delta));
+        last_ = id;
+        ++count_;
+    }
+
+    // like appendVarint, then switches to a bitmap if that got smaller
+    void append(uint32_t id)
+    {
+        appendVarint(id);
+        if (count_ >= kMinDenseCount && last_ / 8 + 1 <= bytes_.size()) {
+            toBitmap();
+        }
+    }
+
+    // id must be larger than every id already in the list
+    void add(uint32_t id)
+    {
+        if (!dense_) {
+            append(id);
+            return;
+        }
+        // a far jump would blow the bitmap up, go back to varints (at most 5 bytes an id)
+        if (id / 8 + 1 > 5 * (static_cast<size_t>(count_) + 1)) {
+            toVarint();
+            append(id);
+            return;
+        }
+        setBit(id);
+    }
+
+    void setBit(uint32_t id)
+    {
+        size_t byte = id / 8;
+        if (byte >= bytes_.size()) {
+            bytes_.resize(byte + 1, 0);
+        }
+        uint8_t mask = static_cast<uint8_t>(1u << (id % 8));
+        if ((bytes_[byte] & mask) == 0) {
+            bytes_[byte] |= mask;
+            ++count_;
+            last_ = std::max(last_, id);
+        }
+    }
+
+    std::vector<uint32_t> decode() const
+    {
+        std::vector<uint32_t> ids;
+        ids.reserve(count_);
+        forEach([&](int id) { ids.push_back(static_cast<uint32_t>(id)); });
+        return ids;
+    }
+
+    // replaces the contents with sorted, unique ids
+    void assign(const std::vector<uint32_t>& ids)
+    {
+        bytes_.clear();
+        count_ = 0;
+        dense_ = false;
+        for (uint32_t id : ids) {
+            add(id);
+        }
+        bytes_.shrink_to_fit();
+    }
+
+    void toBitmap()
+    {
+        std::vector<uint32_t> ids = decode();
+        bytes_.assign(last_ / 8 + 1, 0);
+        count_ = 0;
+        dense_ = true;
+        for (uint32_t id : ids) {
+            setBit(id);
+        }
+    }
+
+    void toVarint()
+    {
+        std::vector<uint32_t> ids = decode();
+        bytes_.clear();
+        count_ = 0;
+        dense_ = false;
+        for (uint32_t id : ids) {
+            appendVarint(id);
+        }
+    }
+
+    void flushPending()
+    {
+        if (!pending_) {
+            return;
+        }
+        std::vector<uint32_t> extra = std::move(*pending_);
+        pending_.reset();
+        if (dense_) {
+            for (uint32_t id : extra) {
+                setBit(id);
+            }
+            return;
+        }
+        std::sort(extra.begin(), extra.end());
+        std::vector<uint32_t> mine = decode();
+        std::vector<uint32_t> merged;
+        merged.reserve(mine.size() + extra.size());
+        std::set_union(mine.begin(), mine.end(), extra.begin(), extra.end(), std::back_inserter(merged));
+        merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+        assign(merged);
+    }
+};
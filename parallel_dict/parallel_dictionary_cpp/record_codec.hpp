@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Word records shared by the spill runs and the multi-process shuffle. Each
+// record is
+//   varint word length, the word's bytes, varint count,
+//   varint number of books, the book ids as varint deltas
+// with nothing around it; words are never empty.
+
+inline void appendVarint(std::string& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// forEachId(fn) must call fn(uint64_t) for numIds increasing ids
+template <typename Ids>
+void appendRecord(std::string& out, std::string_view word, uint64_t count, size_t numIds, Ids&& forEachId)
+{
+    appendVarint(out, word.size());
+    out += word;
+    appendVarint(out, count);
+    appendVarint(out, numIds);
+    uint64_t last = 0;
+    forEachId([&](uint64_t id) {
+        appendVarint(out, id - last);
+        last = id;
+    });
+}
+
+// One decoded record. word points into the decoded buffer.
+struct WordRecord {
+    std::string_view word;
+    uint64_t count = 0;
+    std::vector<uint32_t> ids;
+};
+
+// false if the varint runs past the end of data or over 64 bits
+inline bool decodeVarint(std::string_view data, size_t& pos, uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; pos < data.size() && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(data[pos++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes the record at data[pos]. True with pos moved past it, false with pos
+// unchanged when data ends inside the record.
+inline bool decodeRecord(std::string_view data, size_t& pos, WordRecord& record)
+{
+    size_t at = pos;
+    uint64_t length = 0, numIds = 0;
+    if (!decodeVarint(data, at, length) || data.size() - at < length) {
+        return false;
+    }
+    record.word = data.substr(at, length);
+    at += length;
+    if (!decodeVarint(data, at, record.count) || !decodeVarint(data, at, numIds) || data.size() - at < numIds) {
+        return false;
+    }
+    record.ids.clear();
+    uint64_t id = 0;
+    for (uint64_t i = 0; i < numIds; ++i) {
+        uint64_t delta = 0;
+        if (!decodeVarint(data, at, delta)) {
+            return false;
+        }
+        id += delta;
+        record.ids.push_back(static_cast<uint32_t>(id));
+    }
+    pos = at;
+    return true;
+}
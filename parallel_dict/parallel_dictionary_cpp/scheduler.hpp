@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "compressed_book.hpp"
+
+// a book found by getAllBookFiles, its index in the list is its book id
+struct BookFile {
+    std::string path;
+    uintmax_t size = 0;
+    Compression compression = Compression::None;
+    std::vector<uint64_t> frames; // offsets of a multi-frame zstd book, the only places it can be cut
+};
+
+// A unit of work: a whole book, or a byte range of a large one. Ranges of a
+// plain book are nominal, the reader moves both ends forward to the next
+// word boundary so a word cut by a split is counted once, by the range it
+// started in. A compressed book is only cut between frames, words cut there
+// are joined through the scheduler's seams().
+struct BookTask {
+    static constexpr size_t kToEnd = SIZE_MAX;
+
+    size_t bookIndex = 0;
+    size_t begin = 0;
+    size_t end = kToEnd;
+    uintmax_t weight = 0; // bytes, used for ordering and balancing
+    size_t numRanges = 1; // the book was cut into
+};
+
+// Size-aware work stealing over a fixed set of tasks. Tasks are sorted
+// largest first and dealt to the least loaded worker, each worker takes its
+// own largest task first and steals the smallest task of another worker when
+// it runs dry, so stragglers at the end are at most one chunk long.
+class WorkStealingScheduler {
+public:
+    // books larger than chunkBytes are split into chunkBytes ranges, 0 disables
+    // splitting; compressed books into ranges of whole frames of about as many
+    // compressed bytes, if they have frames
+    WorkStealingScheduler(const std::vector<BookFile>& books, unsigned numWorkers, size_t chunkBytes)
+    {
+        std::vector<BookTask> tasks;
+        tasks.reserve(books.size());
+        for (size_t i = 0; i < books.size(); ++i) {
+            uintmax_t size = books[i].size;
+            bool compressed = books[i].compression != Compression::None;
+            if (chunkBytes == 0 || size <= chunkBytes || (compressed && books[i].frames.empty())) {
+                tasks.push_back({ i, 0, BookTask::kToEnd, size });
+                continue;
+            }
+            std::vector<uintmax_t> cuts;
+            if (compressed) {
+                for (uint64_t frame : books[i].frames) {
+                    if (frame - (cuts.empty() ? 0 : cuts.back()) >= chunkBytes) {
+                        cuts.push_back(frame);
+                    }
+                }
+            } else {
+                for (uintmax_t cut = chunkBytes; cut < size; cut += chunkBytes) {
+                    cuts.push_back(cut);
+                }
+            }
+            cuts.push_back(size);
+            uintmax_t begin = 0;
+            for (uintmax_t end : cuts) {
+                // the last range reads to eof in case the file grew since it was listed
+                size_t taskEnd = end == size ? BookTask::kToEnd : static_cast<size_t>(end);
+                tasks.push_back({ i, static_cast<size_t>(begin), taskEnd, end - begin, cuts.size() });
+                begin = end;
+            }
+            numChunks_ += cuts.size() > 1 ? cuts.size() : 0;
+        }
+        numTasks_ = tasks.size();
+
+        std::stable_sort(tasks.begin(), tasks.end(),
+            [](const BookTask& a, const BookTask& b) { return a.weight > b.weight; });
+
+        numWorkers = std::max(1u, numWorkers);
+        std::vector<uintmax_t> load(numWorkers, 0);
+        for (unsigned i = 0; i < numWorkers; ++i) {
+            queues_.emplace_back(std::make_unique<WorkerQueue>());
+        }
+        for (const BookTask& task : tasks) {
+            size_t worker = std::min_element(load.begin(), load.end()) - load.begin();
+            load[worker] += task.weight + 1; // +1 so empty files still spread out
+            queues_[worker]->tasks.push_back(task);
+        }
+    }
+
+    WorkStealingScheduler(const WorkStealingScheduler&) = delete;
+    WorkStealingScheduler& operator=(const WorkStealingScheduler&) = delete;
+
+    // next task for worker, false once every queue is empty
+    bool next(unsigned worker, BookTask& task)
+    {
+        {
+            WorkerQueue& own = *queues_[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues_.size(); ++k) {
+            WorkerQueue& victim = *queues_[(worker + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t numTasks() const { return numTasks_; }
+    size_t numChunks() const { return numChunks_; }
+
+    // joins the words cut between the frame ranges of compressed books
+    BookSeams& seams() { return seams_; }
+
+private:
+    struct WorkerQueue {
+        std::deque<BookTask> tasks;
+        std::mutex mutex;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    size_t numTasks_ = 0;
+    size_t numChunks_ = 0;
+    BookSeams seams_;
+};
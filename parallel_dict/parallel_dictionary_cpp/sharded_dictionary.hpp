@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory> // For std::unique_ptr
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "dictionary_policies.hpp"
+#include "dictionary_snapshot.hpp"
+#include "instrumentation.hpp"
+#include "posting_list.hpp"
+#include "word_table.hpp"
+
+// shard table of the default policies
+using WordTable = OpenWordTable<DictionaryEntry>;
+
+// sharding for faster speed, using open-addressing word tables. Lock is the per-shard lock
+// type, std::mutex for the shared form and NoLock for single-owner use; Hash, ShardMap and
+// Postings pick the word hash, how a hash picks its shard and the book id container (see
+// dictionary_policies.hpp). Dictionaries that differ only in Lock share shard tables, so
+// shards move between them whole.
+template <typename Lock, typename Hash = WordHash, typename ShardMap = ModuloShards, typename Postings = PostingList>
+class BasicShardedDictionary {
+public:
+    using Entry = BasicDictionaryEntry<Postings>;
+
+    // numShards is rounded up to what ShardMap supports, see numShards()
+    explicit BasicShardedDictionary(size_t numShards = 16)
+        : shardMap_(numShards)
+    {
+        for (size_t i = 0; i < shardMap_.count(); ++i) {
+            shards_.emplace_back(std::make_unique<Shard>());
+        }
+    }
+
+    // delete copy constructor and copy operator
+    BasicShardedDictionary(const BasicShardedDictionary&) = delete;
+    BasicShardedDictionary& operator=(const BasicShardedDictionary&) = delete;
+
+    // delete move constructor and move operator
+    BasicShardedDictionary(BasicShardedDictionary&&) = delete;
+    BasicShardedDictionary& operator=(BasicShardedDictionary&&) = delete;
+
+    // takes a view so callers can pass tokens straight out of a mapped file,
+    // the key string is only allocated the first time a word is seen; count
+    // adds several occurrences from the same book at once
+    void insert(std::string_view word, int bookId, int count = 1)
+    {
+        insertHashed(word, hashWord(word), bookId, count);
+    }
+
+    // the hash insertHashed and shardIndex take
+    static uint64_t hashWord(std::string_view word) { return Hash {}(word); }
+
+    // insert for callers that already hashed the word with hashWord, e.g. to
+    // bucket it by shardIndex first
+    void insertHashed(std::string_view word, uint64_t hash, int bookId, int count = 1)
+    {
+        Shard& shard = *shards_[shardMap_(hash)];
+        auto lock = lockCounted(shard.mutex, shard.stats);
+        shard.dirty = true;
+        shard.stats.inserts.add(static_cast<uint64_t>(count));
+        auto& entry = *shard.dict.tryEmplace(word, hash).first;
+        entry.wordCount += count;
+        entry.bookIds.insert(bookId);
+    }
+
+    size_t numShards() const { return shards_.size(); }
+
+    // distinct words over all shards
+    size_t numWords() const
+    {
+        size_t words = 0;
+        for (const auto& shardPtr : shards_) {
+            std::lock_guard<Lock> lock(shardPtr->mutex);
+            words += shardPtr->dict.size();
+        }
+        return words;
+    }
+
+    // counters of shard i (see instrumentation.hpp) and its current word count
+    ShardStats shardStats(size_t i) const
+    {
+        const Shard& shard = *shards_[i];
+        std::lock_guard<Lock> lock(shard.mutex);
+        ShardStats stats = shard.stats;
+        stats.words = shard.dict.size();
+        return stats;
+    }
+
+    // shard a word with this hashWord lives in
+    size_t shardIndex(uint64_t hash) const { return shardMap_(hash); }
+
+    // adds a whole entry, e.g. one read back from an index file
+    void mergeEntry(std::string_view word, int wordCount, Postings&& bookIds)
+    {
+        uint64_t hash = hashWord(word);
+        Shard& shard = *shards_[shardMap_(hash)];
+        auto lock = lockCounted(shard.mutex, shard.stats);
+        shard.dirty = true;
+        Entry entry { wordCount, std::move(bookIds) };
+        foldEntry(shard.dict, word, hash, entry);
+    }
+
+    // Takes back count occurrences of word that came from bookId, e.g. when
+    // the book is removed. The word is erased once nothing is left of it.
+    void retract(std::string_view word, int count, int bookId)
+    {
+        uint64_t hash = hashWord(word);
+        Shard& shard = *shards_[shardMap_(hash)];
+        auto lock = lockCounted(shard.mutex, shard.stats);
+        Entry* entry = shard.dict.find(word, hash);
+        if (entry == nullptr) {
+            return;
+        }
+        shard.dirty = true;
+        entry->wordCount -= count;
+        entry->bookIds.erase(bookId);
+        if (entry->wordCount <= 0 || entry->bookIds.empty()) {
+            shard.dict.erase(word, hash);
+        }
+    }
+
+    template <typename OtherLock>
+    void merge(const BasicShardedDictionary<OtherLock, Hash, ShardMap, Postings>& other)
+    {
+        for (size_t i = 0; i < other.shards_.size(); ++i) {
+            const auto& otherShard = *other.shards_[i];
+            std::lock_guard<OtherLock> lockOther(otherShard.mutex);
+            otherShard.dict.forEach([&](std::string_view word, const Entry& entry) {
+                uint64_t hash = hashWord(word);
+                Shard& thisShard = *shards_[shardMap_(hash)];
+                auto lockThis = lockCounted(thisShard.mutex, thisShard.stats);
+                thisShard.dirty = true;
+                auto& myEntry = *thisShard.dict.tryEmplace(word, hash).first;
+                myEntry.wordCount += entry.wordCount;
+                Postings copy;
+                entry.bookIds.forEach([&](int bookId) { copy.insert(bookId); });
+                myEntry.bookIds.unionWith(std::move(copy));
+            });
+        }
+    }
+
+    // Consuming merge, this is how a single-owner dictionary turns into the
+    // shared form: with the same shard count shard i folds straight into shard i,
+    // and a shard that is still empty here takes the other table over whole.
+    template <typename OtherLock>
+    void merge(BasicShardedDictionary<OtherLock, Hash, ShardMap, Postings>&& other)
+    {
+        bool sameLayout = other.shards_.size() == shards_.size();
+        for (size_t i = 0; i < other.shards_.size(); ++i) {
+            auto& otherShard = *other.shards_[i];
+            std::lock_guard<OtherLock> lockOther(otherShard.mutex);
+            if (sameLayout) {
+                Shard& thisShard = *shards_[i];
+                auto lockThis = lockCounted(thisShard.mutex, thisShard.stats);
+                thisShard.dirty = true;
+                otherShard.dirty = true;
+                std::vector<Table*> tables { &otherShard.dict };
+                foldTables(thisShard.dict, tables);
+                continue;
+            }
+            otherShard.dict.forEach([&](std::string_view word, Entry& entry) {
+                uint64_t hash = hashWord(word);
+                Shard& thisShard = *shards_[shardMap_(hash)];
+                auto lockThis = lockCounted(thisShard.mutex, thisShard.stats);
+                thisShard.dirty = true;
+                foldEntry(thisShard.dict, word, hash, entry);
+            });
+            otherShard.dict.clear();
+            otherShard.dirty = true;
+        }
+    }
+
+    // Parallel consuming merge of many dictionaries. With matching shard counts
+    // shard i of every source only ever lands in shard i here, so numThreads
+    // workers claim whole shard indices and fold them with one lock per shard
+    // instead of one per word and no re-hashing. removeSingles drops words seen
+    // once in the same pass, while the shard is still hot in cache.
+    template <typename OtherLock>
+    void mergeAll(std::vector<std::unique_ptr<BasicShardedDictionary<OtherLock, Hash, ShardMap, Postings>>>& sources,
+        unsigned numThreads, bool removeSingles)
+    {
+        for (const auto& source : sources) {
+            if (source->shards_.size() != shards_.size()) {
+                // different layout, words have to be re-hashed one at a time
+                for (auto& other : sources) {
+                    merge(std::move(*other));
+                }
+                if (removeSingles) {
+                    removeSingleOccurrences();
+                }
+                return;
+            }
+        }
+
+        std::atomic<size_t> nextShard { 0 };
+        auto worker = [&] {
+            for (size_t i = nextShard++; i < shards_.size(); i = nextShard++) {
+                Shard& thisShard = *shards_[i];
+                auto lockThis = lockCounted(thisShard.mutex, thisShard.stats);
+                thisShard.dirty = true;
+                std::vector<Table*> tables;
+                std::vector<std::unique_lock<OtherLock>> locks;
+                for (auto& source : sources) {
+                    auto& otherShard = *source->shards_[i];
+                    locks.emplace_back(otherShard.mutex);
+                    otherShard.dirty = true;
+                    tables.push_back(&otherShard.dict);
+                }
+                foldTables(thisShard.dict, tables);
+                if (removeSingles) {
+                    eraseSingles(thisShard.dict);
+                }
+            }
+        };
+
+        numThreads = static_cast<unsigned>(std::clamp<size_t>(numThreads, 1, shards_.size()));
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < numThreads; ++t) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void removeSingleOccurrences()
+    {
+        for (auto& shardPtr : shards_) {
+            Shard& shard = *shardPtr;
+            auto lock = lockCounted(shard.mutex, shard.stats);
+            shard.dirty = true;
+            eraseSingles(shard.dict);
+        }
+    }
+
+    // heap bytes held by the shard tables and their posting lists, walks
+    // every entry. Each posting list is its own small allocation, so the
+    // allocator's header for it is counted too.
+    size_t memoryBytes() const
+    {
+        constexpr size_t kAllocationOverhead = 16;
+        size_t bytes = 0;
+        for (const auto& shardPtr : shards_) {
+            const Shard& shard = *shardPtr;
+            std::lock_guard<Lock> lock(shard.mutex);
+            bytes += shard.dict.memoryBytes();
+            shard.dict.forEach([&](std::string_view, const Entry& entry) {
+                size_t postings = entry.bookIds.memoryBytes();
+                bytes += postings + (postings != 0 ? kAllocationOverhead : 0);
+            });
+        }
+        return bytes;
+    }
+
+    // drops every word but keeps the shard tables' slot arrays, for a
+    // dictionary that is filled and emptied over and over
+    void reset()
+    {
+        for (auto& shardPtr : shards_) {
+            Shard& shard = *shardPtr;
+            auto lock = lockCounted(shard.mutex, shard.stats);
+            shard.dirty = true;
+            shard.dict.reset();
+        }
+    }
+
+    // calls fn(std::string_view word, const Entry&) for every word,
+    // holding one shard lock at a time
+    template <typename Fn>
+    void forEach(Fn&& fn) const
+    {
+        for (const auto& shardPtr : shards_) {
+            const Shard& shard = *shardPtr;
+            std::lock_guard<Lock> lock(shard.mutex);
+            shard.dict.forEach(fn);
+        }
+    }
+
+    // forEach over shard i alone
+    template <typename Fn>
+    void forEachInShard(size_t i, Fn&& fn) const
+    {
+        const Shard& shard = *shards_[i];
+        std::lock_guard<Lock> lock(shard.mutex);
+        shard.dict.forEach(fn);
+    }
+
+    // drops every word of shard i and frees its table
+    void clearShard(size_t i)
+    {
+        Shard& shard = *shards_[i];
+        auto lock = lockCounted(shard.mutex, shard.stats);
+        shard.dirty = true;
+        shard.dict.clear();
+    }
+
+    // formats one shard at a time under its lock and writes it out after
+    // unlocking, so writers never wait on stdout
+    void print() const
+    {
+        std::string text;
+        for (const auto& shardPtr : shards_) {
+            const Shard& shard = *shardPtr;
+            text.clear();
+            {
+                std::lock_guard<Lock> lock(shard.mutex);
+                shard.dict.forEach([&](std::string_view word, const Entry& entry) {
+                    text += word;
+                    text += ": ";
+                    text += std::to_string(entry.wordCount);
+                    text += " times, in ";
+                    text += std::to_string(entry.bookIds.size());
+                    text += " books\n";
+                });
+            }
+            std::cout << text;
+        }
+    }
+
+    // Makes the current contents visible to snapshot() readers. Only shards
+    // written since the last publish are copied, the rest are shared with the
+    // previous snapshot. Copying takes each dirty shard's lock once; readers
+    // never take a lock, they only load the published pointer.
+    void publish()
+    {
+        static_assert(kSnapshotLayout, "snapshots find words by WordHash % shards and hold PostingLists");
+        std::lock_guard<std::mutex> publishing(publishMutex_);
+        std::shared_ptr<const DictionarySnapshot> previous = published_.load();
+        auto next = std::make_shared<DictionarySnapshot>();
+        next->version = previous ? previous->version + 1 : 1;
+        next->shards.reserve(shards_.size());
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            Shard& shard = *shards_[i];
+            auto lock = lockCounted(shard.mutex, shard.stats);
+            if (previous && !shard.dirty) {
+                next->shards.push_back(previous->shards[i]);
+                continue;
+            }
+            std::vector<ShardSnapshot::Item> items;
+            items.reserve(shard.dict.size());
+            shard.dict.forEach([&](std::string_view word, const Entry& entry) {
+                items.push_back({ std::string(word), entry });
+            });
+            shard.dirty = false;
+            next->shards.push_back(std::make_shared<const ShardSnapshot>(std::move(items)));
+        }
+        published_.store(std::move(next));
+    }
+
+    // the last published state, empty before the first publish()
+    QuerySnapshot snapshot() const
+    {
+        std::shared_ptr<const DictionarySnapshot> current = published_.load();
+        if (!current) {
+            return QuerySnapshot {};
+        }
+        return QuerySnapshot({ std::move(current) });
+    }
+
+    std::shared_ptr<const DictionarySnapshot> publishedSnapshot() const { return published_.load(); }
+
+private:
+    template <typename, typename, typename, typename>
+    friend class BasicShardedDictionary;
+
+    using Table = OpenWordTable<Entry>;
+
+    static constexpr bool kSnapshotLayout = std::is_same_v<Hash, WordHash>
+        && std::is_same_v<ShardMap, ModuloShards> && std::is_same_v<Postings, PostingList>;
+
+    struct Shard {
+        Table dict;
+        bool dirty = true; // changed since the last publish()
+        ShardStats stats;
+        mutable Lock mutex;
+    };
+
+    ShardMap shardMap_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<std::shared_ptr<const DictionarySnapshot>> published_;
+    std::mutex publishMutex_;
+
+    static void eraseSingles(Table& dict)
+    {
+        dict.eraseIf([](std::string_view, const Entry& entry) { return entry.wordCount == 1; });
+    }
+
+    // moves every entry of sources into target and empties them, the largest
+    // table is taken over whole when target is empty
+    static void foldTables(Table& target, std::vector<Table*>& sources)
+    {
+        if (target.empty() && !sources.empty()) {
+            auto largest = std::max_element(sources.begin(), sources.end(),
+                [](const Table* a, const Table* b) { return a->size() < b->size(); });
+            target.swap(**largest);
+        }
+        for (Table* source : sources) {
+            source->forEachWithHash([&](std::string_view word, uint64_t hash, Entry& entry) {
+                foldEntry(target, word, hash, entry);
+            });
+            source->clear();
+        }
+    }
+
+    static void foldEntry(Table& target, std::string_view word, uint64_t hash, Entry& entry)
+    {
+        auto [mine, inserted] = target.tryEmplace(word, hash);
+        if (inserted) {
+            *mine = std::move(entry);
+            return;
+        }
+        mine->wordCount += entry.wordCount;
+        mine->bookIds.unionWith(std::move(entry.bookIds));
+    }
+};
+
+// shared form, safe for concurrent insert/merge from any thread
+using ShardedConcurrentDictionary = BasicShardedDictionary<std::mutex>;
+
+// per-thread form for ingestion, no locking on the insert path
+using SingleOwnerDictionary = BasicShardedDictionary<NoLock>;
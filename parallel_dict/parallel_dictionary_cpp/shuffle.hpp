@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <unistd.h>
+
+#include "posting_list.hpp"
+#include "record_codec.hpp"
+
+// Wire format of the multi-process shuffle, where every worker streams the
+// words of the shards another worker reduces over a Unix domain socket. A
+// stream is a sequence of record_codec.hpp records ended by a zero word
+// length.
+
+inline void appendShuffleRecord(std::string& out, std::string_view word, int count, const PostingList& bookIds)
+{
+    appendRecord(out, word, static_cast<uint64_t>(count), bookIds.size(),
+        [&](auto&& fn) { bookIds.forEach([&](int id) { fn(static_cast<uint64_t>(id)); }); });
+}
+
+inline void appendShuffleEnd(std::string& out) { appendVarint(out, 0); }
+
+// Parses one incoming stream from the chunks read off its socket, records
+// may be split anywhere between chunks.
+class ShuffleDecoder {
+public:
+    // appends received bytes
+    void feed(const char* data, size_t size) { pending_.append(data, size); }
+
+    // calls fn(std::string_view word, int count, PostingList&& bookIds) for
+    // every complete record fed so far; true once the end of the stream has
+    // been seen
+    template <typename Fn>
+    bool drain(Fn&& fn)
+    {
+        size_t pos = 0;
+        while (!ended_ && pos < pending_.size()) {
+            if (pending_[pos] == 0) {
+                ended_ = true;
+                ++pos;
+                break;
+            }
+            if (!decodeRecord(pending_, pos, record_)) {
+                break;
+            }
+            PostingList bookIds;
+            for (uint32_t id : record_.ids) {
+                bookIds.insert(static_cast<int>(id));
+            }
+            fn(record_.word, static_cast<int>(record_.count), std::move(bookIds));
+        }
+        pending_.erase(0, pos);
+        return ended_;
+    }
+
+    bool ended() const { return ended_; }
+
+private:
+    std::string pending_;
+    bool ended_ = false;
+    WordRecord record_;
+};
+
+// writes all of data to fd, retrying short writes; false on error
+inline bool writeAll(int fd, const void* data, size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size != 0) {
+        ssize_t wrote = ::write(fd, bytes, size);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            return false;
+        }
+        bytes += wrote;
+        size -= static_cast<size_t>(wrote);
+    }
+    return true;
+}
+
+// reads exactly size bytes from fd; false on error or end of file
+inline bool readAll(int fd, void* data, size_t size)
+{
+    char* bytes = static_cast<char*>(data);
+    while (size != 0) {
+        ssize_t got = ::read(fd, bytes, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        bytes += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
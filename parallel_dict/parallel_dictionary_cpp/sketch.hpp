@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dictionary_snapshot.hpp"
+#include "word_table.hpp"
+
+// Count-Min sketch with conservative update: depth rows of width counters,
+// a word bumps the smallest of its depth counters (and any equal to it). The
+// estimate is the minimum of them, never below the true count and above it
+// by at most e * total / width with probability 1 - e^-depth. Sketches of the
+// same shape merge by adding counters. Counters are 32-bit, so one sketch
+// counts up to 4G occurrences of a word.
+class CountMinSketch {
+public:
+    CountMinSketch(size_t width, size_t depth)
+        : depth_(std::max<size_t>(depth, 1))
+    {
+        size_t w = 1;
+        while (w * 2 <= std::max<size_t>(width, 1)) {
+            w *= 2;
+        }
+        mask_ = w - 1;
+        counters_.assign(w * depth_, 0);
+    }
+
+    void add(uint64_t hash, uint32_t count = 1)
+    {
+        total_ += count;
+        uint32_t target = estimate(hash) + count;
+        for (size_t row = 0; row < depth_; ++row) {
+            uint32_t& counter = counters_[row * width() + column(hash, row)];
+            counter = std::max(counter, target);
+        }
+    }
+
+    uint32_t estimate(uint64_t hash) const
+    {
+        uint32_t best = UINT32_MAX;
+        for (size_t row = 0; row < depth_; ++row) {
+            best = std::min(best, counters_[row * width() + column(hash, row)]);
+        }
+        return best;
+    }
+
+    // other must have the same width and depth
+    void merge(const CountMinSketch& other)
+    {
+        for (size_t i = 0; i < counters_.size(); ++i) {
+            counters_[i] += other.counters_[i];
+        }
+        total_ += other.total_;
+    }
+
+    size_t width() const { return mask_ + 1; }
+    size_t depth() const { return depth_; }
+    uint64_t total() const { return total_; }
+    size_t memoryBytes() const { return counters_.capacity() * sizeof(uint32_t); }
+
+    // additive error bound of estimate(), holds with probability 1 - e^-depth
+    double errorBound() const { return 2.718281828 * static_cast<double>(total_) / static_cast<double>(width()); }
+
+private:
+    std::vector<uint32_t> counters_;
+    size_t mask_ = 0;
+    size_t depth_ = 1;
+    uint64_t total_ = 0;
+
+    // double hashing, row i probes h1 + i * h2
+    size_t column(uint64_t hash, size_t row) const
+    {
+        uint64_t h1 = hash & 0xFFFFFFFFu;
+        uint64_t h2 = (hash >> 32) | 1;
+        return static_cast<size_t>(h1 + row * h2) & mask_;
+    }
+};
+
+// Space-Saving heavy hitters: at most capacity words with a counter each. A
+// new word when full takes over the smallest counter and inherits its count
+// as error, so a tracked word's count overestimates by at most its error,
+// which is at most total / capacity. The counters are a min-heap of plain
+// structs pointing at their word's node in the index, which holds the heap
+// slot back, so sifting never looks a word up and an eviction reuses the
+// evicted word's node.
+class SpaceSaving {
+public:
+    struct Item {
+        std::string word;
+        uint64_t count = 0;
+        uint64_t error = 0;
+    };
+
+    explicit SpaceSaving(size_t capacity)
+        : capacity_(std::max<size_t>(capacity, 1))
+    {
+        heap_.reserve(capacity_);
+        index_.reserve(capacity_);
+    }
+
+    void add(std::string_view word, uint64_t count = 1)
+    {
+        auto it = index_.find(word);
+        if (it != index_.end()) {
+            heap_[it->second].count += count;
+            siftDown(it->second);
+            return;
+        }
+        if (heap_.size() < capacity_) {
+            auto entry = index_.emplace(std::string(word), heap_.size()).first;
+            heap_.push_back({ count, 0, &*entry });
+            siftUp(heap_.size() - 1);
+            return;
+        }
+        Counter& smallest = heap_[0];
+        auto node = index_.extract(index_.find(std::string_view(smallest.entry->first)));
+        node.key().assign(word);
+        smallest.entry = &*index_.insert(std::move(node)).position;
+        smallest.error = smallest.count;
+        smallest.count += count;
+        siftDown(0);
+    }
+
+    // count of a word that is not tracked is at most this
+    uint64_t minCount() const { return heap_.size() < capacity_ || heap_.empty() ? 0 : heap_[0].count; }
+
+    // counter of a tracked word
+    std::optional<uint64_t> count(std::string_view word) const
+    {
+        const Counter* counter = find(word);
+        return counter ? std::optional<uint64_t>(counter->count) : std::nullopt;
+    }
+
+    // Mergeable-summary union: a word missing from one side is assumed to
+    // have that side's minCount there, then the capacity largest are kept.
+    // Counts stay overestimates with error bounded by the combined total /
+    // capacity.
+    void merge(const SpaceSaving& other)
+    {
+        std::vector<Item> items;
+        items.reserve(heap_.size() + other.heap_.size());
+        uint64_t otherMin = other.minCount();
+        for (const Counter& mine : heap_) {
+            const Counter* theirs = other.find(mine.entry->first);
+            items.push_back({ mine.entry->first, mine.count + (theirs ? theirs->count : otherMin),
+                mine.error + (theirs ? theirs->error : otherMin) });
+        }
+        uint64_t myMin = minCount();
+        for (const Counter& theirs : other.heap_) {
+            if (find(theirs.entry->first) == nullptr) {
+                items.push_back({ theirs.entry->first, theirs.count + myMin, theirs.error + myMin });
+            }
+        }
+        if (items.size() > capacity_) {
+            std::nth_element(items.begin(), items.begin() + static_cast<std::ptrdiff_t>(capacity_), items.end(),
+                [](const Item& a, const Item& b) { return a.count > b.count; });
+            items.resize(capacity_);
+        }
+        heap_.clear();
+        index_.clear();
+        for (Item& item : items) {
+            auto entry = index_.emplace(std::move(item.word), heap_.size()).first;
+            heap_.push_back({ item.count, item.error, &*entry });
+            siftUp(heap_.size() - 1);
+        }
+    }
+
+    // the k largest counters, largest first, ties broken by word
+    std::vector<Item> top(size_t k) const
+    {
+        std::vector<Item> items;
+        items.reserve(heap_.size());
+        for (const Counter& counter : heap_) {
+            items.push_back({ counter.entry->first, counter.count, counter.error });
+        }
+        std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+            return a.count != b.count ? a.count > b.count : a.word < b.word;
+        });
+        items.resize(std::min(k, items.size()));
+        return items;
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    // approximate: counters plus the index's nodes (short words) and buckets
+    size_t memoryBytes() const { return capacity_ * kBytesPerItem; }
+
+    static constexpr size_t kBytesPerItem = 3 * sizeof(uint64_t) + sizeof(std::string) + 4 * sizeof(void*);
+
+private:
+    struct TransparentHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view key) const { return std::hash<std::string_view> {}(key); }
+    };
+
+    // word -> heap slot
+    using Index = std::unordered_map<std::string, size_t, TransparentHash, std::equal_to<>>;
+
+    struct Counter {
+        uint64_t count;
+        uint64_t error;
+        Index::value_type* entry; // nodes don't move when the index rehashes
+    };
+
+    size_t capacity_;
+    std::vector<Counter> heap_;
+    Index index_;
+
+    const Counter* find(std::string_view word) const
+    {
+        auto it = index_.find(word);
+        return it == index_.end() ? nullptr : &heap_[it->second];
+    }
+
+    void place(size_t i, const Counter& counter)
+    {
+        heap_[i] = counter;
+        counter.entry->second = i;
+    }
+
+    void siftUp(size_t i)
+    {
+        Counter counter = heap_[i];
+        while (i > 0 && heap_[(i - 1) / 2].count > counter.count) {
+            size_t parent = (i - 1) / 2;
+            place(i, heap_[parent]);
+            i = parent;
+        }
+        place(i, counter);
+    }
+
+    void siftDown(size_t i)
+    {
+        Counter counter = heap_[i];
+        for (;;) {
+            size_t child = 2 * i + 1;
+            if (child >= heap_.size()) {
+                break;
+            }
+            if (child + 1 < heap_.size() && heap_[child + 1].count < heap_[child].count) {
+                ++child;
+            }
+            if (heap_[child].count >= counter.count) {
+                break;
+            }
+            place(i, heap_[child]);
+            i = child;
+        }
+        place(i, counter);
+    }
+};
+
+// Fixed-memory stand-in for a per-thread dictionary: every word goes into a
+// Count-Min sketch for frequency estimates of any word and a Space-Saving
+// summary for the heavy hitters. Words are first counted exactly in a small
+// table and flushed into both once it holds kBatchWords words, so a frequent
+// word costs one sketch and one heavy-hitter update per batch instead of per
+// occurrence. budgetBytes is split an eighth to the batch, a quarter to the
+// heavy hitters (at least topK words, so callers check fitsTopK first) and the
+// rest to the sketch. Book ids are not kept.
+class ApproximateCounter {
+public:
+    static constexpr size_t kDepth = 4;
+    static constexpr size_t kBytesPerBatchWord = 64; // slot, hash and some arena at 3/4 load
+
+    ApproximateCounter(size_t budgetBytes, size_t topK)
+        : batchWords_(std::max<size_t>(budgetBytes / 8 / kBytesPerBatchWord, 1))
+        , heavy_(std::max(topK, heavyBytes(budgetBytes) / SpaceSaving::kBytesPerItem))
+        , sketch_((budgetBytes - std::min(budgetBytes, budgetBytes / 8 + heavy_.memoryBytes()))
+                / (kDepth * sizeof(uint32_t)),
+            kDepth)
+    {
+    }
+
+    // true if tracking topK heavy hitters stays within their share of budgetBytes
+    static bool fitsTopK(size_t budgetBytes, size_t topK)
+    {
+        return topK <= heavyBytes(budgetBytes) / SpaceSaving::kBytesPerItem;
+    }
+
+    // same signature as the dictionaries' insert so the ingest code can feed either
+    void insert(std::string_view word, int)
+    {
+        auto [count, inserted] = batch_.tryEmplace(word, WordHash {}(word));
+        ++*count;
+        if (inserted && batch_.size() >= batchWords_) {
+            flush();
+        }
+    }
+
+    // folds the batch into the sketch and heavy hitters
+    void flush()
+    {
+        batch_.forEachWithHash([&](std::string_view word, uint64_t hash, uint32_t count) {
+            sketch_.add(hash, count);
+            heavy_.add(word, count);
+        });
+        batch_.reset();
+    }
+
+    // counters from other are added in, it must have been built with the same
+    // budget; both are flushed first
+    void merge(ApproximateCounter& other)
+    {
+        flush();
+        other.flush();
+        sketch_.merge(other.sketch_);
+        heavy_.merge(other.heavy_);
+    }
+
+    // never below the true count; the smaller of the two overestimates
+    uint64_t estimate(std::string_view word) const
+    {
+        uint64_t count = sketch_.estimate(WordHash {}(word));
+        if (std::optional<uint64_t> tracked = heavy_.count(word)) {
+            count = std::min(count, *tracked);
+        }
+        return count;
+    }
+
+    // the k most frequent words by estimate, most frequent first
+    std::vector<std::pair<std::string, uint64_t>> top(size_t k) const
+    {
+        std::vector<std::pair<std::string, uint64_t>> words;
+        for (const SpaceSaving::Item& item : heavy_.top(heavy_.capacity())) {
+            words.emplace_back(item.word, estimate(item.word));
+        }
+        std::sort(words.begin(), words.end(), [](const auto& a, const auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        words.resize(std::min(k, words.size()));
+        return words;
+    }
+
+    const CountMinSketch& sketch() const { return sketch_; }
+    const SpaceSaving& heavyHitters() const { return heavy_; }
+    size_t memoryBytes() const
+    {
+        return batchWords_ * kBytesPerBatchWord + sketch_.memoryBytes() + heavy_.memoryBytes();
+    }
+
+private:
+    size_t batchWords_;
+    OpenWordTable<uint32_t> batch_;
+    SpaceSaving heavy_;
+    CountMinSketch sketch_;
+    static size_t heavyBytes(size_t budgetBytes) { return budgetBytes / 4; }
+};
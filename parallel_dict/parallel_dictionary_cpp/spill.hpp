@@ -0,0 +1,305 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dictionary_snapshot.hpp"
+#include "record_codec.hpp"
+
+// Sorted runs for out-of-core ingestion. A dictionary that outgrows its
+// memory budget is written out as a run, its words in increasing byte order,
+// and emptied; the runs are combined at the end by a streaming k-way merge
+// that holds one buffer per run and one word at a time. A run is a plain
+// sequence of record_codec.hpp records and only lives as long as the process.
+
+// Buffered append-only writer of one run file.
+class SpillRunWriter {
+public:
+    SpillRunWriter(const std::string& path, size_t bufferBytes)
+        : fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+    {
+        buffer_.reserve(std::max<size_t>(bufferBytes, 4096));
+    }
+
+    ~SpillRunWriter() { close(); }
+
+    SpillRunWriter(const SpillRunWriter&) = delete;
+    SpillRunWriter& operator=(const SpillRunWriter&) = delete;
+
+    bool isOpen() const { return fd_ >= 0; }
+
+    // ids must be increasing; words must arrive in increasing order
+    template <typename Ids>
+    void write(std::string_view word, uint64_t count, size_t numIds, Ids&& forEachId)
+    {
+        appendRecord(buffer_, word, count, numIds, forEachId);
+        if (buffer_.size() >= buffer_.capacity() / 2) {
+            flush();
+        }
+    }
+
+    // flushes and closes, false if any write failed
+    bool close()
+    {
+        if (fd_ < 0) {
+            return ok_;
+        }
+        flush();
+        ok_ = ::close(fd_) == 0 && ok_;
+        fd_ = -1;
+        return ok_;
+    }
+
+private:
+    int fd_;
+    bool ok_ = true;
+    std::string buffer_;
+
+    void flush()
+    {
+        size_t done = 0;
+        while (ok_ && fd_ >= 0 && done < buffer_.size()) {
+            ssize_t wrote = ::write(fd_, buffer_.data() + done, buffer_.size() - done);
+            if (wrote <= 0) {
+                ok_ = false;
+                break;
+            }
+            done += static_cast<size_t>(wrote);
+        }
+        buffer_.clear();
+    }
+};
+
+// Streams the records of one run file back through a buffer that holds at
+// least one whole record.
+class SpillRunReader {
+public:
+    SpillRunReader(const std::string& path, size_t bufferBytes)
+        : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC))
+        , chunk_(std::max<size_t>(bufferBytes, 4096))
+    {
+        buffer_.reserve(chunk_);
+    }
+
+    ~SpillRunReader()
+    {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    SpillRunReader(const SpillRunReader&) = delete;
+    SpillRunReader& operator=(const SpillRunReader&) = delete;
+
+    bool isOpen() const { return fd_ >= 0; }
+
+    // false once a read failed or the run ended inside a record
+    bool ok() const { return ok_; }
+
+    // loads the next record; false at the end of the run, and on an error or
+    // a truncated record, which also clear ok()
+    bool next()
+    {
+        while (ok_) {
+            if (decodeRecord(buffer_, pos_, record_)) {
+                return true;
+            }
+            if (!fill()) {
+                // the only clean end: no bytes left at a record boundary
+                ok_ = ok_ && pos_ == buffer_.size();
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // valid until the next call to next()
+    std::string_view word() const { return record_.word; }
+    uint64_t count() const { return record_.count; }
+    const std::vector<uint32_t>& ids() const { return record_.ids; }
+
+private:
+    int fd_;
+    size_t chunk_;
+    bool ok_ = true;
+    std::string buffer_;
+    size_t pos_ = 0;
+    WordRecord record_;
+
+    // appends the next chunk after the unread bytes; false at the end of the
+    // file, or on an error, which also clears ok_
+    bool fill()
+    {
+        buffer_.erase(0, pos_);
+        pos_ = 0;
+        size_t kept = buffer_.size();
+        buffer_.resize(kept + chunk_);
+        ssize_t got;
+        do {
+            got = ::read(fd_, buffer_.data() + kept, chunk_);
+        } while (got < 0 && errno == EINTR);
+        buffer_.resize(kept + static_cast<size_t>(std::max<ssize_t>(got, 0)));
+        if (got < 0) {
+            ok_ = false;
+            return false;
+        }
+        return got != 0;
+    }
+};
+
+// Writes every word of dict to path as a sorted run. dict is any dictionary
+// with forEach(fn(std::string_view, const DictionaryEntry&)).
+template <typename Dictionary>
+bool writeSpillRun(const std::string& path, const Dictionary& dict, size_t bufferBytes)
+{
+    std::vector<std::pair<std::string_view, const DictionaryEntry*>> words;
+    dict.forEach([&](std::string_view word, const DictionaryEntry& entry) { words.emplace_back(word, &entry); });
+    std::sort(words.begin(), words.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    SpillRunWriter writer(path, bufferBytes);
+    if (!writer.isOpen()) {
+        return false;
+    }
+    for (const auto& [word, entry] : words) {
+        writer.write(word, static_cast<uint64_t>(entry->wordCount), entry->bookIds.size(), [&](auto&& fn) {
+            entry->bookIds.forEach([&](int id) { fn(static_cast<uint64_t>(id)); });
+        });
+    }
+    return writer.close();
+}
+
+// K-way merge of sorted runs: calls emit(const std::string& word, uint64_t
+// count, const std::vector<uint32_t>& ids) once per distinct word in
+// increasing order, with the counts summed and the book ids unioned over all
+// runs. Memory is one buffer of bufferBytes per run plus the current word.
+// False if a run can't be opened or read, or ends inside a record; the merge
+// stops there, so emit has only seen words before the damage.
+inline bool mergeSpillRuns(const std::vector<std::string>& paths, size_t bufferBytes,
+    const std::function<void(const std::string&, uint64_t, const std::vector<uint32_t>&)>& emit)
+{
+    std::vector<std::unique_ptr<SpillRunReader>> runs;
+    for (const std::string& path : paths) {
+        runs.push_back(std::make_unique<SpillRunReader>(path, bufferBytes));
+        if (!runs.back()->isOpen()) {
+            return false;
+        }
+    }
+    auto later = [&](size_t a, size_t b) { return runs[a]->word() > runs[b]->word(); };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heads(later);
+    // next record of a run back into the heap; false if the run is damaged
+    auto advance = [&](size_t run) {
+        if (runs[run]->next()) {
+            heads.push(run);
+        }
+        return runs[run]->ok();
+    };
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (!advance(i)) {
+            return false;
+        }
+    }
+    std::string word;
+    uint64_t count = 0;
+    std::vector<uint32_t> ids, merged;
+    while (!heads.empty()) {
+        size_t run = heads.top();
+        heads.pop();
+        word = runs[run]->word();
+        count = runs[run]->count();
+        ids = runs[run]->ids();
+        if (!advance(run)) {
+            return false;
+        }
+        // every other run holding the same word is at the top now
+        while (!heads.empty() && runs[heads.top()]->word() == word) {
+            size_t other = heads.top();
+            heads.pop();
+            count += runs[other]->count();
+            merged.clear();
+            std::set_union(ids.begin(), ids.end(), runs[other]->ids().begin(), runs[other]->ids().end(),
+                std::back_inserter(merged));
+            ids.swap(merged);
+            if (!advance(other)) {
+                return false;
+            }
+        }
+        emit(word, count, ids);
+    }
+    return true;
+}
+
+// Private temporary directory for one run's spill files, removed with
+// everything in it on destruction. Thread safe.
+class SpillDirectory {
+public:
+    explicit SpillDirectory(const std::string& parent)
+    {
+        std::string pattern = parent + "/pd_spill.XXXXXX";
+        std::vector<char> path(pattern.begin(), pattern.end());
+        path.push_back('\0');
+        if (::mkdtemp(path.data()) != nullptr) {
+            path_ = path.data();
+        }
+    }
+
+    ~SpillDirectory()
+    {
+        for (const std::string& run : allRuns_) {
+            ::unlink(run.c_str());
+        }
+        if (!path_.empty()) {
+            ::rmdir(path_.c_str());
+        }
+    }
+
+    SpillDirectory(const SpillDirectory&) = delete;
+    SpillDirectory& operator=(const SpillDirectory&) = delete;
+
+    bool isOpen() const { return !path_.empty(); }
+    const std::string& path() const { return path_; }
+
+    // a fresh file name for a run, not yet among runs()
+    std::string newRunPath()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string run = path_ + "/run" + std::to_string(allRuns_.size()) + ".bin";
+        allRuns_.push_back(run);
+        return run;
+    }
+
+    // adds a finished run to the ones waiting to be merged
+    void addRun(const std::string& run)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        runs_.push_back(run);
+    }
+
+    // takes the waiting runs, oldest first
+    std::vector<std::string> takeRuns()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::exchange(runs_, {});
+    }
+
+    // deletes a run that has been merged into another
+    void removeRun(const std::string& run) { ::unlink(run.c_str()); }
+
+private:
+    std::string path_;
+    std::mutex mutex_;
+    std::vector<std::string> allRuns_;
+    std::vector<std::string> runs_;
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PD_TOKENIZER_X86 1
+#endif
+
+// Helper function to split a string into words without modifying the input.
+// This is the original byte-at-a-time tokenizer, kept as the reference the
+// kernels below are checked and benchmarked against.
+inline std::vector<std::string> splitToWords(const std::string& text)
+{
+    std::vector<std::string> words;
+    words.reserve(text.size() / 5); // Assuming average word length of 5
+    size_t pos = 0, length = text.length();
+    while (pos < length) {
+        // Skip non-alphabetic characters
+        while (pos < length && !std::isalpha(static_cast<unsigned char>(text[pos])))
+            ++pos;
+        size_t start = pos;
+        // Collect alphabetic characters
+        while (pos < length && std::isalpha(static_cast<unsigned char>(text[pos]))) {
+            ++pos;
+        }
+        if (start < pos) {
+            // Extract the word and convert to lowercase
+            std::string word = text.substr(start, pos - start);
+            std::transform(word.begin(), word.end(), word.begin(),
+                [](unsigned char c) { return std::tolower(c); });
+            words.emplace_back(std::move(word));
+        }
+    }
+    return words;
+}
+
+// a word inside a tokenized chunk, offsets index the lowercased output buffer
+struct WordSpan {
+    uint32_t start;
+    uint32_t length;
+};
+
+// Lowercases length bytes of text into out and appends the span of every
+// word. A word is a run of ASCII letters, matching std::isalpha in the "C"
+// locale. out must have room for length bytes.
+using TokenizeKernel = void (*)(const char* text, size_t length, char* out, std::vector<WordSpan>& words);
+
+inline bool isAsciiLetter(unsigned char c)
+{
+    return static_cast<unsigned char>((c | 0x20) - 'a') < 26;
+}
+
+inline void tokenizeScalar(const char* text, size_t length, char* out, std::vector<WordSpan>& words)
+{
+    size_t pos = 0;
+    while (pos < length) {
+        while (pos < length && !isAsciiLetter(static_cast<unsigned char>(text[pos]))) {
+            out[pos] = text[pos];
+            ++pos;
+        }
+        size_t start = pos;
+        while (pos < length && isAsciiLetter(static_cast<unsigned char>(text[pos]))) {
+            out[pos] = static_cast<char>(text[pos] | 0x20);
+            ++pos;
+        }
+        if (start < pos) {
+            words.push_back({ static_cast<uint32_t>(start), static_cast<uint32_t>(pos - start) });
+        }
+    }
+}
+
+#ifdef PD_TOKENIZER_X86
+// Classifies 32 bytes at a time into a letter bitmask, lowercases the block
+// with the same compare results and walks the letter/non-letter transitions
+// of the mask to find word boundaries.
+__attribute__((target("avx2"))) inline void tokenizeAvx2(const char* text, size_t length, char* out,
+    std::vector<WordSpan>& words)
+{
+    const __m256i upperA = _mm256_set1_epi8('A');
+    const __m256i lowerA = _mm256_set1_epi8('a');
+    const __m256i range = _mm256_set1_epi8(25);
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+
+    uint32_t prevLetter = 0; // 1 if the byte before the current block was a letter
+    size_t wordStart = 0;
+    size_t pos = 0;
+    char tail[32];
+
+    while (pos < length) {
+        const char* src = text + pos;
+        size_t blockLength = std::min<size_t>(32, length - pos);
+        if (blockLength < 32) {
+            // zero padding is non-letter, so it also closes a word at the end
+            std::memset(tail, 0, sizeof(tail));
+            std::memcpy(tail, src, blockLength);
+            src = tail;
+        }
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+
+        // unsigned (c - 'A') <= 25  <=>  min(c - 'A', 25) == c - 'A'
+        __m256i upperOffset = _mm256_sub_epi8(bytes, upperA);
+        __m256i isUpper = _mm256_cmpeq_epi8(_mm256_min_epu8(upperOffset, range), upperOffset);
+        __m256i lowerOffset = _mm256_sub_epi8(bytes, lowerA);
+        __m256i isLower = _mm256_cmpeq_epi8(_mm256_min_epu8(lowerOffset, range), lowerOffset);
+
+        __m256i lowered = _mm256_or_si256(bytes, _mm256_and_si256(isUpper, caseBit));
+        uint32_t letters = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(isUpper, isLower)));
+
+        if (blockLength == 32) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + pos), lowered);
+        } else {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(tail), lowered);
+            std::memcpy(out + pos, tail, blockLength);
+        }
+
+        // a set bit marks a byte whose letter-ness differs from the byte before it
+        uint32_t transitions = letters ^ ((letters << 1) | prevLetter);
+        while (transitions != 0) {
+            size_t at = pos + static_cast<size_t>(__builtin_ctz(transitions));
+            if ((letters >> (at - pos)) & 1u) {
+                wordStart = at;
+            } else {
+                words.push_back({ static_cast<uint32_t>(wordStart), static_cast<uint32_t>(at - wordStart) });
+            }
+            transitions &= transitions - 1;
+        }
+        prevLetter = letters >> 31;
+        pos += blockLength;
+    }
+    if (prevLetter != 0) {
+        words.push_back({ static_cast<uint32_t>(wordStart), static_cast<uint32_t>(length - wordStart) });
+    }
+}
+#endif
+
+// picks the widest kernel the running cpu supports
+inline TokenizeKernel selectTokenizeKernel()
+{
+#ifdef PD_TOKENIZER_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return tokenizeAvx2;
+    }
+#endif
+    return tokenizeScalar;
+}
+
+// Reusable per-thread tokenizer. Text is processed in chunks cut after a
+// non-letter so words never straddle a chunk, the lowercased chunk lives in
+// buffer_ and words are handed out as views into it.
+class WordTokenizer {
+public:
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    explicit WordTokenizer(TokenizeKernel kernel = selectTokenizeKernel())
+        : kernel_(kernel)
+    {
+    }
+
+    // calls fn(std::string_view) with every lowercased word of text, views
+    // are only valid for the duration of the call
+    template <typename Fn>
+    void forEachWord(std::string_view text, Fn&& fn)
+    {
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = std::min(text.size(), pos + kChunkSize);
+            // extend to the end of a word cut by the chunk boundary
+            while (end < text.size() && isAsciiLetter(static_cast<unsigned char>(text[end]))) {
+                ++end;
+            }
+            size_t length = end - pos;
+            if (buffer_.size() < length) {
+                buffer_.resize(length);
+            }
+            words_.clear();
+            kernel_(text.data() + pos, length, buffer_.data(), words_);
+            for (const WordSpan& span : words_) {
+                fn(std::string_view(buffer_.data() + span.start, span.length));
+            }
+            pos = end;
+        }
+    }
+
+private:
+    TokenizeKernel kernel_;
+    std::string buffer_;
+    std::vector<WordSpan> words_;
+};
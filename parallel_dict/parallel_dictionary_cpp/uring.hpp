@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Minimal io_uring ring over the raw syscalls, so there is no liburing
+// dependency. Callers fill submission entries from nextSqe(), submit() hands
+// them to the kernel (optionally waiting for completions) and
+// popCompletion() reaps finished ones. Not thread safe, one ring per thread.
+// A ring can set up fine on a kernel that rejects some opcodes, so callers
+// check supports() for each one they use.
+class IoUring {
+public:
+    explicit IoUring(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            return; // no io_uring in this kernel, or it is disabled
+        }
+        fd_ = fd;
+        sqRingBytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingBytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap) {
+            sqRingBytes_ = cqRingBytes_ = std::max(sqRingBytes_, cqRingBytes_);
+        }
+        sqRing_ = ::mmap(nullptr, sqRingBytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        cqRing_ = singleMap ? sqRing_
+                            : ::mmap(nullptr, cqRingBytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                                IORING_OFF_CQ_RING);
+        sqesBytes_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = ::mmap(nullptr, sqesBytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes != MAP_FAILED) {
+            sqes_ = static_cast<io_uring_sqe*>(sqes);
+        }
+        if (sqRing_ == MAP_FAILED || cqRing_ == MAP_FAILED || sqes_ == nullptr) {
+            close();
+            return;
+        }
+        char* sq = static_cast<char*>(sqRing_);
+        sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqEntries_ = params.sq_entries;
+        sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cqRing_);
+        cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        open_ = true;
+        probe();
+    }
+
+    ~IoUring() { close(); }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool isOpen() const { return open_; }
+
+    // false for opcodes the kernel would fail with -EINVAL, and for every
+    // opcode on kernels before 5.6, which can't be probed
+    bool supports(unsigned opcode) const { return opcode < supported_.size() && supported_[opcode]; }
+
+    // a zeroed submission entry, null if the submission queue is full
+    io_uring_sqe* nextSqe()
+    {
+        unsigned head = std::atomic_ref<unsigned>(*sqHead_).load(std::memory_order_acquire);
+        if (localTail_ - head >= sqEntries_) {
+            return nullptr;
+        }
+        unsigned index = localTail_ & sqMask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray_[index] = index;
+        ++localTail_;
+        return sqe;
+    }
+
+    // submits everything prepared and waits for at least waitFor completions,
+    // returns the syscall's result (negative errno on failure)
+    int submit(unsigned waitFor = 0)
+    {
+        unsigned toSubmit = localTail_ - std::atomic_ref<unsigned>(*sqTail_).load(std::memory_order_relaxed);
+        std::atomic_ref<unsigned>(*sqTail_).store(localTail_, std::memory_order_release);
+        if (toSubmit == 0 && waitFor == 0) {
+            return 0;
+        }
+        long result = ::syscall(__NR_io_uring_enter, fd_, toSubmit, waitFor, waitFor != 0 ? IORING_ENTER_GETEVENTS : 0,
+            nullptr, 0);
+        return result < 0 ? -errno : static_cast<int>(result);
+    }
+
+    // reaps one completion, false if none is ready
+    bool popCompletion(io_uring_cqe& cqe)
+    {
+        unsigned head = std::atomic_ref<unsigned>(*cqHead_).load(std::memory_order_relaxed);
+        if (head == std::atomic_ref<unsigned>(*cqTail_).load(std::memory_order_acquire)) {
+            return false;
+        }
+        cqe = cqes_[head & cqMask_];
+        std::atomic_ref<unsigned>(*cqHead_).store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    int fd_ = -1;
+    bool open_ = false;
+    void* sqRing_ = MAP_FAILED;
+    void* cqRing_ = MAP_FAILED;
+    size_t sqRingBytes_ = 0;
+    size_t cqRingBytes_ = 0;
+    size_t sqesBytes_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqArray_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    unsigned localTail_ = 0; // prepared but maybe not yet published to the kernel
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    std::bitset<256> supported_;
+
+    void probe()
+    {
+        constexpr size_t maxOps = 256;
+        std::vector<char> bytes(sizeof(io_uring_probe) + maxOps * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(bytes.data());
+        if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, maxOps) < 0) {
+            return;
+        }
+        for (size_t i = 0; i < probe->ops_len && i < maxOps; ++i) {
+            if ((probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0) {
+                supported_.set(probe->ops[i].op);
+            }
+        }
+    }
+
+    void close()
+    {
+        if (sqes_ != nullptr) {
+            ::munmap(sqes_, sqesBytes_);
+        }
+        if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+            ::munmap(cqRing_, cqRingBytes_);
+        }
+        if (sqRing_ != MAP_FAILED) {
+            ::munmap(sqRing_, sqRingBytes_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        sqes_ = nullptr;
+        sqRing_ = cqRing_ = MAP_FAILED;
+        fd_ = -1;
+        open_ = false;
+    }
+};
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Bump allocator for key bytes. Storage is only released when the arena is
+// destroyed, erased keys stay behind until then.
+class StringArena {
+public:
+    static constexpr size_t kBlockSize = 64 * 1024;
+
+    std::string_view store(std::string_view text)
+    {
+        if (text.size() > kBlockSize / 4) {
+            // big keys get their own block so they don't waste the current one
+            blocks_.emplace_back(std::make_unique<char[]>(text.size()));
+            std::memcpy(blocks_.back().get(), text.data(), text.size());
+            bytes_ += text.size();
+            return { blocks_.back().get(), text.size() };
+        }
+        if (blocks_.empty() || used_ + text.size() > kBlockSize) {
+            blocks_.emplace_back(std::make_unique<char[]>(kBlockSize));
+            current_ = blocks_.back().get();
+            used_ = 0;
+            bytes_ += kBlockSize;
+        }
+        char* out = current_ + used_;
+        std::memcpy(out, text.data(), text.size());
+        used_ += text.size();
+        return { out, text.size() };
+    }
+
+    size_t memoryBytes() const { return bytes_; }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* current_ = nullptr;
+    size_t used_ = 0;
+    size_t bytes_ = 0;
+};
+
+// Open-addressing hash table from words to Value, used as the per-shard table.
+//
+// Probing is linear over a dense array of 64-bit hashes (0 marks an empty
+// slot), so a miss or a hit usually touches one cache line of hashes and one
+// slot. Keys up to kInlineKey bytes live in the slot, longer ones in the
+// table's StringArena. Lookups take a string_view plus the caller's hash, so
+// the dictionary hashes a word once for both the shard and the slot. Erase
+// uses backward-shift deletion, there are no tombstones.
+//
+// Views returned for keys stay valid until the next insert or erase.
+template <typename Value>
+class OpenWordTable {
+public:
+    static constexpr size_t kInlineKey = 15;
+
+    OpenWordTable() = default;
+
+    OpenWordTable(OpenWordTable&& other) noexcept
+    {
+        swap(other);
+    }
+
+    OpenWordTable& operator=(OpenWordTable&& other) noexcept
+    {
+        OpenWordTable moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+
+    OpenWordTable(const OpenWordTable&) = delete;
+    OpenWordTable& operator=(const OpenWordTable&) = delete;
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    Value* find(std::string_view key, uint64_t hash)
+    {
+        if (size_ == 0) {
+            return nullptr;
+        }
+        hash = storedHash(hash);
+        for (size_t i = home(hash);; i = (i + 1) & mask_) {
+            if (hashes_[i] == 0) {
+                return nullptr;
+            }
+            if (hashes_[i] == hash && slots_[i].key() == key) {
+                return &slots_[i].value;
+            }
+        }
+    }
+
+    const Value* find(std::string_view key, uint64_t hash) const
+    {
+        return const_cast<OpenWordTable*>(this)->find(key, hash);
+    }
+
+    // value for key, default constructed and inserted if missing; the bool is
+    // true if it was inserted
+    std::pair<Value*, bool> tryEmplace(std::string_view key, uint64_t hash)
+    {
+        if ((size_ + 1) * 4 > hashes_.size() * 3) {
+            rehash(std::max<size_t>(16, hashes_.size() * 2));
+        }
+        hash = storedHash(hash);
+        size_t i = home(hash);
+        for (; hashes_[i] != 0; i = (i + 1) & mask_) {
+            if (hashes_[i] == hash && slots_[i].key() == key) {
+                return { &slots_[i].value, false };
+            }
+        }
+        hashes_[i] = hash;
+        slots_[i].setKey(key, arena_);
+        slots_[i].value = Value {};
+        ++size_;
+        return { &slots_[i].value, true };
+    }
+
+    // calls fn(std::string_view word, Value&) for every entry
+    template <typename Fn>
+    void forEach(Fn&& fn)
+    {
+        for (size_t i = 0; i < hashes_.size(); ++i) {
+            if (hashes_[i] != 0) {
+                fn(slots_[i].key(), slots_[i].value);
+            }
+        }
+    }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const
+    {
+        for (size_t i = 0; i < hashes_.size(); ++i) {
+            if (hashes_[i] != 0) {
+                fn(slots_[i].key(), static_cast<const Value&>(slots_[i].value));
+            }
+        }
+    }
+
+    // like forEach, but also passes the stored hash so entries can be moved
+    // to another table without hashing the key again
+    template <typename Fn>
+    void forEachWithHash(Fn&& fn)
+    {
+        for (size_t i = 0; i < hashes_.size(); ++i) {
+            if (hashes_[i] != 0) {
+                fn(slots_[i].key(), hashes_[i], slots_[i].value);
+            }
+        }
+    }
+
+    // erases key, returns whether it was there
+    bool erase(std::string_view key, uint64_t hash)
+    {
+        if (size_ == 0) {
+            return false;
+        }
+        hash = storedHash(hash);
+        for (size_t i = home(hash); hashes_[i] != 0; i = (i + 1) & mask_) {
+            if (hashes_[i] == hash && slots_[i].key() == key) {
+                eraseSlot(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // erases every entry for which pred(std::string_view, const Value&) is true
+    template <typename Pred>
+    void eraseIf(Pred&& pred)
+    {
+        if (size_ == 0) {
+            return;
+        }
+        // start right after an empty slot so no probe run wraps past the
+        // start, then backward shifts never move an entry we already visited
+        size_t start = 0;
+        while (hashes_[start] != 0) {
+            ++start;
+        }
+        size_t i = (start + 1) & mask_;
+        for (size_t visited = 0; visited < hashes_.size(); ++visited) {
+            while (hashes_[i] != 0 && pred(slots_[i].key(), static_cast<const Value&>(slots_[i].value))) {
+                eraseSlot(i); // pulls the next entry of the run into i, check it too
+            }
+            i = (i + 1) & mask_;
+        }
+    }
+
+    void clear()
+    {
+        OpenWordTable empty;
+        swap(empty);
+    }
+
+    // like clear, but keeps the slot arrays for a table that is refilled over
+    // and over
+    void reset()
+    {
+        for (size_t i = 0; i < hashes_.size(); ++i) {
+            if (hashes_[i] != 0) {
+                hashes_[i] = 0;
+                slots_[i].value = Value {};
+            }
+        }
+        arena_ = StringArena {};
+        size_ = 0;
+    }
+
+    void swap(OpenWordTable& other) noexcept
+    {
+        std::swap(hashes_, other.hashes_);
+        std::swap(slots_, other.slots_);
+        std::swap(arena_, other.arena_);
+        std::swap(mask_, other.mask_);
+        std::swap(size_, other.size_);
+    }
+
+    // heap bytes of the slot arrays and arena, values' own allocations excluded
+    size_t memoryBytes() const
+    {
+        return hashes_.capacity() * sizeof(uint64_t) + slots_.capacity() * sizeof(Slot) + arena_.memoryBytes();
+    }
+
+private:
+    struct Slot {
+        uint32_t length = 0;
+        union {
+            char inlineKey[kInlineKey + 1];
+            const char* arenaKey;
+        };
+        Value value;
+
+        Slot() { }
+
+        std::string_view key() const
+        {
+            return { length <= kInlineKey ? inlineKey : arenaKey, length };
+        }
+
+        void setKey(std::string_view text, StringArena& arena)
+        {
+            length = static_cast<uint32_t>(text.size());
+            if (text.size() <= kInlineKey) {
+                std::memcpy(inlineKey, text.data(), text.size());
+            } else {
+                arenaKey = arena.store(text).data();
+            }
+        }
+
+        // the key bytes are either inline or owned by the arena, both copy as-is
+        void moveFrom(Slot& other)
+        {
+            length = other.length;
+            std::memcpy(inlineKey, other.inlineKey, sizeof(inlineKey));
+            value = std::move(other.value);
+        }
+    };
+
+    std::vector<uint64_t> hashes_;
+    std::vector<Slot> slots_;
+    StringArena arena_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+
+    static uint64_t storedHash(uint64_t hash) { return hash == 0 ? 1 : hash; }
+
+    // Fibonacci hashing, so tables inside one shard don't probe on the same low
+    // bits the shard index was taken from
+    size_t home(uint64_t hash) const
+    {
+        return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> 32) & mask_;
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<uint64_t> oldHashes(capacity, 0);
+        std::vector<Slot> oldSlots(capacity);
+        oldHashes.swap(hashes_);
+        oldSlots.swap(slots_);
+        mask_ = capacity - 1;
+        for (size_t j = 0; j < oldHashes.size(); ++j) {
+            if (oldHashes[j] == 0) {
+                continue;
+            }
+            size_t i = home(oldHashes[j]);
+            while (hashes_[i] != 0) {
+                i = (i + 1) & mask_;
+            }
+            hashes_[i] = oldHashes[j];
+            slots_[i].moveFrom(oldSlots[j]);
+        }
+    }
+
+    void eraseSlot(size_t hole)
+    {
+        for (size_t j = (hole + 1) & mask_; hashes_[j] != 0; j = (j + 1) & mask_) {
+            // move j into the hole unless its home lies cyclically in (hole, j]
+            size_t h = home(hashes_[j]);
+            bool homeBetween = hole <= j ? (hole < h && h <= j) : (hole < h || h <= j);
+            if (!homeBetween) {
+                hashes_[hole] = hashes_[j];
+                slots_[hole].moveFrom(slots_[j]);
+                hole = j;
+            }
+        }
+        hashes_[hole] = 0;
+        slots_[hole].value = Value {};
+        --size_;
+    }
+};